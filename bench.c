@@ -0,0 +1,580 @@
+/*
+ * Throughput benchmarks over a generated corpus.
+ *
+ *   ./bench [--json] [corpus...]
+ *
+ * Every row reports MB/s of JSON text, ns per node of the parsed tree and
+ * heap allocations (malloc/calloc/realloc calls) per document. --json prints
+ * one JSON object per row for regression tracking.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <time.h>
+#include "json_parser.h"
+
+#define BENCH_MIN_TIME 0.2
+#define BENCH_THREADS 4
+
+/* Linked with -Wl,--wrap=malloc,... so library allocations can be counted. */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+static size_t allocs = 0;
+
+#define COUNT_ALLOC() __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED)
+void *__wrap_malloc(size_t size) { COUNT_ALLOC(); return __real_malloc(size); }
+void *__wrap_calloc(size_t n, size_t size) { COUNT_ALLOC(); return __real_calloc(n, size); }
+void *__wrap_realloc(void *p, size_t size) { COUNT_ALLOC(); return __real_realloc(p, size); }
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct {
+    char *s;
+    size_t len, cap;
+} buffer;
+
+static void append(buffer *b, const char *format, ...) {
+    va_list ap;
+    int n;
+
+    for ( ; ; ) {
+        va_start(ap, format);
+        n = vsnprintf(b->s + b->len, b->cap - b->len, format, ap);
+        va_end(ap);
+        if (b->len + n < b->cap)
+            break;
+        b->cap = (b->cap + n) * 2;
+        b->s = realloc(b->s, b->cap);
+    }
+    b->len += n;
+}
+
+static unsigned long long rng;
+
+static unsigned long long next() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static double uniform(double lo, double hi) {
+    return lo + (hi - lo) * (next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static const char *words[] = {
+    "lorem", "ipsum", "caf\\u00e9", "na\\u00efve", "\\u6f22\\u5b57", "tab\\there", "quote\\\"d",
+    "slash\\/", "emoji\\ud83d\\ude00", "line\\nbreak", "plain", "text", "json", "parser"
+};
+
+static void append_text(buffer *b, int nwords) {
+    int i;
+
+    append(b, "\"");
+    for (i = 0; i < nwords; i++)
+        append(b, "%s%s", i ? " " : "", words[next() % (sizeof(words) / sizeof(words[0]))]);
+    append(b, "\"");
+}
+
+static void gen_numbers(buffer *b) {
+    int i;
+
+    append(b, "[");
+    for (i = 0; i < 100000; i++)
+        append(b, i % 3 == 0 ? "%s%.17g" : i % 3 == 1 ? "%s%.6f" : "%s%.0f",
+            i ? "," : "", uniform(-1e6, 1e6));
+    append(b, "]");
+}
+
+static void gen_strings(buffer *b) {
+    int i;
+
+    append(b, "[");
+    for (i = 0; i < 20000; i++) {
+        append(b, i ? "," : "");
+        append_text(b, 1 + next() % 12);
+    }
+    append(b, "]");
+}
+
+static void gen_nested(buffer *b) {
+    int i, d;
+
+    append(b, "[");
+    for (i = 0; i < 500; i++) {
+        append(b, i ? "," : "");
+        for (d = 0; d < 100; d++)
+            append(b, d % 2 ? "{\"k\":" : "[");
+        append(b, "%d", i);
+        for (d = 99; d >= 0; d--)
+            append(b, d % 2 ? "}" : "]");
+    }
+    append(b, "]");
+}
+
+static void gen_wide(buffer *b) {
+    int i;
+
+    append(b, "{");
+    for (i = 0; i < 50000; i++)
+        append(b, "%s\"key_%d\":%s", i ? "," : "", i,
+            i % 4 == 0 ? "true" : i % 4 == 1 ? "\"value\"" : i % 4 == 2 ? "null" : "42");
+    append(b, "}");
+}
+
+/* GeoJSON polygons: mostly arrays of coordinate pairs. */
+static void gen_canada(buffer *b) {
+    int r, i;
+
+    append(b, "{\"type\":\"FeatureCollection\",\"features\":[{\"type\":\"Feature\","
+        "\"properties\":{\"name\":\"Canada\"},\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[");
+    for (r = 0; r < 100; r++) {
+        append(b, "%s[", r ? "," : "");
+        for (i = 0; i < 1000; i++)
+            append(b, "%s[%.15g,%.15g]", i ? "," : "", uniform(-141, -52), uniform(41, 83));
+        append(b, "]");
+    }
+    append(b, "]}}]}");
+}
+
+/* Social media statuses: strings, nested users and many small objects. */
+static void gen_twitter(buffer *b) {
+    int i;
+
+    append(b, "{\"statuses\":[");
+    for (i = 0; i < 2000; i++) {
+        append(b, "%s{\"metadata\":{\"result_type\":\"recent\",\"iso_language_code\":\"ja\"},"
+            "\"created_at\":\"Sun Aug 31 00:29:15 +0000 2014\",\"id\":%llu,\"id_str\":\"%llu\",\"text\":",
+            i ? "," : "", next() >> 10, next() >> 10);
+        append_text(b, 10);
+        append(b, ",\"truncated\":false,\"in_reply_to_status_id\":null,\"user\":{\"id\":%d,"
+            "\"name\":", (int) (next() % 100000000));
+        append_text(b, 2);
+        append(b, ",\"screen_name\":\"user%d\",\"description\":", i);
+        append_text(b, 8);
+        append(b, ",\"followers_count\":%d,\"friends_count\":%d,\"verified\":false,"
+            "\"profile_background_color\":\"C0DEED\",\"default_profile\":true},"
+            "\"entities\":{\"hashtags\":[{\"text\":\"tag\",\"indices\":[%d,%d]}],\"urls\":[],"
+            "\"user_mentions\":[]},\"retweet_count\":%d,\"favorited\":false,\"lang\":\"ja\"}",
+            (int) (next() % 5000), (int) (next() % 5000), i % 50, i % 50 + 4, (int) (next() % 100));
+    }
+    append(b, "],\"search_metadata\":{\"completed_in\":0.087,\"max_id\":505874924095815681,\"count\":100}}");
+}
+
+/* Event catalogue: id-keyed maps and arrays of integers. */
+static void gen_citm(buffer *b) {
+    int i, j;
+
+    append(b, "{\"areaNames\":{");
+    for (i = 0; i < 2000; i++)
+        append(b, "%s\"%d\":\"Arri\\u00e8re-sc\\u00e8ne %d\"", i ? "," : "", 205705993 + i, i);
+    append(b, "},\"events\":{");
+    for (i = 0; i < 2000; i++)
+        append(b, "%s\"%d\":{\"description\":null,\"id\":%d,\"logo\":null,\"name\":\"Event %d\","
+            "\"subTopicIds\":[337184269,337184283],\"subjectCode\":null,\"subtitle\":null,"
+            "\"topicIds\":[324846099,107888604]}", i ? "," : "", 138586341 + i, 138586341 + i, i);
+    append(b, "},\"performances\":[");
+    for (i = 0; i < 2000; i++) {
+        append(b, "%s{\"eventId\":%d,\"id\":%d,\"logo\":null,\"name\":null,\"prices\":[",
+            i ? "," : "", 138586341 + i, 339887544 + i);
+        for (j = 0; j < 6; j++)
+            append(b, "%s{\"amount\":%d,\"audienceSubCategoryId\":337100890,\"seatCategoryId\":%d}",
+                j ? "," : "", 90250 - j * 1000, 338937295 + j);
+        append(b, "],\"seatCategories\":[{\"areas\":[{\"areaId\":205705999,\"blockIds\":[]}],"
+            "\"seatCategoryId\":338937295}],\"seatMapImage\":null,\"start\":%lld,"
+            "\"venueCode\":\"PLEYEL_PLEYEL\"}", 1372701600000LL + i * 86400000LL);
+    }
+    append(b, "]}");
+}
+
+/* The fields an application reads from the twitter corpus. */
+typedef struct {
+    int id, followers_count;
+    char *screen_name;
+} tw_user;
+
+typedef struct {
+    long long id;
+    char *text;
+    int retweet_count;
+    tw_user user;
+} tw_status;
+
+typedef struct {
+    json_field_array statuses;
+    struct { int count; } search_metadata;
+} tw_search;
+
+static json_schema tw_user_schema, tw_status_schema, tw_search_meta_schema, tw_search_schema;
+static const json_field tw_user_fields[] = {
+    { "id",              offsetof(tw_user, id),              JSON_FIELD_INT },
+    { "followers_count", offsetof(tw_user, followers_count), JSON_FIELD_INT },
+    { "screen_name",     offsetof(tw_user, screen_name),     JSON_FIELD_STRING },
+};
+static const json_field tw_status_fields[] = {
+    { "id",              offsetof(tw_status, id),            JSON_FIELD_INT64 },
+    { "text",            offsetof(tw_status, text),          JSON_FIELD_STRING },
+    { "retweet_count",   offsetof(tw_status, retweet_count), JSON_FIELD_INT },
+    { "user",            offsetof(tw_status, user),          JSON_FIELD_OBJECT, 0, &tw_user_schema },
+};
+static const json_field tw_search_meta_fields[] = {
+    { "count",           0,                                  JSON_FIELD_INT },
+};
+static const json_field tw_search_fields[] = {
+    { "statuses",        offsetof(tw_search, statuses),      JSON_FIELD_ARRAY, JSON_FIELD_OBJECT, &tw_status_schema },
+    { "search_metadata", offsetof(tw_search, search_metadata), JSON_FIELD_OBJECT, 0, &tw_search_meta_schema },
+};
+
+static char *dup_string(const json_value *v) {
+    char *s = malloc(json_get_string_length(v) + 1);
+    memcpy(s, json_get_string(v), json_get_string_length(v) + 1);
+    return s;
+}
+
+/* What applications do without a schema: parse a tree, copy fields out, free it. */
+static void tw_search_from_dom(tw_search *out, const char *json) {
+    json_value v, *statuses, *e, *user;
+    tw_status *st;
+    size_t i;
+
+    json_init(&v);
+    json_parse(&v, json);
+    memset(out, 0, sizeof(*out));
+    statuses = json_find_object_value(&v, "statuses", 8);
+    out->statuses.size = json_get_array_size(statuses);
+    out->statuses.e = st = calloc(out->statuses.size, sizeof(tw_status));
+    for (i = 0; i < out->statuses.size; i++, st++) {
+        e = json_get_array_element(statuses, i);
+        st->id = (long long) json_get_number(json_find_object_value(e, "id", 2));
+        st->text = dup_string(json_find_object_value(e, "text", 4));
+        st->retweet_count = (int) json_get_number(json_find_object_value(e, "retweet_count", 13));
+        user = json_find_object_value(e, "user", 4);
+        st->user.id = (int) json_get_number(json_find_object_value(user, "id", 2));
+        st->user.followers_count = (int) json_get_number(json_find_object_value(user, "followers_count", 15));
+        st->user.screen_name = dup_string(json_find_object_value(user, "screen_name", 11));
+    }
+    e = json_find_object_value(&v, "search_metadata", 15);
+    out->search_metadata.count = (int) json_get_number(json_find_object_value(e, "count", 5));
+    json_free(&v);
+}
+
+/* Without a schema a response is built as a tree, stringified and freed. */
+static json_value *dom_object(json_value *v, size_t n) {
+    v->type = JSON_OBJECT;
+    v->json_osz = n;
+    v->json_m = calloc(n, sizeof(json_member));
+    return &v->json_m[0].v;
+}
+
+static json_value *dom_member(json_value *o, size_t i, const char *k) {
+    json_member *m = &o->json_m[i];
+    m->klen = strlen(k);
+    m->k = malloc(m->klen + 1);
+    memcpy(m->k, k, m->klen + 1);
+    json_init(&m->v);
+    return &m->v;
+}
+
+static void tw_search_to_dom(const tw_search *in, char **json, size_t *length) {
+    json_value v, *statuses, *e, *user;
+    const tw_status *st = in->statuses.e;
+    size_t i;
+
+    json_init(&v);
+    dom_object(&v, 2);
+    statuses = dom_member(&v, 0, "statuses");
+    statuses->type = JSON_ARRAY;
+    statuses->json_size = in->statuses.size;
+    statuses->json_e = calloc(in->statuses.size, sizeof(json_value));
+    for (i = 0; i < in->statuses.size; i++, st++) {
+        e = &statuses->json_e[i];
+        dom_object(e, 4);
+        json_set_number(dom_member(e, 0, "id"), (double) st->id);
+        json_set_string(dom_member(e, 1, "text"), st->text, strlen(st->text));
+        json_set_number(dom_member(e, 2, "retweet_count"), st->retweet_count);
+        user = dom_member(e, 3, "user");
+        dom_object(user, 3);
+        json_set_number(dom_member(user, 0, "id"), st->user.id);
+        json_set_number(dom_member(user, 1, "followers_count"), st->user.followers_count);
+        json_set_string(dom_member(user, 2, "screen_name"), st->user.screen_name, strlen(st->user.screen_name));
+    }
+    e = dom_member(&v, 1, "search_metadata");
+    dom_object(e, 1);
+    json_set_number(dom_member(e, 0, "count"), in->search_metadata.count);
+    json_stringify(&v, json, length);
+    json_free(&v);
+}
+
+typedef struct {
+    const char *name;
+    void (*generate)(buffer *b);
+    const char *projection;
+    const char *query;
+    const json_schema *schema;  /* of tw_search, for the struct ops */
+    char *json;
+    size_t length, nodes;
+} corpus;
+
+static corpus corpora[] = {
+    { "numbers", gen_numbers, "/0",               "$[?@ > 999000]" },
+    { "strings", gen_strings, "/0",               "$[0]" },
+    { "nested",  gen_nested,  "/499",             "$[499]" },
+    { "wide",    gen_wide,    "/key_17",          "$.key_17" },
+    { "canada",  gen_canada,  "/type",            "$.features[*].type" },
+    { "twitter", gen_twitter, "/search_metadata", "$.statuses[?@.retweet_count > 90].id", &tw_search_schema },
+    { "citm",    gen_citm,    "/performances/0",  "$.performances[?@.eventId == 138586345].id" },
+};
+
+static size_t count_nodes(const json_value *v) {
+    size_t i, n = 1;
+
+    switch (json_get_type(v)) {
+    case JSON_ARRAY:
+        for (i = 0; i < json_get_array_size(v); i++)
+            n += count_nodes(json_get_array_element(v, i));
+        break;
+    case JSON_OBJECT:
+        for (i = 0; i < json_get_object_size(v); i++)
+            n += count_nodes(json_get_object_value(v, i));
+        break;
+    default:
+        break;
+    }
+    return n;
+}
+
+static int json_output = 0;
+
+static void report(const corpus *c, const char *op, double seconds, size_t iterations, size_t nallocs) {
+    double per_doc = seconds / iterations;
+
+    if (json_output)
+        printf("{\"corpus\":\"%s\",\"op\":\"%s\",\"bytes\":%zu,\"nodes\":%zu,\"iterations\":%zu,"
+            "\"mb_per_s\":%.2f,\"ns_per_node\":%.2f,\"allocs_per_doc\":%.1f}\n",
+            c->name, op, c->length, c->nodes, iterations,
+            c->length / per_doc / 1e6, per_doc * 1e9 / c->nodes, (double) nallocs / iterations);
+    else
+        printf("%-8s %-20s %10zu %9zu %10.1f %10.2f %12.1f\n",
+            c->name, op, c->length, c->nodes,
+            c->length / per_doc / 1e6, per_doc * 1e9 / c->nodes, (double) nallocs / iterations);
+}
+
+/*
+ * Each op runs on a fresh document per iteration; setup and teardown
+ * outside the measured call are excluded from time and allocation counts.
+ */
+enum { OP_PARSE, OP_PARSE_EX, OP_PARSE_OPTS, OP_VALIDATE, OP_STRINGIFY, OP_STRINGIFY_UTF8, OP_CANONICAL, OP_FREE, OP_PROJECTION, OP_QUERY_TREE, OP_QUERY_STREAM, OP_PARSE_PARALLEL, OP_STRINGIFY_PARALLEL, OP_PARSE_POOL, OP_PARSE_FIXED, OP_PARSER, OP_FREE_DEFERRED,
+    OP_ENCODE_BINARY, OP_DECODE_BINARY, OP_TEXT_HOP, OP_MSGPACK_HOP, OP_CBOR_HOP,
+    OP_COPY, OP_COW_VARIANT, OP_PATCH, OP_DOM_STRUCT, OP_DECODE_STRUCT,
+    OP_DOM_ENCODE, OP_ENCODE_STRUCT };
+static const char *op_names[] = {
+    "parse", "parse_ex", "parse_strict", "validate", "stringify", "stringify_utf8", "stringify_canonical", "free", "parse_projection", "query_tree", "query_stream", "parse_parallel", "stringify_parallel", "parse_pool", "parse_fixed", "parser_reuse", "free_deferred",
+    "encode_binary", "decode_binary", "text_hop", "msgpack_hop", "cbor_hop",
+    "copy", "cow_variant", "patch", "dom_to_struct", "decode_struct",
+    "dom_encode", "encode_struct"
+};
+
+/* A hop re-encodes a parsed tree and decodes it on the other side. */
+#define IS_HOP(op) ((op) == OP_TEXT_HOP || (op) == OP_MSGPACK_HOP || (op) == OP_CBOR_HOP)
+
+static void bench_op(corpus *c, int op, const json_projection *p) {
+    json_value v, w;
+    double t, total = 0.0;
+    size_t iterations = 0, nallocs = 0, length, before, blen = 0;
+    char *out, *bin = NULL;
+    json_pool *pool = NULL;
+    json_allocator pooled;
+    json_parser parser;
+    json_pointer ptr;
+    json_value patch;
+    char ops[256];
+    tw_search search;
+    json_error e;
+    json_buffers fixed;
+    json_query query;
+    json_value *matches[16];
+
+    if (op >= OP_DOM_STRUCT && c->schema == NULL)
+        return;
+    if (op == OP_DOM_ENCODE || op == OP_ENCODE_STRUCT)
+        json_decode_struct(&search, c->json, c->schema);
+
+    /* the pool outlives the loop so its slabs are reused between documents */
+    if (op == OP_PARSE_POOL) {
+        pool = json_pool_create();
+        json_pool_allocator(pool, &pooled);
+        json_set_thread_allocator(&pooled);
+    }
+    /* worst-case sized, so every parse is a single pass */
+    if (op == OP_PARSE_FIXED) {
+        fixed.nodes_size = JSON_FIXED_NODES_SIZE(c->length);
+        fixed.strings_size = JSON_FIXED_STRINGS_SIZE(c->length);
+        fixed.nodes = malloc(fixed.nodes_size);
+        fixed.strings = malloc(fixed.strings_size);
+    }
+    json_query_compile(&query, c->query, strlen(c->query));
+    json_parser_init(&parser);
+    json_init(&v);
+    if (op == OP_STRINGIFY || op == OP_STRINGIFY_UTF8 || op == OP_CANONICAL || op == OP_STRINGIFY_PARALLEL
+            || op == OP_ENCODE_BINARY || IS_HOP(op))
+        json_parse(&v, c->json);
+    /* a variant shares the document except along the path to the changed value */
+    json_init(&w);
+    json_pointer_compile(&ptr, c->projection, strlen(c->projection));
+    if (op == OP_COPY || op == OP_COW_VARIANT || op == OP_PATCH)
+        json_parse(&v, c->json);
+    /* the same document is updated in place every iteration */
+    json_init(&patch);
+    sprintf(ops, "[{\"op\":\"replace\",\"path\":\"%s\",\"value\":0}]", c->projection);
+    json_parse(&patch, ops);
+    if (op == OP_COW_VARIANT)
+        json_share(&v);
+    if (op == OP_DECODE_BINARY) {
+        json_parse(&v, c->json);
+        json_encode_binary(&v, &bin, &blen);
+        json_free(&v);
+    }
+    while (total < BENCH_MIN_TIME || iterations < 3) {
+        if (op == OP_FREE || op == OP_FREE_DEFERRED)
+            json_parse(&v, c->json);
+        before = allocs;
+        t = now();
+        switch (op) {
+        case OP_PARSE:
+        case OP_PARSE_POOL:         json_parse(&v, c->json); break;
+        case OP_PARSE_EX:           json_parse_ex(&v, c->json, &e); break;
+        case OP_PARSE_OPTS:
+            json_parse_opts(&v, c->json, JSON_PARSE_VALIDATE_UTF8 | JSON_PARSE_DEPTH_LIMIT, &e);
+            break;
+        case OP_VALIDATE:           json_validate(c->json, c->length); break;
+        case OP_PARSE_FIXED:        json_parse_fixed(&v, c->json, &fixed); break;
+        case OP_PARSER:             json_parser_parse(&parser, &v, c->json); break;
+        case OP_STRINGIFY:          json_stringify(&v, &out, &length); break;
+        case OP_STRINGIFY_UTF8:     json_stringify_opts(&v, &out, &length, JSON_STRINGIFY_UTF8); break;
+        case OP_CANONICAL:          json_stringify_canonical(&v, &out, &length); break;
+        case OP_FREE:               json_free(&v); break;
+        case OP_FREE_DEFERRED:      json_free_deferred(&v); break;
+        case OP_ENCODE_BINARY:      json_encode_binary(&v, &out, &length); break;
+        case OP_DECODE_BINARY:      json_decode_binary(&v, bin, blen); break;
+        case OP_TEXT_HOP:
+            json_stringify(&v, &out, &length);
+            json_parse(&w, out);
+            free(out);
+            break;
+        case OP_MSGPACK_HOP:
+            json_encode_msgpack(&v, &out, &length);
+            json_decode_msgpack(&w, out, length);
+            free(out);
+            break;
+        case OP_CBOR_HOP:
+            json_encode_cbor(&v, &out, &length);
+            json_decode_cbor(&w, out, length);
+            free(out);
+            break;
+        case OP_COPY:               json_copy(&w, &v); break;
+        case OP_COW_VARIANT:
+            json_copy(&w, &v);
+            json_set_number(json_pointer_cow(&ptr, &w), iterations);
+            break;
+        case OP_PATCH:              json_patch(&v, &patch); break;
+        case OP_DOM_STRUCT:         tw_search_from_dom(&search, c->json); break;
+        case OP_DECODE_STRUCT:      json_decode_struct(&search, c->json, c->schema); break;
+        case OP_DOM_ENCODE:         tw_search_to_dom(&search, &out, &length); break;
+        case OP_ENCODE_STRUCT:      json_encode_struct(&search, c->schema, &out, &length); break;
+        case OP_PROJECTION:         json_parse_projection(&v, c->json, p); break;
+        case OP_QUERY_TREE:
+            json_parse(&v, c->json);
+            json_query_select(&query, &v, matches, 16);
+            break;
+        case OP_QUERY_STREAM:       json_parse_query(&v, c->json, &query); break;
+        case OP_PARSE_PARALLEL:     json_parse_parallel(&v, c->json, BENCH_THREADS); break;
+        case OP_STRINGIFY_PARALLEL: json_stringify_parallel(&v, &out, &length, BENCH_THREADS); break;
+        }
+        total += now() - t;
+        nallocs += allocs - before;
+        iterations++;
+        if (op == OP_STRINGIFY || op == OP_STRINGIFY_UTF8 || op == OP_CANONICAL || op == OP_STRINGIFY_PARALLEL
+                || op == OP_ENCODE_BINARY || op == OP_DOM_ENCODE || op == OP_ENCODE_STRUCT)
+            free(out);
+        else if (op == OP_FREE_DEFERRED)
+            json_free_wait();
+        else if (IS_HOP(op) || op == OP_COPY || op == OP_COW_VARIANT)
+            json_free(&w);
+        else if (op == OP_DOM_STRUCT || op == OP_DECODE_STRUCT)
+            json_free_struct(&search, c->schema);
+        else if (op == OP_PARSE_FIXED)
+            json_init(&v);
+        else if (op != OP_FREE && op != OP_PATCH)
+            json_free(&v);
+    }
+    if (op == OP_PARSE_FIXED) {
+        free(fixed.nodes);
+        free(fixed.strings);
+    }
+    if (op == OP_DOM_ENCODE || op == OP_ENCODE_STRUCT)
+        json_free_struct(&search, c->schema);
+    json_free(&v);
+    json_free(&patch);
+    json_pointer_free(&ptr);
+    json_query_free(&query);
+    free(bin);
+    json_parser_free(&parser);
+    if (pool != NULL) {
+        json_set_thread_allocator(NULL);
+        json_pool_destroy(pool);
+    }
+    report(c, op_names[op], total, iterations, nallocs);
+}
+
+int main(int argc, char **argv) {
+    size_t i;
+    int op, j, selected;
+    json_value v;
+    json_projection p;
+    buffer b;
+
+    if (argc > 1 && strcmp(argv[1], "--json") == 0) {
+        json_output = 1;
+        argc--, argv++;
+    }
+    json_schema_compile(&tw_user_schema, tw_user_fields, 3, sizeof(tw_user));
+    json_schema_compile(&tw_status_schema, tw_status_fields, 4, sizeof(tw_status));
+    json_schema_compile(&tw_search_meta_schema, tw_search_meta_fields, 1, sizeof(int));
+    json_schema_compile(&tw_search_schema, tw_search_fields, 2, sizeof(tw_search));
+    if (!json_output)
+        printf("%-8s %-20s %10s %9s %10s %10s %12s\n",
+            "corpus", "op", "bytes", "nodes", "MB/s", "ns/node", "allocs/doc");
+    for (i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++) {
+        corpus *c = &corpora[i];
+        for (j = 1, selected = argc == 1; j < argc; j++)
+            selected |= strcmp(argv[j], c->name) == 0;
+        if (!selected)
+            continue;
+        b.s = NULL;
+        b.len = b.cap = 0;
+        rng = 88172645463325252ULL;  /* same corpus whatever is selected */
+        c->generate(&b);
+        c->json = b.s;
+        c->length = b.len;
+        if (json_parse(&v, c->json) != JSON_PARSE_OK) {
+            fprintf(stderr, "%s: corpus does not parse\n", c->name);
+            return 1;
+        }
+        c->nodes = count_nodes(&v);
+        json_free(&v);
+        json_projection_init(&p);
+        json_projection_add(&p, c->projection, strlen(c->projection));
+        for (op = OP_PARSE; op <= OP_ENCODE_STRUCT; op++)
+            bench_op(c, op, &p);
+        json_projection_free(&p);
+        free(c->json);
+    }
+    return 0;
+}
@@ -0,0 +1,478 @@
+/*
+ * Fuzz target and differential harness.
+ *
+ *   make fuzz && ./fuzz [-n runs] [-s seed] [file...]
+ *
+ * Every input is parsed by json_parse, the reference, and by every other
+ * engine: the reusable parser, the pool allocator, fixed buffers (measured
+ * and worst-case sized), projection, pointer, query and parallel parsing,
+ * json_validate and the parsers compiled for each option set. They must
+ * agree on the error code and, on success, on the tree; options may only
+ * reject more. Accepted trees must then survive stringify (serial and parallel)
+ * and the binary, MessagePack and CBOR codecs unchanged. Any disagreement
+ * aborts, so sanitizers and fuzzers report it as a crash.
+ *
+ * With files, each is run once (corpus replay, AFL with @@). Without files,
+ * random documents and mutations of them are generated. Building with
+ * -DFUZZ_LIBFUZZER leaves out main for clang -fsanitize=fuzzer.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "json_parser.h"
+
+#define FUZZ_THREADS 3
+
+static const char *fuzz_input;
+
+static void fail(const char *what, int expect, int actual) {
+    fprintf(stderr, "fuzz: %s mismatch (%d vs %d) on input:\n%s\n", what, expect, actual, fuzz_input);
+    abort();
+}
+
+#define CHECK(what, expect, actual) do { if ((expect) != (actual)) fail(what, expect, actual); } while (0)
+
+static void check_equal(const char *what, const json_value *expect, const json_value *actual) {
+    if (!json_is_equal(expect, actual))
+        fail(what, 1, 0);
+}
+
+static void check_engine(const char *what, int ret, int expect_ret, json_value *v, const json_value *expect) {
+    CHECK(what, expect_ret, ret);
+    if (ret == JSON_PARSE_OK)
+        check_equal(what, expect, v);
+    json_free(v);
+}
+
+/* Lookups resolve duplicate keys to the first, so reordering them changes the tree. */
+static int has_duplicate_keys(const json_value *v) {
+    size_t i;
+
+    if (json_get_type(v) == JSON_ARRAY)
+        for (i = 0; i < json_get_array_size(v); i++)
+            if (has_duplicate_keys(json_get_array_element(v, i)))
+                return 1;
+    if (json_get_type(v) != JSON_OBJECT)
+        return 0;
+    for (i = 0; i < json_get_object_size(v); i++)
+        if (json_find_object_index(v, json_get_object_key(v, i), json_get_object_key_length(v, i)) != i
+                || has_duplicate_keys(json_get_object_value(v, i)))
+            return 1;
+    return 0;
+}
+
+/* Levels of arrays and objects; the binary decoders reject more than 512. */
+static size_t nesting(const json_value *v) {
+    size_t i, n, max = 0;
+
+    if (json_get_type(v) == JSON_ARRAY)
+        for (i = 0; i < json_get_array_size(v); i++)
+            if ((n = nesting(json_get_array_element(v, i))) > max)
+                max = n;
+    if (json_get_type(v) == JSON_OBJECT)
+        for (i = 0; i < json_get_object_size(v); i++)
+            if ((n = nesting(json_get_object_value(v, i))) > max)
+                max = n;
+    return json_get_type(v) == JSON_ARRAY || json_get_type(v) == JSON_OBJECT ? max + 1 : 0;
+}
+
+/* Whatever the reference accepts must come back unchanged through every encoding. */
+static void check_roundtrip(const json_value *v) {
+    char *json, *again, *bin;
+    size_t length, again_length, blen;
+    int deep = nesting(v) > 512;
+    json_value w;
+
+    json_init(&w);
+    CHECK("stringify", JSON_STRINGIFY_OK, json_stringify(v, &json, &length));
+    CHECK("reparse", JSON_PARSE_OK, json_parse(&w, json));
+    check_equal("reparse", v, &w);
+    CHECK("stringify again", JSON_STRINGIFY_OK, json_stringify(&w, &again, &again_length));
+    if (again_length != length || memcmp(json, again, length) != 0)
+        fail("stringify again", 0, 1);
+    free(again);
+    json_free(&w);
+
+    /* Canonical text reads back as the same tree and is a fixed point. */
+    CHECK("canonical", JSON_STRINGIFY_OK, json_stringify_canonical(v, &bin, &blen));
+    CHECK("canonical reparse", JSON_PARSE_OK, json_parse(&w, bin));
+    if (!has_duplicate_keys(v))
+        check_equal("canonical reparse", v, &w);
+    CHECK("canonical again", JSON_STRINGIFY_OK, json_stringify_canonical(&w, &again, &again_length));
+    if (again_length != blen || memcmp(bin, again, blen) != 0)
+        fail("canonical again", 0, 1);
+    free(again);
+    free(bin);
+    json_free(&w);
+
+    CHECK("stringify_utf8", JSON_STRINGIFY_OK, json_stringify_opts(v, &bin, &blen, JSON_STRINGIFY_UTF8));
+    check_engine("stringify_utf8 reparse", json_parse(&w, bin), JSON_PARSE_OK, &w, v);
+    free(bin);
+
+    CHECK("stringify_parallel", JSON_STRINGIFY_OK, json_stringify_parallel(v, &again, &again_length, FUZZ_THREADS));
+    if (again_length != length || memcmp(json, again, length) != 0)
+        fail("stringify_parallel", 0, 1);
+    free(again);
+    free(json);
+
+    CHECK("encode_binary", JSON_STRINGIFY_OK, json_encode_binary(v, &bin, &blen));
+    check_engine("decode_binary", json_decode_binary(&w, bin, blen), deep ? JSON_BINARY_INVALID : JSON_PARSE_OK, &w, v);
+    free(bin);
+    CHECK("encode_msgpack", JSON_STRINGIFY_OK, json_encode_msgpack(v, &bin, &blen));
+    check_engine("decode_msgpack", json_decode_msgpack(&w, bin, blen), deep ? JSON_BINARY_INVALID : JSON_PARSE_OK, &w, v);
+    free(bin);
+    CHECK("encode_cbor", JSON_STRINGIFY_OK, json_encode_cbor(v, &bin, &blen));
+    check_engine("decode_cbor", json_decode_cbor(&w, bin, blen), deep ? JSON_BINARY_INVALID : JSON_PARSE_OK, &w, v);
+    free(bin);
+}
+
+/* Lookups, indexed or not, must find the first member with a key. */
+static void check_lookup(const json_value *v) {
+    size_t i, j, n;
+
+    if (json_get_type(v) == JSON_ARRAY)
+        for (i = 0; i < json_get_array_size(v); i++)
+            check_lookup(json_get_array_element(v, i));
+    if (json_get_type(v) != JSON_OBJECT)
+        return;
+    n = json_get_object_size(v);
+    for (i = 0; i < n; i++) {
+        const char *k = json_get_object_key(v, i);
+        size_t klen = json_get_object_key_length(v, i);
+        for (j = 0; j < i; j++)
+            if (json_get_object_key_length(v, j) == klen && memcmp(json_get_object_key(v, j), k, klen) == 0)
+                break;
+        CHECK("find_object_index", (int) j, (int) json_find_object_index(v, k, klen));
+        check_lookup(json_get_object_value(v, i));
+    }
+}
+
+static void check_shared(json_value *v) {
+    json_value w;
+
+    json_init(&w);
+    json_copy(&w, v);
+    check_lookup(v);
+    json_share(v);
+    check_equal("share", &w, v);
+    check_lookup(v);
+    json_unshare(&w);
+    json_free(&w);
+    json_copy(&w, v);
+    check_equal("copy", v, &w);
+    json_free(&w);
+}
+
+/* Measured buffers must be exactly big enough; worst-case ones always are. */
+static void check_fixed(const char *json, int expect_ret, const json_value *expect) {
+    json_buffers b = { NULL, 0, 0, NULL, 0, 0 };
+    json_value v;
+    int ret;
+
+    ret = json_parse_fixed(&v, json, &b);
+    if (ret == JSON_PARSE_CAPACITY_EXCEEDED) {
+        b.nodes = malloc(b.nodes_needed + 1);
+        b.strings = malloc(b.strings_needed + 1);
+        b.nodes_size = b.nodes_needed;
+        b.strings_size = b.strings_needed;
+        ret = json_parse_fixed(&v, json, &b);
+    }
+    CHECK("parse_fixed", expect_ret, ret);
+    if (ret == JSON_PARSE_OK)
+        check_equal("parse_fixed", expect, &v);
+    free(b.nodes);
+    free(b.strings);
+
+    b.nodes_size = JSON_FIXED_NODES_SIZE(strlen(json));
+    b.strings_size = JSON_FIXED_STRINGS_SIZE(strlen(json));
+    b.nodes = malloc(b.nodes_size);
+    b.strings = malloc(b.strings_size);
+    ret = json_parse_fixed(&v, json, &b);
+    CHECK("parse_fixed bound", expect_ret, ret);
+    if (ret == JSON_PARSE_OK)
+        check_equal("parse_fixed bound", expect, &v);
+    free(b.nodes);
+    free(b.strings);
+}
+
+/* What an option set accepts, json_parse accepts as the same tree. */
+static void check_opts(const char *json, int expect_ret, const json_value *expect) {
+    json_value v;
+    unsigned flags;
+    int ret;
+
+    check_engine("parse_opts", json_parse_opts(&v, json, 0, NULL), expect_ret, &v, expect);
+    for (flags = 1; flags < JSON_PARSE_OPTIONS; flags++) {
+        ret = json_parse_opts(&v, json, flags, NULL);
+        /* An option may reject the text before the reference's error is reached. */
+        if (ret == JSON_PARSE_INVALID_UTF8 || ret == JSON_PARSE_INVALID_UNICODE_SURROGATE
+                || ret == JSON_PARSE_TOO_DEEP || ret == JSON_PARSE_NUMBER_NOT_INTEGER)
+            continue;
+        check_engine("parse_opts", ret, expect_ret, &v, expect);
+    }
+}
+
+static const char *const queries[] = {
+    "$[*]", "$.key[?@.a]", "$[?@ == 1]", "$.*[?(@.key != null || @[0] > 0)]", "$[0].a",
+    "$['']", "$[?!@[1] && @.a < \"z\"].*", "$.a[?@.key >= 0][*]",
+};
+#define NQUERIES (sizeof(queries) / sizeof(queries[0]))
+static json_query compiled[NQUERIES];
+
+/* The text engine must agree with json_parse on errors and with the tree engine on matches. */
+static void check_queries(const char *json, int expect_ret, const json_value *base) {
+    json_value v, **out;
+    size_t i, j, n;
+
+    for (i = 0; i < NQUERIES; i++) {
+        if (compiled[i].size == 0)
+            CHECK("query_compile", JSON_PARSE_OK, json_query_compile(&compiled[i], queries[i], strlen(queries[i])));
+        CHECK("parse_query", expect_ret, json_parse_query(&v, json, &compiled[i]));
+        if (expect_ret != JSON_PARSE_OK)
+            continue;
+        n = json_query_select(&compiled[i], base, NULL, 0);
+        CHECK("query_select", (int) json_get_array_size(&v), (int) n);
+        out = malloc((n + 1) * sizeof(json_value *));
+        json_query_select(&compiled[i], base, out, n);
+        for (j = 0; j < n; j++)
+            check_equal("query_select", out[j], json_get_array_element(&v, j));
+        free(out);
+        json_free(&v);
+    }
+}
+
+static void fuzz_one(const uint8_t *data, size_t size) {
+    char *json = malloc(size + 1);
+    json_value base, v;
+    json_parser parser;
+    json_pool *pool;
+    json_allocator pooled;
+    json_projection p;
+    json_pointer root;
+    int ret;
+
+    memcpy(json, data, size);
+    json[size] = '\0';
+    fuzz_input = json;
+    json_init(&base);
+    json_init(&v);
+    ret = json_parse(&base, json);
+    CHECK("validate", ret, json_validate(json, strlen(json)));
+
+    json_parser_init(&parser);
+    check_engine("json_parser_parse", json_parser_parse(&parser, &v, json), ret, &v, &base);
+    check_engine("json_parser_parse reused", json_parser_parse(&parser, &v, json), ret, &v, &base);
+    json_parser_free(&parser);
+
+    pool = json_pool_create();
+    json_pool_allocator(pool, &pooled);
+    json_set_thread_allocator(&pooled);
+    check_engine("pool", json_parse(&v, json), ret, &v, &base);
+    json_set_thread_allocator(NULL);
+    json_pool_destroy(pool);
+
+    check_fixed(json, ret, &base);
+    check_opts(json, ret, &base);
+    check_queries(json, ret, &base);
+    check_engine("parse_parallel", json_parse_parallel(&v, json, FUZZ_THREADS), ret, &v, &base);
+
+    json_projection_init(&p);
+    json_projection_add(&p, "", 0);
+    check_engine("parse_projection", json_parse_projection(&v, json, &p), ret, &v, &base);
+    json_projection_free(&p);
+
+    /* The pointer parser stops at its target, so only accepted text must agree. */
+    if (ret == JSON_PARSE_OK) {
+        json_pointer_compile(&root, "", 0);
+        check_engine("parse_pointer", json_parse_pointer(&v, json, &root), ret, &v, &base);
+        json_pointer_free(&root);
+        check_roundtrip(&base);
+        check_shared(&base);
+    }
+    json_free(&base);
+    free(json);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    fuzz_one(data, size);
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+typedef struct {
+    char *s;
+    size_t len, cap;
+} buffer;
+
+static void put(buffer *b, const char *s, size_t n) {
+    if (b->len + n + 1 > b->cap) {
+        b->cap = (b->len + n + 1) * 2;
+        b->s = realloc(b->s, b->cap);
+    }
+    memcpy(b->s + b->len, s, n);
+    b->len += n;
+}
+
+static void put_str(buffer *b, const char *s) {
+    put(b, s, strlen(s));
+}
+
+static unsigned long long rng;
+
+static unsigned next(unsigned n) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (unsigned) (rng >> 32) % n;
+}
+
+static const char *const spaces[] = { "", "", "", " ", "\n", "\t ", "\r\n  " };
+static const char *const numbers[] = {
+    "0", "-0", "1", "-1", "0.5", "1e10", "1E-10", "-1.5e+3", "123456789012345678901234567890",
+    "1e308", "1.7976931348623157e308", "1.7976931348623159e308", "1e309", "-1e400", "4.9e-324",
+    "1e-400", "2.2250738585072014e-308", "9007199254740993", "0.1", "1.0000000000000002",
+    /* Near DBL_MAX with 64 or more digits, where a truncated token would round the other way. */
+    "999999999999999999999999999999999999999999999999999999999999999999999999999999999999999999"
+    "999999999999999999999999999999999999999999999999999999999999999999999999999999999999999999"
+    "999999999999999999999999999999999999999999999999999999999999999999999999999999999999999999"
+    "999999999999999999999999999999999999999",
+    "200000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+    "000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+    "000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+    "000000000000000000000000000000000000000",
+    "179769313486231580793728971405303415079934132710037826936173778980444968292764750946649017"
+    "977587207096330286416692887910946555547851940402630657488671505820681908902000708383676273"
+    "854845817711531764475730270069855571366959622842914819860834936475292719074168444365510704"
+    "342711559699508093042880177904174497792",
+    "179769313486231580793728971405303415079934132710037826936173778980444968292764750946649017"
+    "977587207096330286416692887910946555547851940402630657488671505820681908902000708383676273"
+    "854845817711531764475730270069855571366959622842914819860834936475292719074168444365510704"
+    "342711559699508093042880177904174497791",
+    "1797693134862315807937289714053034150799341327100378269361737789e245",
+    "1797693134862315807937289714053034150799341327100378269361737790e245",
+    "0.00000000001797693134862315807937289714053034150799341327100378269361737789804449e319",
+};
+static const char *const strings[] = {
+    "", "a", "key", "\\\"", "\\\\", "\\/", "\\b\\f\\n\\r\\t", "\\u0000", "\\u00e9", "\\u20AC",
+    "\\ud83d\\ude00", "\\udc00", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "long string with spaces",
+};
+
+static void gen_value(buffer *b, int depth) {
+    unsigned i, n;
+
+    switch (next(depth > 6 ? 5 : 7)) {
+    case 0: put_str(b, "null"); break;
+    case 1: put_str(b, next(2) ? "true" : "false"); break;
+    case 2: put_str(b, numbers[next(sizeof(numbers) / sizeof(numbers[0]))]); break;
+    case 3:
+    case 4:
+        put_str(b, "\"");
+        for (i = 0, n = next(4); i < n; i++)
+            put_str(b, strings[next(sizeof(strings) / sizeof(strings[0]))]);
+        put_str(b, "\"");
+        break;
+    case 5:
+        put_str(b, "[");
+        for (i = 0, n = next(6); i < n; i++) {
+            put_str(b, spaces[next(sizeof(spaces) / sizeof(spaces[0]))]);
+            gen_value(b, depth + 1);
+            put_str(b, i + 1 < n ? "," : "");
+        }
+        put_str(b, "]");
+        break;
+    default:
+        put_str(b, "{");
+        for (i = 0, n = next(6); i < n; i++) {
+            put_str(b, spaces[next(sizeof(spaces) / sizeof(spaces[0]))]);
+            put_str(b, "\"");
+            put_str(b, strings[next(sizeof(strings) / sizeof(strings[0]))]);
+            put_str(b, "\":");
+            put_str(b, spaces[next(sizeof(spaces) / sizeof(spaces[0]))]);
+            gen_value(b, depth + 1);
+            put_str(b, i + 1 < n ? "," : "");
+        }
+        put_str(b, "}");
+        break;
+    }
+}
+
+/* Byte flips, token splices, insertions, deletions and truncation. */
+static void mutate(buffer *b) {
+    static const char *const tokens[] = { "{", "}", "[", "]", ",", ":", "\"", "\\", "\\u", "-", ".", "e", "0", "\x01", "\xff" };
+    unsigned i, n, pos;
+    const char *t;
+
+    for (i = 0, n = 1 + next(4); i < n && b->len > 0; i++) {
+        pos = next((unsigned) b->len);
+        switch (next(4)) {
+        case 0:
+            b->s[pos] ^= (char) (1 << next(8));
+            break;
+        case 1:
+            t = tokens[next(sizeof(tokens) / sizeof(tokens[0]))];
+            put(b, t, strlen(t));
+            memmove(b->s + pos + strlen(t), b->s + pos, b->len - strlen(t) - pos);
+            memcpy(b->s + pos, t, strlen(t));
+            break;
+        case 2:
+            memmove(b->s + pos, b->s + pos + 1, b->len - pos - 1);
+            b->len--;
+            break;
+        default:
+            b->len = pos;
+            break;
+        }
+    }
+}
+
+static void run_file(const char *path) {
+    FILE *f = fopen(path, "rb");
+    buffer b = { NULL, 0, 0 };
+    char chunk[4096];
+    size_t n;
+
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    put(&b, "", 0);
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        put(&b, chunk, n);
+    fclose(f);
+    fuzz_one((const uint8_t *) b.s, b.len);
+    free(b.s);
+}
+
+int main(int argc, char **argv) {
+    buffer b = { NULL, 0, 0 };
+    unsigned long runs = 10000, i;
+    int j, files = 0;
+
+    rng = 88172645463325252ULL;
+    for (j = 1; j < argc; j++) {
+        if (strcmp(argv[j], "-n") == 0 && j + 1 < argc)
+            runs = strtoul(argv[++j], NULL, 10);
+        else if (strcmp(argv[j], "-s") == 0 && j + 1 < argc)
+            rng ^= strtoull(argv[++j], NULL, 10) * 0x9e3779b97f4a7c15ULL;
+        else {
+            run_file(argv[j]);
+            files++;
+        }
+    }
+    if (files > 0)
+        return 0;
+    for (i = 0; i < runs; i++) {
+        b.len = 0;
+        put_str(&b, spaces[next(sizeof(spaces) / sizeof(spaces[0]))]);
+        gen_value(&b, 0);
+        put_str(&b, spaces[next(sizeof(spaces) / sizeof(spaces[0]))]);
+        if (i % 2)
+            mutate(&b);
+        fuzz_one((const uint8_t *) b.s, b.len);
+    }
+    free(b.s);
+    printf("%lu inputs, no mismatch\n", runs);
+    return 0;
+}
+#endif
@@ -1,32 +1,364 @@
 #include "json_parser.h"
+#include <pthread.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdint.h>
 
 #ifndef JSON_PARSE_STACK_INIT_SIZE
 #define JSON_PARSE_STACK_INIT_SIZE 256
 #endif
 
+#ifndef JSON_PARSER_SHRINK_SIZE
+#define JSON_PARSER_SHRINK_SIZE 65536
+#endif
+
+#ifndef JSON_PARSE_MAX_DEPTH
+#define JSON_PARSE_MAX_DEPTH 512
+#endif
+
 #define EXPECT(c, ch)    do { assert(*c->json == (ch)); c->json++; } while (0)
 #define ISDIGIT(ch)       ((ch) >= '0' && (ch) <= '9')
 #define ISDIGIT1TO9(ch)   ((ch) >= '1' && (ch) <= '9')
 #define PUTC(c, ch)          do { *(char *) json_context_push(c, sizeof(char)) = (ch); } while (0)
-#define STRING_ERROR(ret) do { c->top = head; return ret; } while (0)
+#define PUTS(c, s, len)   memcpy(json_context_push(c, len), s, len);
+#define STRING_ERROR(ret, at) do { c->top = head; c->json = (at); return ret; } while (0)
+#define PEEK(c)           ((c)->json < (c)->end ? *(c)->json : '\0')
 
 typedef struct {
     const char *json;
+    const char *end;    /* only used by the json_skip_* functions */
     char *stack;
     size_t size, top;
+    size_t depth;
+    size_t nest;        /* nesting where it is limited: JSON_PARSE_DEPTH_LIMIT, MessagePack, CBOR */
+    const json_allocator *a;
+    const json_allocator *sa;   /* strings and keys; a except in json_parse_fixed */
 } json_context;
 
+/* strtod sets errno to ERANGE on overflow and underflow; keep the caller's. */
+static double json_strtod(const char *s, char **end)
+{
+    int saved = errno;
+    double d = strtod(s, end);
+
+    errno = saved;
+    return d;
+}
+
+static void *json_libc_malloc(void *ud, size_t size)
+{
+    (void) ud;
+    return malloc(size);
+}
+
+static void *json_libc_realloc(void *ud, void *p, size_t size)
+{
+    (void) ud;
+    return realloc(p, size);
+}
+
+static void json_libc_free(void *ud, void *p)
+{
+    (void) ud;
+    free(p);
+}
+
+static const json_allocator json_libc_allocator = {
+    json_libc_malloc, json_libc_realloc, json_libc_free, NULL
+};
+static const json_allocator *json_default_allocator = &json_libc_allocator;
+static __thread const json_allocator *json_thread_allocator;
+
+void json_set_allocator(const json_allocator *a)
+{
+    __atomic_store_n(&json_default_allocator, a != NULL ? a : &json_libc_allocator, __ATOMIC_RELEASE);
+}
+
+const json_allocator *json_set_thread_allocator(const json_allocator *a)
+{
+    const json_allocator *prev = json_thread_allocator;
+    json_thread_allocator = a;
+    return prev;
+}
+
+const json_allocator *json_get_allocator(void)
+{
+    return json_thread_allocator != NULL ? json_thread_allocator
+        : __atomic_load_n(&json_default_allocator, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Optional instrumentation, compiled in with -DJSON_ENABLE_STATS. Counters
+ * are per thread; when compiled out every STAT_* macro is a no-op.
+ */
+#ifdef JSON_ENABLE_STATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+static __thread json_stats json_tls_stats;
+
+static unsigned long long json_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void *json_stats_malloc(const json_allocator *a, size_t size)
+{
+    json_tls_stats.allocs++;
+    json_tls_stats.alloc_bytes += size;
+    return a->malloc(a->ud, size);
+}
+
+static void *json_stats_realloc(const json_allocator *a, void *p, size_t size)
+{
+    if (p == NULL)
+        json_tls_stats.allocs++;
+    else
+        json_tls_stats.reallocs++;
+    json_tls_stats.alloc_bytes += size;
+    return a->realloc(a->ud, p, size);
+}
+
+static void json_stats_free(const json_allocator *a, void *p)
+{
+    if (p != NULL)
+        json_tls_stats.frees++;
+    a->free(a->ud, p);
+}
+
+#define JSON_MALLOC(a, size)        json_stats_malloc(a, size)
+#define JSON_REALLOC(a, p, size)    json_stats_realloc(a, p, size)
+#define JSON_FREE(a, p)             json_stats_free(a, p)
+#define STAT_INC(field)         (json_tls_stats.field++)
+#define STAT_TIMER(t)           unsigned long long t = json_cycles()
+#define STAT_PHASE(phase, t)    (json_tls_stats.cycles[phase] += json_cycles() - (t))
+#define STAT_ENTER(c) \
+    do { \
+        if (++(c)->depth > json_tls_stats.max_depth) \
+            json_tls_stats.max_depth = (c)->depth; \
+    } while (0)
+#define STAT_LEAVE(c, v, ret) \
+    do { \
+        (c)->depth--; \
+        if ((ret) == JSON_PARSE_OK) \
+            json_tls_stats.nodes[(v)->type]++; \
+    } while (0)
+#else
+#define JSON_MALLOC(a, size)        ((a)->malloc((a)->ud, size))
+#define JSON_REALLOC(a, p, size)    ((a)->realloc((a)->ud, p, size))
+#define JSON_FREE(a, p)             ((a)->free((a)->ud, p))
+#define STAT_INC(field)         ((void) 0)
+#define STAT_TIMER(t)           ((void) 0)
+#define STAT_PHASE(phase, t)    ((void) 0)
+#define STAT_ENTER(c)           ((void) 0)
+#define STAT_LEAVE(c, v, ret)   ((void) 0)
+#endif
+
+void json_stats_get(json_stats *s)
+{
+    assert(s != NULL);
+#ifdef JSON_ENABLE_STATS
+    *s = json_tls_stats;
+#else
+    memset(s, 0, sizeof(json_stats));
+#endif
+}
+
+void json_stats_reset(void)
+{
+#ifdef JSON_ENABLE_STATS
+    memset(&json_tls_stats, 0, sizeof(json_stats));
+#endif
+}
+
+/*
+ * json_pool carves fixed-size blocks out of slabs aligned to their own size,
+ * so a block's size class is found from its address and blocks carry no
+ * header. Classes follow multiples of sizeof(json_value) and
+ * sizeof(json_member); anything larger gets its own aligned region.
+ */
+#define JSON_POOL_SLAB_SIZE   65536
+#define JSON_POOL_HEADER      64
+#define JSON_POOL_MAX_BLOCK   4096
+#define JSON_POOL_LARGE       ((size_t) -1)
+
+static const size_t json_pool_sizes[] = {
+    8, 16, 24, 32, 48, 64, 72, 96, 128, 144, 192, 256, 288, 384,
+    512, 576, 768, 1024, 1152, 1536, 2048, 2304, 3072, 4096
+};
+#define JSON_POOL_CLASSES (sizeof(json_pool_sizes) / sizeof(json_pool_sizes[0]))
+
+typedef struct json_pool_slab json_pool_slab;
+struct json_pool_slab {
+    json_pool_slab *next, *prev;
+    size_t cls;         /* index into json_pool_sizes or JSON_POOL_LARGE */
+    size_t size;        /* usable bytes of a large block */
+};
+
+struct json_pool {
+    void *free_list[JSON_POOL_CLASSES];
+    char *bump[JSON_POOL_CLASSES], *bump_end[JSON_POOL_CLASSES];
+    json_pool_slab *slabs;
+    json_pool_slab *large;
+    unsigned char cls[JSON_POOL_MAX_BLOCK / 8 + 1];   /* (size + 7) / 8 -> class */
+};
+
+static json_pool_slab *json_pool_slab_of(void *ptr)
+{
+    return (json_pool_slab *) ((uintptr_t) ptr & ~(uintptr_t) (JSON_POOL_SLAB_SIZE - 1));
+}
+
+static void *json_pool_malloc(void *ud, size_t size)
+{
+    json_pool *p = (json_pool *) ud;
+    json_pool_slab *slab;
+    size_t cls;
+    void *ret;
+
+    if (size > JSON_POOL_MAX_BLOCK) {
+        if (posix_memalign((void **) &slab, JSON_POOL_SLAB_SIZE, JSON_POOL_HEADER + size) != 0)
+            return NULL;
+        slab->cls = JSON_POOL_LARGE;
+        slab->size = size;
+        slab->prev = NULL;
+        if ((slab->next = p->large) != NULL)
+            p->large->prev = slab;
+        p->large = slab;
+        return (char *) slab + JSON_POOL_HEADER;
+    }
+    cls = p->cls[(size + 7) / 8];
+    if ((ret = p->free_list[cls]) != NULL) {
+        p->free_list[cls] = *(void **) ret;
+        return ret;
+    }
+    if (p->bump[cls] + json_pool_sizes[cls] > p->bump_end[cls]) {
+        if (posix_memalign((void **) &slab, JSON_POOL_SLAB_SIZE, JSON_POOL_SLAB_SIZE) != 0)
+            return NULL;
+        slab->cls = cls;
+        slab->next = p->slabs;
+        p->slabs = slab;
+        p->bump[cls] = (char *) slab + JSON_POOL_HEADER;
+        p->bump_end[cls] = (char *) slab + JSON_POOL_SLAB_SIZE;
+    }
+    ret = p->bump[cls];
+    p->bump[cls] += json_pool_sizes[cls];
+    return ret;
+}
+
+static void json_pool_free(void *ud, void *ptr)
+{
+    json_pool *p = (json_pool *) ud;
+    json_pool_slab *slab;
+
+    if (ptr == NULL)
+        return;
+    slab = json_pool_slab_of(ptr);
+    if (slab->cls == JSON_POOL_LARGE) {
+        if (slab->prev != NULL)
+            slab->prev->next = slab->next;
+        else
+            p->large = slab->next;
+        if (slab->next != NULL)
+            slab->next->prev = slab->prev;
+        free(slab);
+    } else {
+        *(void **) ptr = p->free_list[slab->cls];
+        p->free_list[slab->cls] = ptr;
+    }
+}
+
+static void *json_pool_realloc(void *ud, void *ptr, size_t size)
+{
+    json_pool_slab *slab;
+    size_t old;
+    void *ret;
+
+    if (ptr == NULL)
+        return json_pool_malloc(ud, size);
+    slab = json_pool_slab_of(ptr);
+    old = slab->cls == JSON_POOL_LARGE ? slab->size : json_pool_sizes[slab->cls];
+    if (size <= old)
+        return ptr;
+    if ((ret = json_pool_malloc(ud, size)) != NULL) {
+        memcpy(ret, ptr, old);
+        json_pool_free(ud, ptr);
+    }
+    return ret;
+}
+
+json_pool *json_pool_create(void)
+{
+    json_pool *p = (json_pool *) calloc(1, sizeof(json_pool));
+    size_t i, cls = 0;
+
+    if (p == NULL)
+        return NULL;
+    for (i = 0; i <= JSON_POOL_MAX_BLOCK / 8; ++i) {
+        while (json_pool_sizes[cls] < i * 8)
+            ++cls;
+        p->cls[i] = (unsigned char) cls;
+    }
+    return p;
+}
+
+void json_pool_destroy(json_pool *p)
+{
+    json_pool_slab *slab, *next;
+
+    if (p == NULL)
+        return;
+    for (slab = p->slabs; slab != NULL; slab = next) {
+        next = slab->next;
+        free(slab);
+    }
+    for (slab = p->large; slab != NULL; slab = next) {
+        next = slab->next;
+        free(slab);
+    }
+    free(p);
+}
+
+void json_pool_allocator(json_pool *p, json_allocator *a)
+{
+    assert(p != NULL && a != NULL);
+    a->malloc = json_pool_malloc;
+    a->realloc = json_pool_realloc;
+    a->free = json_pool_free;
+    a->ud = p;
+}
+
+static void json_context_init(json_context *c, const char *json, const char *end,
+        const json_allocator *a)
+{
+    c->json = json;
+    c->end = end;
+    c->stack = NULL;
+    c->size = c->top = 0;
+    c->depth = c->nest = 0;
+    c->a = c->sa = a;
+}
+
 static void *json_context_push(json_context *c, size_t size)
 {
     void *ret;
 
     assert(size > 0);
-    if (c->top + size >= c->size) {
-        if (c->size == 0)
+    if (c->top + size > c->size) {
+        if (c->size < JSON_PARSE_STACK_INIT_SIZE)
             c->size = JSON_PARSE_STACK_INIT_SIZE;
         while (c->top + size >= c->size)
             c->size += c->size >> 1;   /* c->size *= 1.5 */
-        c->stack = (char *) realloc(c->stack, c->size);
+        c->stack = (char *) JSON_REALLOC(c->a, c->stack, c->size);
+        STAT_INC(stack_grows);
     }
     ret = c->stack + c->top;
     c->top += size;
@@ -57,55 +389,15 @@ static int json_parse_literal(json_context *c, json_value *v,
 
     EXPECT(c, *literal);
     for (i = 0; *++literal != '\0'; ++i)
-        if (c->json[i] != *literal)
+        if (c->json[i] != *literal) {
+            c->json--;
             return JSON_PARSE_INVALID_VALUE;
+        }
     c->json += i;
     v->type = type;
     return JSON_PARSE_OK;
 }
 
-static int json_parse_number(json_context *c, json_value *v)
-{
-    char *p;
-    p = (char *) c->json;
-
-    /* validate number */
-    if (*p == '-')
-        ++p;
-    if (*p == '0')
-        ++p;
-    else {
-        if (!ISDIGIT1TO9(*p))
-            return JSON_PARSE_INVALID_VALUE;
-        for (++p; ISDIGIT(*p); ++p)
-            ;
-    }
-    if (*p == '.') {
-        ++p;
-        if (!ISDIGIT(*p))
-            return JSON_PARSE_INVALID_VALUE;
-        for (++p; ISDIGIT(*p); ++p)
-            ;
-    }
-    if (*p == 'e' || *p == 'E') {
-        ++p;
-        if (*p == '-' || *p == '+')
-            ++p;
-        if (!ISDIGIT(*p))
-            return JSON_PARSE_INVALID_VALUE;
-        for (++p; ISDIGIT(*p); ++p)
-            ;
-    }
-
-    errno = 0;
-    v->json_n = strtod(c->json, NULL);
-    if (errno == ERANGE && (v->json_n == HUGE_VAL || v->json_n == -HUGE_VAL))
-        return JSON_PARSE_NUMBER_TOO_BIG;
-    c->json = p;
-    v->type = JSON_NUMBER;
-    return JSON_PARSE_OK;
-}
-
 static const char *json_parse_hex4(const char *p, unsigned *u)
 {
     int i;
@@ -145,511 +437,4671 @@ static void json_encode_utf8(json_context *c, unsigned u)
     }
 }
 
-static int json_parse_string_raw(json_context *c, char **str, size_t *len)
+/* FNV-1a, used to compare object keys quickly. */
+static unsigned json_hash_key(const char *k, size_t len)
+{
+    unsigned h = 2166136261u;
+
+    while (len-- > 0) {
+        h ^= (u_char) *k++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int json_parse_value(json_context *c, json_value *v);
+static void json_free_value(json_value *v, const json_allocator *a);
+static void json_free_object_member(json_member *m, const json_allocator *a);
+
+/* Length of the well-formed UTF-8 sequence at p (RFC 3629), or 0. */
+static size_t json_utf8_length(const u_char *p)
+{
+    if (p[0] < 0x80)
+        return 1;
+    if (p[0] >= 0xc2 && p[0] <= 0xdf)
+        return (p[1] & 0xc0) == 0x80 ? 2 : 0;
+    if (p[0] >= 0xe0 && p[0] <= 0xef)   /* no overlongs or surrogates */
+        return p[1] >= (p[0] == 0xe0 ? 0xa0 : 0x80) && p[1] <= (p[0] == 0xed ? 0x9f : 0xbf)
+            && (p[2] & 0xc0) == 0x80 ? 3 : 0;
+    if (p[0] >= 0xf0 && p[0] <= 0xf4)   /* no overlongs or code points past U+10FFFF */
+        return p[1] >= (p[0] == 0xf0 ? 0x90 : 0x80) && p[1] <= (p[0] == 0xf4 ? 0x8f : 0xbf)
+            && (p[2] & 0xc0) == 0x80 && (p[3] & 0xc0) == 0x80 ? 4 : 0;
+    return 0;
+}
+
+/*
+ * A parser for each combination of JSON_PARSE_* flags, suffixed with the
+ * flags; the one without options keeps the plain names.
+ */
+#define JSON_VARIANT(name) name
+#define JSON_VARIANT_PARSE_OPTS 0
+#include "json_parser_variant.h"
+#define JSON_VARIANT(name) name##_1
+#define JSON_VARIANT_PARSE_OPTS JSON_PARSE_VALIDATE_UTF8
+#include "json_parser_variant.h"
+#define JSON_VARIANT(name) name##_2
+#define JSON_VARIANT_PARSE_OPTS JSON_PARSE_DEPTH_LIMIT
+#include "json_parser_variant.h"
+#define JSON_VARIANT(name) name##_3
+#define JSON_VARIANT_PARSE_OPTS (JSON_PARSE_VALIDATE_UTF8 | JSON_PARSE_DEPTH_LIMIT)
+#include "json_parser_variant.h"
+#define JSON_VARIANT(name) name##_4
+#define JSON_VARIANT_PARSE_OPTS JSON_PARSE_INTEGERS
+#include "json_parser_variant.h"
+#define JSON_VARIANT(name) name##_5
+#define JSON_VARIANT_PARSE_OPTS (JSON_PARSE_VALIDATE_UTF8 | JSON_PARSE_INTEGERS)
+#include "json_parser_variant.h"
+#define JSON_VARIANT(name) name##_6
+#define JSON_VARIANT_PARSE_OPTS (JSON_PARSE_DEPTH_LIMIT | JSON_PARSE_INTEGERS)
+#include "json_parser_variant.h"
+#define JSON_VARIANT(name) name##_7
+#define JSON_VARIANT_PARSE_OPTS (JSON_PARSE_VALIDATE_UTF8 | JSON_PARSE_DEPTH_LIMIT | JSON_PARSE_INTEGERS)
+#include "json_parser_variant.h"
+
+/*
+ * The json_skip_* functions walk the same grammar as json_parse_* and return
+ * the same error codes, but build nothing: no allocation, no unescaping and no
+ * number conversion. They stop at c->end instead of at '\0'.
+ */
+static void json_skip_whitespace(json_context *c)
+{
+    const char *p = c->json;
+
+    while (p < c->end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        ++p;
+    c->json = p;
+}
+
+static int json_skip_literal(json_context *c, const char *literal)
+{
+    const char *p = c->json;
+
+    for ( ; *literal != '\0'; ++literal, ++p)
+        if (p >= c->end || *p != *literal)
+            return JSON_PARSE_INVALID_VALUE;
+    c->json = p;
+    return JSON_PARSE_OK;
+}
+
+/*
+ * Only called for numbers whose magnitude is 10^308. They overflow from
+ * 2^1024 - 2^970 up, an integer of 309 digits, so their first 309
+ * significant digits decide; strtod reads them as d.ddd...e308 from a
+ * buffer, however long the token is or wherever the text ends.
+ */
+#define JSON_OVERFLOW_DIGITS 309
+
+static int json_number_overflows(const char *s, const char *e)
+{
+    char buf[JSON_OVERFLOW_DIGITS + 8];
+    char *p = buf;
+
+    for ( ; s < e && *s != 'e' && *s != 'E' && p - buf <= JSON_OVERFLOW_DIGITS; ++s) {
+        if (!ISDIGIT(*s) || (p == buf && *s == '0'))
+            continue;
+        *p++ = *s;
+        if (p == buf + 1)
+            *p++ = '.';
+    }
+    memcpy(p, "e308", 5);
+    return isinf(json_strtod(buf, NULL));
+}
+
+static int json_skip_number(json_context *c)
+{
+    const char *p = c->json;
+    const char *end = c->end;
+    long idigits = 0, fzeros = 0, exp = 0, mag;
+    int nonzero = 0, eneg = 0;
+
+#define SKIP_PEEK(p) ((p) < end ? *(p) : '\0')
+    if (SKIP_PEEK(p) == '-')
+        ++p;
+    if (SKIP_PEEK(p) == '0')
+        ++p;
+    else {
+        if (!ISDIGIT1TO9(SKIP_PEEK(p)))
+            return JSON_PARSE_INVALID_VALUE;
+        for (++p, idigits = 1; ISDIGIT(SKIP_PEEK(p)); ++p)
+            if (idigits < LONG_MAX / 4)
+                ++idigits;
+        nonzero = 1;
+    }
+    if (SKIP_PEEK(p) == '.') {
+        ++p;
+        if (!ISDIGIT(SKIP_PEEK(p)))
+            return JSON_PARSE_INVALID_VALUE;
+        for ( ; ISDIGIT(SKIP_PEEK(p)); ++p)
+            if (!nonzero) {
+                if (*p != '0')
+                    nonzero = 1;
+                else if (fzeros < LONG_MAX / 4)
+                    ++fzeros;
+            }
+    }
+    if (SKIP_PEEK(p) == 'e' || SKIP_PEEK(p) == 'E') {
+        ++p;
+        if (SKIP_PEEK(p) == '-' || SKIP_PEEK(p) == '+')
+            eneg = *p++ == '-';
+        if (!ISDIGIT(SKIP_PEEK(p)))
+            return JSON_PARSE_INVALID_VALUE;
+        for ( ; ISDIGIT(SKIP_PEEK(p)); ++p)
+            if (exp < LONG_MAX / 40)
+                exp = exp * 10 + (*p - '0');
+    }
+#undef SKIP_PEEK
+
+    /* Decimal exponent of the leading digit; only 308 needs strtod to decide. */
+    if (nonzero) {
+        mag = idigits > 0 ? idigits - 1 : -fzeros - 1;
+        mag += eneg ? -exp : exp;
+        if (mag > 308 || (mag == 308 && json_number_overflows(c->json, p)))
+            return JSON_PARSE_NUMBER_TOO_BIG;
+    }
+    c->json = p;
+    return JSON_PARSE_OK;
+}
+
+static const char *json_skip_hex4(const char *p, const char *end, unsigned *u)
+{
+    return end - p < 4 ? NULL : json_parse_hex4(p, u);
+}
+
+/*
+ * Whether any of the 8 bytes at p is '"', '\\' or a control character: the
+ * bytes that end a run of plain string characters. Bytes that are zero after
+ * the xor, or below 0x20, borrow into their top bit; bytes >= 0x80 are masked.
+ */
+#define JSON_SWAR_ONES  0x0101010101010101ULL
+#define JSON_SWAR_HIGHS 0x8080808080808080ULL
+
+static int json_swar_special(const char *p)
+{
+    uint64_t w, q, b;
+
+    memcpy(&w, p, sizeof(w));
+    q = w ^ (JSON_SWAR_ONES * '"');
+    b = w ^ (JSON_SWAR_ONES * '\\');
+    return ((((q - JSON_SWAR_ONES) & ~q) | ((b - JSON_SWAR_ONES) & ~b)
+        | ((w - JSON_SWAR_ONES * 0x20) & ~w)) & JSON_SWAR_HIGHS) != 0;
+}
+
+/* *len is the length of the decoded string, as json_parse_string_raw makes it. */
+static int json_skip_string_len(json_context *c, size_t *len)
 {
-    size_t head;
-    unsigned u, low = 0;  /* low surrogate */
     const char *p;
+    const char *end = c->end;
+    unsigned u, low;
+    size_t saved = 0;   /* bytes escapes save over their text */
+    u_char ch;
 
     EXPECT(c, '\"');
-    head = c->top;
     p = c->json;
     for ( ; ; ) {
-        char ch = *p++;
-        switch (ch) {
-        case '\"':
-            *len = c->top - head;
-            *str = (char *) malloc(*len + 1);
-            memcpy(*str, (const char *) json_context_pop(c, *len), *len);
-            (*str)[*len] = 0;
+        /* Skip plain runs a word at a time, then find the byte that ended it. */
+        while (end - p >= 8 && !json_swar_special(p))
+            p += 8;
+        do {
+            if (p >= end)
+                return JSON_PARSE_MISS_QUOTATION_MARK;
+            ch = (u_char) *p++;
+        } while (ch >= 0x20 && ch != '\"' && ch != '\\');
+        if (ch == '\"') {
+            *len = p - c->json - 1 - saved;
             c->json = p;
             return JSON_PARSE_OK;
-        case '\\':
-            switch (*p++) {
-            case '\\': PUTC(c, '\\'); break;
-            case '/':  PUTC(c, '/' ); break;
-            case '"': PUTC(c, '"'); break;
-            case 't':  PUTC(c, '\t'); break;
-            case 'b':  PUTC(c, '\b'); break;
-            case 'f':  PUTC(c, '\f'); break;
-            case 'n':  PUTC(c, '\n'); break;
-            case 'r':  PUTC(c, '\r'); break;
-            case 'u':  /* UTF-8 */
-                if (!(p = json_parse_hex4(p, &u)))
-                    STRING_ERROR(JSON_PARSE_INVALID_UNICODE_HEX);
-                if (u >= 0xd800 && u <= 0xdbff) { /* high surrogate */
-                    if (p[0] != '\\' || p[1] != 'u')
-                        STRING_ERROR(JSON_PARSE_INVALID_UNICODE_SURROGATE);
-                    if (!(p = json_parse_hex4(p + 2, &low)))
-                        STRING_ERROR(JSON_PARSE_INVALID_UNICODE_HEX);
+        } else if (ch == '\\') {
+            switch (p < end ? *p++ : '\0') {
+            case '\\': case '/': case '"':
+            case 't': case 'b': case 'f': case 'n': case 'r':
+                saved += 1;
+                break;
+            case 'u':
+                if (!(p = json_skip_hex4(p, end, &u)))
+                    return JSON_PARSE_INVALID_UNICODE_HEX;
+                if (u >= 0xd800 && u <= 0xdbff) {
+                    if (end - p < 2 || p[0] != '\\' || p[1] != 'u')
+                        return JSON_PARSE_INVALID_UNICODE_SURROGATE;
+                    if (!(p = json_skip_hex4(p + 2, end, &low)))
+                        return JSON_PARSE_INVALID_UNICODE_HEX;
                     if (low > 0xdfff || low < 0xdc00)
-                        STRING_ERROR(JSON_PARSE_INVALID_UNICODE_SURROGATE);
-                    u = 0x10000 + (u - 0xD800) * 0x400 + (low - 0xDC00);
-                }
-                json_encode_utf8(c, u);
+                        return JSON_PARSE_INVALID_UNICODE_SURROGATE;
+                    saved += 12 - 4;
+                } else
+                    saved += u <= 0x7f ? 6 - 1 : u <= 0x7ff ? 6 - 2 : 6 - 3;
                 break;
             default:
-                c->top = head;
                 return JSON_PARSE_INVALID_STRING_ESCAPE;
             }
-            break;
-        case '\0':
-            c->top = head;
+        } else if (ch == '\0') {
             return JSON_PARSE_MISS_QUOTATION_MARK;
-        default:
-            if (ch >= '\x00' && ch <= '\x1F') {
-                c->top = head;
-                return JSON_PARSE_INVALID_STRING_CHAR;
-            }
-            PUTC(c, ch);
+        } else {
+            return JSON_PARSE_INVALID_STRING_CHAR;
         }
     }
 }
 
-static int json_parse_string(json_context *c, json_value *v)
+static int json_skip_string(json_context *c)
 {
-    int ret;
-    char *s;
     size_t len;
-    if ((ret = json_parse_string_raw(c, &s, &len)) == JSON_PARSE_OK) {
-        json_set_string(v, s, len);
-        free(s);
-    }
-    return ret;
+
+    return json_skip_string_len(c, &len);
 }
 
-static int json_parse_value(json_context *c, json_value *v);
-static int json_parse_array(json_context *c, json_value *v)
+static int json_skip_value(json_context *c);
+static int json_skip_array(json_context *c)
 {
-    size_t size;
     int ret;
 
     EXPECT(c, '[');
-    size = 0;
     for ( ; ; ) {
-        json_parse_whitespace(c);
-        if (*c->json == ']') {
+        json_skip_whitespace(c);
+        if (PEEK(c) == ']') {
             c->json++;
-            v->type = JSON_ARRAY;
-            v->json_size = size;
-            size *= sizeof(json_value);
-            if (size > 0)
-                memcpy(v->json_e = (json_value *) malloc(size), json_context_pop(c, size), size);
-            else
-                v->json_e = NULL;
             return JSON_PARSE_OK;
+        }
+        if ((ret = json_skip_value(c)) != JSON_PARSE_OK)
+            return ret;
+        json_skip_whitespace(c);
+        if (PEEK(c) == ']') {
+            continue;
+        } else if (PEEK(c) == ',') {
+            c->json++;
+            if (PEEK(c) == ']')
+                return JSON_PARSE_INVALID_VALUE;
         } else {
-            json_value e;
-            json_init(&e);
-            if ((ret = json_parse_value(c, &e)) != JSON_PARSE_OK) {
-                goto free;
-            }
-            memcpy(json_context_push(c, sizeof(json_value)), &e, sizeof(json_value));
-            ++size;
-            json_parse_whitespace(c);
-            if (*c->json == ']') {
-                continue;
-            } else if (*c->json == ',') {
-                c->json++;
-                if (*c->json == ']') {
-                    ret = JSON_PARSE_INVALID_VALUE;
-                    goto free;
-                }
-            } else {
-                ret = JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
-                goto free;
-            }
+            return JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
         }
     }
-free:
-    while (c->top != 0)
-        json_free(json_context_pop(c, sizeof(json_value)));
-    return ret;
 }
 
-static void json_free_object_member(json_member *m);
-
-static int json_parse_object(json_context *c, json_value *v)
+static int json_skip_object(json_context *c)
 {
-    size_t size;
     int ret;
-    char *s;
-    size_t len;
-    json_member m;
 
     EXPECT(c, '{');
-    json_parse_whitespace(c);
-    if (*c->json == '}') {
+    json_skip_whitespace(c);
+    if (PEEK(c) == '}') {
         c->json++;
-        v->type = JSON_OBJECT;
-        v->json_m = NULL;
-        v->json_osz = 0;
         return JSON_PARSE_OK;
     }
-    m.k = NULL;
-    size = 0;
     for ( ; ; ) {
-        json_parse_whitespace(c);
-        if (*c->json != '\"') {
-            ret = JSON_PARSE_MISS_KEY;
-            goto free;
-        }
-        if ((ret = json_parse_string_raw(c, &s, &len)) != JSON_PARSE_OK)
-            goto free;
-        m.k = s;
-        m.klen = len;
-        json_parse_whitespace(c);
-        if (*c->json != ':') {
-            ret = JSON_PARSE_MISS_COLON;
-            goto miss_colon;
-        } else {
-            c->json++;
-        }
-        json_parse_whitespace(c);
-        json_init(&m.v);
-        if ((ret = json_parse_value(c, &m.v)) != JSON_PARSE_OK)
-            goto free;
-        memcpy(json_context_push(c, sizeof(json_member)), &m, sizeof(json_member));
-        ++size;
-        json_parse_whitespace(c);
-        if (*c->json == '}') {
+        json_skip_whitespace(c);
+        if (PEEK(c) != '\"')
+            return JSON_PARSE_MISS_KEY;
+        if ((ret = json_skip_string(c)) != JSON_PARSE_OK)
+            return ret;
+        json_skip_whitespace(c);
+        if (PEEK(c) != ':')
+            return JSON_PARSE_MISS_COLON;
+        c->json++;
+        json_skip_whitespace(c);
+        if ((ret = json_skip_value(c)) != JSON_PARSE_OK)
+            return ret;
+        json_skip_whitespace(c);
+        if (PEEK(c) == '}') {
             c->json++;
-            v->type = JSON_OBJECT;
-            v->json_osz = size;
-            size *= sizeof(json_member);
-            memcpy(v->json_m = (json_member *) malloc(size), json_context_pop(c, size), size);
             return JSON_PARSE_OK;
-        } else if (*c->json == ',') {
+        } else if (PEEK(c) == ',') {
             c->json++;
-            continue;
         } else {
-            ret = JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
-            goto free;
+            return JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
         }
-        m.k = NULL;
     }
-miss_colon:
-    free(m.k);
-free:
-    while (c->top != 0)
-        json_free_object_member(json_context_pop(c, sizeof(json_member)));
-    return ret;
 }
 
-/* value = null / false / true / number / array / object */
-static int json_parse_value(json_context *c, json_value *v)
+static int json_skip_value(json_context *c)
 {
-    switch (*c->json) {
-    case 'n':  return json_parse_literal(c, v, "null", JSON_NULL);
-    case 't':  return json_parse_literal(c, v, "true", JSON_TRUE);
-    case 'f':  return json_parse_literal(c, v, "false", JSON_FALSE);
-    case '\"': return json_parse_string(c, v);
-    case '[':  return json_parse_array(c, v);
-    case '{':  return json_parse_object(c, v);
+    switch (PEEK(c)) {
+    case 'n':  return json_skip_literal(c, "null");
+    case 't':  return json_skip_literal(c, "true");
+    case 'f':  return json_skip_literal(c, "false");
+    case '\"': return json_skip_string(c);
+    case '[':  return json_skip_array(c);
+    case '{':  return json_skip_object(c);
     case '\0': return JSON_PARSE_EXPECT_VALUE;
-    default:   return json_parse_number(c, v);
+    default:   return json_skip_number(c);
     }
 }
 
-void json_free(json_value *v)
-{
-    assert(v != NULL);
-    switch (v->type) {
-    case JSON_STRING:
-        free(v->json_s);
-        break;
-    case JSON_ARRAY:
-        for ( ; v->json_size > 0; v->json_size--)
-            json_free(&v->json_e[v->json_size - 1]);
-        free(v->json_e);
+#ifndef JSON_FREE_WORKLIST_SIZE
+#define JSON_FREE_WORKLIST_SIZE 64
+#endif
+
+#ifndef JSON_INDEX_MIN_SIZE
+#define JSON_INDEX_MIN_SIZE 16
+#endif
+
+/* Open-addressing table of member indices + 1, keyed by khash. */
+typedef struct {
+    size_t mask;
+    size_t slot[];
+} json_index;
+
+/*
+ * A private vector grown in place records its capacity, a power of two, as
+ * log2 + 1 in the flags bits from JSON_CAPACITY_SHIFT up. 0 there means
+ * exactly json_size slots, as every parsed, copied or shared vector has.
+ */
+#define JSON_CAPACITY_SHIFT 8
+#define JSON_CAPACITY_MASK  (~0u << JSON_CAPACITY_SHIFT)
+
+/* Header of a JSON_SHARED string or vector; the payload follows it. */
+typedef struct {
+    size_t refs;
+    json_index *index;  /* objects only: built by the first lookup, then read-only */
+} json_shared;
+
+static void *json_payload(const json_value *v)
+{
+    switch (v->type) {
+    case JSON_STRING: return v->json_s;
+    case JSON_ARRAY:  return v->json_e;
+    case JSON_OBJECT: return v->json_m;
+    default:          return NULL;
+    }
+}
+
+/* The allocation that holds v's payload. */
+static void *json_block(const json_value *v)
+{
+    void *p = json_payload(v);
+    return v->flags & JSON_SHARED ? (void *) ((json_shared *) p - 1) : p;
+}
+
+static void json_retain(const json_value *v)
+{
+    if (v->flags & JSON_SHARED)
+        __atomic_add_fetch(&((json_shared *) json_payload(v) - 1)->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* Drop a reference to v's payload; true if the caller must free it. */
+static int json_release(const json_value *v)
+{
+    if (!(v->flags & JSON_SHARED))
+        return 1;
+    return __atomic_sub_fetch(&((json_shared *) json_payload(v) - 1)->refs, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+typedef struct {
+    json_value v;       /* copy of the container being torn down */
+    size_t i;           /* next element or member to free */
+} json_free_frame;
+
+/*
+ * Containers being freed are kept on an explicit worklist of frames instead
+ * of the call stack, so deep inputs cannot overflow it. The worklist holds
+ * one frame per level of nesting and spills to the heap past
+ * JSON_FREE_WORKLIST_SIZE levels.
+ */
+static void json_free_value(json_value *v, const json_allocator *a)
+{
+    json_free_frame local[JSON_FREE_WORKLIST_SIZE];
+    json_free_frame *work = local, *f;
+    size_t top = 0, cap = JSON_FREE_WORKLIST_SIZE;
+    json_value *e;
+
+    if (v->type == JSON_STRING) {
+        if (json_release(v))
+            JSON_FREE(a, json_block(v));
+    } else if ((v->type == JSON_ARRAY || v->type == JSON_OBJECT) && json_release(v)) {
+        work[top].v = *v;
+        work[top++].i = 0;
+    }
+    v->type = JSON_NULL;
+    v->flags = 0;
+    while (top > 0) {
+        f = &work[top - 1];
+        if (f->i == (f->v.type == JSON_ARRAY ? f->v.json_size : f->v.json_osz)) {
+            if (f->v.type == JSON_OBJECT && (f->v.flags & JSON_SHARED))
+                JSON_FREE(a, ((json_shared *) f->v.json_m - 1)->index);
+            JSON_FREE(a, json_block(&f->v));
+            --top;
+            continue;
+        }
+        if (f->v.type == JSON_ARRAY)
+            e = &f->v.json_e[f->i++];
+        else {
+            JSON_FREE(a, f->v.json_m[f->i].k);
+            e = &f->v.json_m[f->i++].v;
+        }
+        if (e->type == JSON_STRING) {
+            if (json_release(e))
+                JSON_FREE(a, json_block(e));
+        } else if ((e->type == JSON_ARRAY || e->type == JSON_OBJECT) && json_release(e)) {
+            if (top == cap) {
+                if (work == local) {
+                    work = (json_free_frame *) JSON_MALLOC(a, (cap += cap >> 1) * sizeof(json_free_frame));
+                    memcpy(work, local, sizeof(local));
+                } else
+                    work = (json_free_frame *) JSON_REALLOC(a, work, (cap += cap >> 1) * sizeof(json_free_frame));
+            }
+            work[top].v = *e;
+            work[top++].i = 0;
+        }
+    }
+    if (work != local)
+        JSON_FREE(a, work);
+}
+
+void json_free(json_value *v)
+{
+    STAT_TIMER(t);
+
+    assert(v != NULL);
+    json_free_value(v, json_get_allocator());
+    STAT_PHASE(JSON_PHASE_FREE, t);
+}
+
+static void json_free_object_member(json_member *m, const json_allocator *a)
+{
+    json_free_value(&m->v, a);
+    JSON_FREE(a, m->k);
+}
+
+/*
+ * The parser leaves c->json where it stopped, so a failure costs one scan of
+ * the text before it to find the line; nothing is tracked while parsing.
+ */
+static void json_error_locate(json_error *e, const char *json, const char *at, int code)
+{
+    const char *line = json, *begin, *end, *p;
+    size_t i;
+
+    e->code = code;
+    e->offset = at - json;
+    e->line = 1;
+    for (p = json; (p = memchr(p, '\n', at - p)) != NULL; line = ++p)
+        e->line++;
+    e->column = at - line + 1;
+    /* The error's line, cut to a window around it if the line is long. */
+    begin = at - line > JSON_ERROR_EXCERPT_SIZE / 2 ? at - JSON_ERROR_EXCERPT_SIZE / 2 : line;
+    for (end = begin; end - begin < JSON_ERROR_EXCERPT_SIZE - 1 && *end != '\0' && *end != '\n'; ++end)
+        ;
+    for (i = 0; begin + i < end; ++i)
+        e->excerpt[i] = (u_char) begin[i] < 0x20 ? ' ' : begin[i];
+    e->excerpt[i] = '\0';
+    e->excerpt_column = at - begin;
+}
+
+/* Indexed by the JSON_PARSE_* flags; the choice costs one indirect call per text. */
+static int (*const json_parse_roots[JSON_PARSE_OPTIONS])(json_context *c, json_value *v) = {
+    json_parse_root, json_parse_root_1, json_parse_root_2, json_parse_root_3,
+    json_parse_root_4, json_parse_root_5, json_parse_root_6, json_parse_root_7,
+};
+
+int json_parse_opts(json_value *v, const char *json, unsigned flags, json_error *e)
+{
+    int ret;
+    json_context c;
+    STAT_TIMER(t);
+
+    assert(v != NULL);
+    assert(flags < JSON_PARSE_OPTIONS);
+    json_context_init(&c, json, NULL, json_get_allocator());
+    ret = json_parse_roots[flags](&c, v);
+    if (e != NULL) {
+        if (ret != JSON_PARSE_OK)
+            json_error_locate(e, json, c.json, ret);
+        else
+            e->code = ret;
+    }
+    JSON_FREE(c.a, c.stack);
+    STAT_PHASE(JSON_PHASE_PARSE, t);
+    return ret;
+}
+
+int json_parse_ex(json_value *v, const char *json, json_error *e)
+{
+    return json_parse_opts(v, json, 0, e);
+}
+
+int json_parse(json_value *v, const char *json)
+{
+    return json_parse_ex(v, json, NULL);
+}
+
+int json_validate(const char *json, size_t len)
+{
+    json_context c;
+    int ret;
+
+    assert(json != NULL);
+    json_context_init(&c, json, json + len, NULL);
+    json_skip_whitespace(&c);
+    if ((ret = json_skip_value(&c)) == JSON_PARSE_OK) {
+        json_skip_whitespace(&c);
+        if (c.json != c.end)
+            ret = JSON_PARSE_ROOT_NOT_SINGULAR;
+    }
+    return ret;
+}
+
+/*
+ * Fixed-capacity parsing. The scratch stack sits at the start of the nodes
+ * buffer and vectors are bumped after it; strings are bumped from their own
+ * buffer. Unless the buffers meet the worst-case bound, the text is first
+ * measured with the json_skip_* grammar, so the parse itself cannot run out.
+ */
+typedef struct {
+    size_t vectors, strings;
+    size_t top, peak;   /* of the scratch stack */
+} json_fixed_need;
+
+static int json_measure_value(json_context *c, json_fixed_need *m);
+
+static void json_measure_push(json_fixed_need *m, size_t size)
+{
+    m->top += size;
+    if (m->top > m->peak)
+        m->peak = m->top;
+}
+
+static int json_measure_string(json_context *c, json_fixed_need *m)
+{
+    size_t len;
+    int ret;
+
+    if ((ret = json_skip_string_len(c, &len)) == JSON_PARSE_OK) {
+        json_measure_push(m, len);
+        m->top -= len;
+        m->strings += len + 1;
+    }
+    return ret;
+}
+
+static int json_measure_array(json_context *c, json_fixed_need *m)
+{
+    size_t size = 0;
+    int ret;
+
+    EXPECT(c, '[');
+    for ( ; ; ) {
+        json_skip_whitespace(c);
+        if (PEEK(c) == ']') {
+            c->json++;
+            m->vectors += size;
+            m->top -= size;
+            return JSON_PARSE_OK;
+        }
+        if ((ret = json_measure_value(c, m)) != JSON_PARSE_OK)
+            return ret;
+        json_measure_push(m, sizeof(json_value));
+        size += sizeof(json_value);
+        json_skip_whitespace(c);
+        if (PEEK(c) == ']') {
+            continue;
+        } else if (PEEK(c) == ',') {
+            c->json++;
+            if (PEEK(c) == ']')
+                return JSON_PARSE_INVALID_VALUE;
+        } else {
+            return JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+        }
+    }
+}
+
+static int json_measure_object(json_context *c, json_fixed_need *m)
+{
+    size_t size = 0;
+    int ret;
+
+    EXPECT(c, '{');
+    json_skip_whitespace(c);
+    if (PEEK(c) == '}') {
+        c->json++;
+        return JSON_PARSE_OK;
+    }
+    for ( ; ; ) {
+        json_skip_whitespace(c);
+        if (PEEK(c) != '\"')
+            return JSON_PARSE_MISS_KEY;
+        if ((ret = json_measure_string(c, m)) != JSON_PARSE_OK)
+            return ret;
+        json_skip_whitespace(c);
+        if (PEEK(c) != ':')
+            return JSON_PARSE_MISS_COLON;
+        c->json++;
+        json_skip_whitespace(c);
+        if ((ret = json_measure_value(c, m)) != JSON_PARSE_OK)
+            return ret;
+        json_measure_push(m, sizeof(json_member));
+        size += sizeof(json_member);
+        json_skip_whitespace(c);
+        if (PEEK(c) == '}') {
+            c->json++;
+            m->vectors += size;
+            m->top -= size;
+            return JSON_PARSE_OK;
+        } else if (PEEK(c) == ',') {
+            c->json++;
+        } else {
+            return JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+        }
+    }
+}
+
+static int json_measure_value(json_context *c, json_fixed_need *m)
+{
+    switch (PEEK(c)) {
+    case '\"': return json_measure_string(c, m);
+    case '[':  return json_measure_array(c, m);
+    case '{':  return json_measure_object(c, m);
+    default:   return json_skip_value(c);
+    }
+}
+
+typedef struct {
+    char *p, *end;
+} json_bump;
+
+static void *json_bump_malloc(void *ud, size_t size)
+{
+    json_bump *b = (json_bump *) ud;
+    void *ret = b->p;
+
+    assert(size <= (size_t) (b->end - b->p));
+    b->p += size;
+    return ret;
+}
+
+static void *json_bump_realloc(void *ud, void *p, size_t size)
+{
+    (void) ud; (void) p; (void) size;
+    assert(0);  /* the fixed scratch stack never grows */
+    return NULL;
+}
+
+static void json_bump_free(void *ud, void *p)
+{
+    (void) ud; (void) p;
+}
+
+#define JSON_ALIGN8(n) (((n) + 7) & ~(size_t) 7)
+
+int json_parse_fixed(json_value *v, const char *json, json_buffers *b)
+{
+    size_t len, scratch;
+    json_context c;
+    json_fixed_need m = { 0, 0, 0, 0 };
+    json_bump nodes, strings;
+    json_allocator na = { json_bump_malloc, json_bump_realloc, json_bump_free, &nodes };
+    json_allocator sa = { json_bump_malloc, json_bump_realloc, json_bump_free, &strings };
+    int ret;
+
+    assert(v != NULL && json != NULL && b != NULL);
+    assert(((uintptr_t) b->nodes & 7) == 0);
+    len = strlen(json);
+    if (b->nodes_size >= JSON_FIXED_NODES_SIZE(len) && b->strings_size >= JSON_FIXED_STRINGS_SIZE(len)) {
+        /* pending elements fill at most the vectors' bound, plus one string */
+        scratch = JSON_ALIGN8(JSON_NODE_BYTES_PER_CHAR * len + len);
+    } else {
+        json_context_init(&c, json, json + len, NULL);
+        json_skip_whitespace(&c);
+        if ((ret = json_measure_value(&c, &m)) == JSON_PARSE_OK) {
+            json_skip_whitespace(&c);
+            if (c.json != c.end)
+                ret = JSON_PARSE_ROOT_NOT_SINGULAR;
+        }
+        json_init(v);
+        if (ret != JSON_PARSE_OK)
+            return ret;
+        scratch = JSON_ALIGN8(m.peak);
+        b->nodes_needed = scratch + m.vectors;
+        b->strings_needed = m.strings;
+        if (b->nodes_size < b->nodes_needed || b->strings_size < b->strings_needed)
+            return JSON_PARSE_CAPACITY_EXCEEDED;
+    }
+    nodes.p = (char *) b->nodes + scratch;
+    nodes.end = (char *) b->nodes + b->nodes_size;
+    strings.p = b->strings;
+    strings.end = b->strings + b->strings_size;
+    json_context_init(&c, json, NULL, &na);
+    c.sa = &sa;
+    c.stack = (char *) b->nodes;
+    c.size = scratch;
+    return json_parse_root(&c, v);
+}
+
+void json_parser_init(json_parser *p)
+{
+    assert(p != NULL);
+    p->stack = NULL;
+    p->size = 0;
+    p->shrink_size = JSON_PARSER_SHRINK_SIZE;
+    p->a = NULL;
+}
+
+void json_parser_free(json_parser *p)
+{
+    assert(p != NULL);
+    if (p->stack != NULL)
+        JSON_FREE(p->a, p->stack);
+    p->stack = NULL;
+    p->size = 0;
+}
+
+int json_parser_parse(json_parser *p, json_value *v, const char *json)
+{
+    int ret;
+    json_context c;
+    STAT_TIMER(t);
+
+    assert(p != NULL && v != NULL);
+    json_context_init(&c, json, NULL, json_get_allocator());
+    /* The stack belongs to whichever allocator grew it. */
+    if (p->a != c.a) {
+        json_parser_free(p);
+        p->a = c.a;
+    }
+    c.stack = p->stack;
+    c.size = p->size;
+    ret = json_parse_root(&c, v);
+    if (c.size > p->shrink_size) {
+        if (p->shrink_size == 0) {
+            JSON_FREE(c.a, c.stack);
+            c.stack = NULL;
+        } else
+            c.stack = (char *) JSON_REALLOC(c.a, c.stack, p->shrink_size);
+        c.size = p->shrink_size;
+    }
+    p->stack = c.stack;
+    p->size = c.size;
+    STAT_PHASE(JSON_PHASE_PARSE, t);
+    return ret;
+}
+
+void json_projection_init(json_projection *p)
+{
+    const json_allocator *a = json_get_allocator();
+
+    assert(p != NULL);
+    p->n = (json_projection_node *) JSON_MALLOC(a, sizeof(json_projection_node));
+    memset(p->n, 0, sizeof(json_projection_node));
+    p->size = p->capacity = 1;
+}
+
+void json_projection_free(json_projection *p)
+{
+    const json_allocator *a = json_get_allocator();
+    size_t i;
+
+    assert(p != NULL);
+    for (i = 0; i < p->size; ++i)
+        JSON_FREE(a, p->n[i].k);
+    JSON_FREE(a, p->n);
+    p->n = NULL;
+    p->size = p->capacity = 0;
+}
+
+static size_t json_projection_child(const json_projection *p, size_t node,
+        const char *k, size_t klen)
+{
+    size_t i;
+
+    for (i = p->n[node].child; i != 0; i = p->n[i].next)
+        if (p->n[i].klen == klen && memcmp(p->n[i].k, k, klen) == 0)
+            return i;
+    return 0;
+}
+
+int json_projection_add(json_projection *p, const char *ptr, size_t len)
+{
+    const json_allocator *a = json_get_allocator();
+    json_pointer path;
+    json_projection_node *n;
+    size_t i, node, child;
+    int ret;
+
+    assert(p != NULL && p->size > 0);
+    if ((ret = json_pointer_compile(&path, ptr, len)) != JSON_PARSE_OK)
+        return ret;
+    for (i = 0, node = 0; i < path.size && !p->n[node].leaf; ++i, node = child) {
+        const json_pointer_segment *seg = &path.s[i];
+        if ((child = json_projection_child(p, node, seg->k, seg->klen)) != 0)
+            continue;
+        if (p->size == p->capacity) {
+            p->capacity += p->capacity >> 1 ? p->capacity >> 1 : 1;
+            p->n = (json_projection_node *) JSON_REALLOC(a, p->n, p->capacity * sizeof(json_projection_node));
+        }
+        child = p->size++;
+        n = &p->n[child];
+        n->k = (char *) JSON_MALLOC(a, seg->klen + 1);
+        memcpy(n->k, seg->k, seg->klen + 1);
+        n->klen = seg->klen;
+        n->index = seg->index;
+        n->child = 0;
+        n->leaf = 0;
+        n->next = p->n[node].child;
+        p->n[node].child = child;
+    }
+    p->n[node].leaf = 1;
+    json_pointer_free(&path);
+    return JSON_PARSE_OK;
+}
+
+static size_t json_projection_element(const json_projection *p, size_t node, size_t index)
+{
+    size_t i;
+
+    for (i = p->n[node].child; i != 0; i = p->n[i].next)
+        if (p->n[i].index == index)
+            return i;
+    return 0;
+}
+
+/* Match the raw key at c->json against the children of node. */
+static int json_projection_key(json_context *c, const json_projection *p, size_t node,
+        size_t *child, json_member *m)
+{
+    const char *k = c->json + 1;
+    size_t klen;
+    int ret;
+
+    if ((ret = json_skip_string(c)) != JSON_PARSE_OK)
+        return ret;
+    klen = c->json - k - 1;
+    if (memchr(k, '\\', klen) == NULL) {
+        if ((*child = json_projection_child(p, node, k, klen)) != 0) {
+            m->k = (char *) JSON_MALLOC(c->a, klen + 1);
+            memcpy(m->k, k, klen);
+            m->k[klen] = '\0';
+            m->klen = klen;
+        }
+    } else {
+        c->json = k - 1;
+        if ((ret = json_parse_string_raw(c, &m->k, &m->klen)) != JSON_PARSE_OK)
+            return ret;
+        if ((*child = json_projection_child(p, node, m->k, m->klen)) == 0)
+            JSON_FREE(c->a, m->k);
+    }
+    if (*child != 0)
+        m->khash = json_hash_key(m->k, m->klen);
+    return JSON_PARSE_OK;
+}
+
+static int json_parse_projected(json_context *c, json_value *v,
+        const json_projection *p, size_t node, int *kept);
+
+static int json_parse_projected_object(json_context *c, json_value *v,
+        const json_projection *p, size_t node)
+{
+    size_t size = 0, child;
+    json_member m;
+    int ret, kept;
+
+    EXPECT(c, '{');
+    json_skip_whitespace(c);
+    if (PEEK(c) != '}') {
+        for ( ; ; ) {
+            json_skip_whitespace(c);
+            if (PEEK(c) != '\"') {
+                ret = JSON_PARSE_MISS_KEY;
+                goto free;
+            }
+            if ((ret = json_projection_key(c, p, node, &child, &m)) != JSON_PARSE_OK)
+                goto free;
+            json_skip_whitespace(c);
+            if (PEEK(c) != ':') {
+                ret = JSON_PARSE_MISS_COLON;
+                goto miss_colon;
+            }
+            c->json++;
+            json_skip_whitespace(c);
+            if (child == 0) {
+                if ((ret = json_skip_value(c)) != JSON_PARSE_OK)
+                    goto free;
+            } else {
+                json_init(&m.v);
+                if ((ret = json_parse_projected(c, &m.v, p, child, &kept)) != JSON_PARSE_OK)
+                    goto miss_colon;
+                if (kept) {
+                    memcpy(json_context_push(c, sizeof(json_member)), &m, sizeof(json_member));
+                    ++size;
+                } else
+                    JSON_FREE(c->a, m.k);
+            }
+            json_skip_whitespace(c);
+            if (PEEK(c) == '}')
+                break;
+            else if (PEEK(c) == ',')
+                c->json++;
+            else {
+                ret = JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+                goto free;
+            }
+        }
+    }
+    c->json++;
+    v->type = JSON_OBJECT;
+    v->json_osz = size;
+    v->json_m = NULL;
+    if (size > 0) {
+        size *= sizeof(json_member);
+        memcpy(v->json_m = (json_member *) JSON_MALLOC(c->a, size), json_context_pop(c, size), size);
+    }
+    return JSON_PARSE_OK;
+miss_colon:
+    if (child != 0)
+        JSON_FREE(c->a, m.k);
+free:
+    for ( ; size > 0; --size)
+        json_free_object_member(json_context_pop(c, sizeof(json_member)), c->a);
+    return ret;
+}
+
+static int json_parse_projected_array(json_context *c, json_value *v,
+        const json_projection *p, size_t node)
+{
+    size_t i, size = 0, child;
+    json_value e;
+    int ret, kept;
+
+    EXPECT(c, '[');
+    for (i = 0; ; ++i) {
+        json_skip_whitespace(c);
+        if (PEEK(c) == ']')
+            break;
+        json_init(&e);
+        if ((child = json_projection_element(p, node, i)) == 0)
+            ret = json_skip_value(c);
+        else if ((ret = json_parse_projected(c, &e, p, child, &kept)) == JSON_PARSE_OK && kept) {
+            /* Elements before this one that were skipped stay as nulls. */
+            for ( ; size < i; ++size) {
+                json_value *skipped = (json_value *) json_context_push(c, sizeof(json_value));
+                json_init(skipped);
+            }
+            memcpy(json_context_push(c, sizeof(json_value)), &e, sizeof(json_value));
+            ++size;
+        }
+        if (ret != JSON_PARSE_OK)
+            goto free;
+        json_skip_whitespace(c);
+        if (PEEK(c) == ']')
+            continue;
+        else if (PEEK(c) == ',') {
+            c->json++;
+            if (PEEK(c) == ']') {
+                ret = JSON_PARSE_INVALID_VALUE;
+                goto free;
+            }
+        } else {
+            ret = JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+            goto free;
+        }
+    }
+    c->json++;
+    v->type = JSON_ARRAY;
+    v->json_size = size;
+    v->json_e = NULL;
+    if (size > 0) {
+        size *= sizeof(json_value);
+        memcpy(v->json_e = (json_value *) JSON_MALLOC(c->a, size), json_context_pop(c, size), size);
+    }
+    return JSON_PARSE_OK;
+free:
+    for ( ; size > 0; --size)
+        json_free_value(json_context_pop(c, sizeof(json_value)), c->a);
+    return ret;
+}
+
+/* *kept is cleared for values that lie off every projected path. */
+static int json_parse_projected(json_context *c, json_value *v,
+        const json_projection *p, size_t node, int *kept)
+{
+    *kept = 1;
+    if (p->n[node].leaf)
+        return json_parse_value(c, v);
+    switch (PEEK(c)) {
+    case '{': return json_parse_projected_object(c, v, p, node);
+    case '[': return json_parse_projected_array(c, v, p, node);
+    default:
+        *kept = 0;
+        return json_skip_value(c);
+    }
+}
+
+int json_parse_projection(json_value *v, const char *json, const json_projection *p)
+{
+    json_context c;
+    int ret, kept;
+
+    assert(v != NULL && p != NULL && p->size > 0);
+    json_context_init(&c, json, json + strlen(json), json_get_allocator());
+    json_init(v);
+    json_skip_whitespace(&c);
+    if ((ret = json_parse_projected(&c, v, p, 0, &kept)) == JSON_PARSE_OK) {
+        json_skip_whitespace(&c);
+        if (c.json != c.end) {
+            json_free_value(v, c.a);
+            ret = JSON_PARSE_ROOT_NOT_SINGULAR;
+        }
+    }
+    assert(c.top == 0);
+    JSON_FREE(c.a, c.stack);
+    return ret;
+}
+
+static void json_stringify_string(json_context* c, const char* s, size_t len);
+
+/*
+ * Struct decoding follows the field table alone: no json_value is built,
+ * members without a field are skipped and keys are found by their FNV hash.
+ */
+static size_t json_field_size(json_field_type type, const json_schema *s)
+{
+    switch (type) {
+    case JSON_FIELD_BOOL:
+    case JSON_FIELD_INT:    return sizeof(int);
+    case JSON_FIELD_INT64:  return sizeof(long long);
+    case JSON_FIELD_DOUBLE: return sizeof(double);
+    case JSON_FIELD_STRING: return sizeof(char *);
+    default:                return s->size;
+    }
+}
+
+int json_schema_compile(json_schema *s, const json_field *fields, size_t count, size_t size)
+{
+    const json_allocator *a = json_get_allocator();
+    size_t i, j, n, klen, end;
+    json_context c;
+
+    assert(s != NULL && (fields != NULL || count == 0));
+    for (i = 0; i < count; ++i) {
+        const json_field *f = &fields[i];
+        json_field_type type = f->type == JSON_FIELD_ARRAY ? f->item : f->type;
+        if (f->name == NULL || type > JSON_FIELD_OBJECT || (type == JSON_FIELD_OBJECT && f->schema == NULL))
+            return JSON_SCHEMA_INVALID;
+        end = f->type == JSON_FIELD_ARRAY ? sizeof(json_field_array) : json_field_size(f->type, f->schema);
+        if (f->offset > size || end > size - f->offset)
+            return JSON_SCHEMA_INVALID;
+        for (j = 0; j < i; ++j)
+            if (strcmp(fields[j].name, f->name) == 0)
+                return JSON_SCHEMA_INVALID;
+    }
+    /* Keys are escaped once here rather than on every json_encode_struct. */
+    json_context_init(&c, NULL, NULL, a);
+    s->kpos = (size_t *) JSON_MALLOC(a, (count + 1) * sizeof(size_t));
+    for (i = 0; i < count; ++i) {
+        s->kpos[i] = c.top;
+        if (i > 0)
+            PUTC(&c, ',');
+        json_stringify_string(&c, fields[i].name, strlen(fields[i].name));
+        PUTC(&c, ':');
+    }
+    s->kpos[count] = c.top;
+    s->keys = c.stack;
+    /* At most half full, so every probe sequence ends at an empty slot. */
+    for (n = 2; n < 2 * count; n <<= 1)
+        ;
+    s->fields = fields;
+    s->count = count;
+    s->size = size;
+    s->mask = n - 1;
+    s->slots = (json_schema_slot *) JSON_MALLOC(a, n * sizeof(json_schema_slot));
+    memset(s->slots, 0, n * sizeof(json_schema_slot));
+    for (i = 0; i < count; ++i) {
+        unsigned h = json_hash_key(fields[i].name, klen = strlen(fields[i].name));
+        for (j = h & s->mask; s->slots[j].field != 0; j = (j + 1) & s->mask)
+            ;
+        s->slots[j].khash = h;
+        s->slots[j].klen = klen;
+        s->slots[j].field = i + 1;
+    }
+    return JSON_PARSE_OK;
+}
+
+void json_schema_free(json_schema *s)
+{
+    const json_allocator *a = json_get_allocator();
+
+    assert(s != NULL);
+    JSON_FREE(a, s->slots);
+    JSON_FREE(a, s->keys);
+    JSON_FREE(a, s->kpos);
+    s->slots = NULL;
+    s->keys = NULL;
+    s->kpos = NULL;
+    s->count = 0;
+}
+
+static const json_field *json_schema_find(const json_schema *s, const char *k, size_t klen)
+{
+    unsigned h = json_hash_key(k, klen);
+    const json_schema_slot *slot;
+    size_t i;
+
+    for (i = h & s->mask; (slot = &s->slots[i])->field != 0; i = (i + 1) & s->mask)
+        if (slot->khash == h && slot->klen == klen && memcmp(s->fields[slot->field - 1].name, k, klen) == 0)
+            return &s->fields[slot->field - 1];
+    return NULL;
+}
+
+static void json_free_fields(char *base, const json_schema *s, const json_allocator *a);
+
+static void json_free_field(char *p, json_field_type type, const json_schema *s, const json_allocator *a)
+{
+    if (type == JSON_FIELD_STRING)
+        JSON_FREE(a, *(char **) p);
+    else if (type == JSON_FIELD_OBJECT)
+        json_free_fields(p, s, a);
+}
+
+static void json_free_field_array(json_field_array *arr, const json_field *f, const json_allocator *a)
+{
+    size_t i, size = json_field_size(f->item, f->schema);
+
+    for (i = 0; i < arr->size; ++i)
+        json_free_field((char *) arr->e + i * size, f->item, f->schema, a);
+    JSON_FREE(a, arr->e);
+}
+
+static void json_free_fields(char *base, const json_schema *s, const json_allocator *a)
+{
+    size_t i;
+
+    for (i = 0; i < s->count; ++i) {
+        const json_field *f = &s->fields[i];
+        if (f->type == JSON_FIELD_ARRAY)
+            json_free_field_array((json_field_array *) (base + f->offset), f, a);
+        else
+            json_free_field(base + f->offset, f->type, f->schema, a);
+    }
+}
+
+void json_free_struct(void *out, const json_schema *s)
+{
+    assert(out != NULL && s != NULL);
+    json_free_fields((char *) out, s, json_get_allocator());
+    memset(out, 0, s->size);
+}
+
+static int json_decode_fields(json_context *c, char *base, const json_schema *s);
+
+/*
+ * The exact integer value of the validated number token [s, e), read from
+ * its digits in 64 bits as JSON_PARSE_INTEGERS does, so no double rounds it.
+ * A fraction or exponent is fine while the value stays integral.
+ */
+static int json_decode_integer(const char *s, const char *e, long long *out)
+{
+    uint64_t u = 0, limit;
+    long long exp = 0, scale;
+    const char *p, *dot = NULL, *last = NULL;
+    int neg = *s == '-', expneg = 0;
+
+    limit = neg ? (uint64_t) LLONG_MAX + 1 : (uint64_t) LLONG_MAX;
+    for (p = s + neg; p < e && *p != 'e' && *p != 'E'; ++p) {
+        if (*p == '.')
+            dot = p;
+        else if (*p != '0')
+            last = p;
+    }
+    if (dot == NULL)
+        dot = p;
+    if (p < e) {
+        expneg = *++p == '-';
+        for (p += *p == '-' || *p == '+'; p < e; ++p)
+            if (exp < (LLONG_MAX - 9) / 10)
+                exp = exp * 10 + (*p - '0');
+    }
+    if (last == NULL) {
+        *out = 0;
+        return JSON_PARSE_OK;
+    }
+    /* The digits up to the last nonzero one, times 10^scale. */
+    scale = last < dot ? dot - last - 1 : -(last - dot);
+    scale += expneg ? -exp : exp;
+    if (scale < 0)
+        return JSON_DECODE_TYPE_MISMATCH;
+    for (p = s + neg; p <= last; ++p) {
+        if (*p == '.')
+            continue;
+        if (u > (limit - (*p - '0')) / 10)
+            return JSON_DECODE_TYPE_MISMATCH;
+        u = u * 10 + (*p - '0');
+    }
+    for ( ; scale > 0; --scale) {
+        if (u > limit / 10)
+            return JSON_DECODE_TYPE_MISMATCH;
+        u *= 10;
+    }
+    *out = neg ? -(long long) (u - 1) - 1 : (long long) u;
+    return JSON_PARSE_OK;
+}
+
+/* Decode one non-null value of the given type into p. */
+static int json_decode_field(json_context *c, char *p, json_field_type type, const json_schema *s)
+{
+    json_value v;
+    const char *start = c->json;
+    long long integer;
+    char *str;
+    size_t len;
+    int ret;
+
+    switch (type) {
+    case JSON_FIELD_BOOL:
+        if (PEEK(c) == 't')
+            ret = json_parse_literal(c, &v, "true", JSON_TRUE);
+        else if (PEEK(c) == 'f')
+            ret = json_parse_literal(c, &v, "false", JSON_FALSE);
+        else
+            return JSON_DECODE_TYPE_MISMATCH;
+        if (ret == JSON_PARSE_OK)
+            *(int *) p = v.type == JSON_TRUE;
+        return ret;
+    case JSON_FIELD_INT:
+    case JSON_FIELD_INT64:
+    case JSON_FIELD_DOUBLE:
+        if (PEEK(c) != '-' && !ISDIGIT(PEEK(c)))
+            return JSON_DECODE_TYPE_MISMATCH;
+        if ((ret = json_parse_number(c, &v)) != JSON_PARSE_OK)
+            return ret;
+        if (type == JSON_FIELD_DOUBLE) {
+            *(double *) p = v.json_n;
+            return JSON_PARSE_OK;
+        }
+        if ((ret = json_decode_integer(start, c->json, &integer)) != JSON_PARSE_OK)
+            return ret;
+        if (type == JSON_FIELD_INT64)
+            *(long long *) p = integer;
+        else if (integer < INT_MIN || integer > INT_MAX)
+            return JSON_DECODE_TYPE_MISMATCH;
+        else
+            *(int *) p = (int) integer;
+        return JSON_PARSE_OK;
+    case JSON_FIELD_STRING:
+        if (PEEK(c) != '\"')
+            return JSON_DECODE_TYPE_MISMATCH;
+        if ((ret = json_parse_string_raw(c, &str, &len)) != JSON_PARSE_OK)
+            return ret;
+        JSON_FREE(c->a, *(char **) p);
+        *(char **) p = str;
+        return JSON_PARSE_OK;
+    default:
+        if (PEEK(c) != '{')
+            return JSON_DECODE_TYPE_MISMATCH;
+        /* A repeated member replaces the whole struct. */
+        json_free_fields(p, s, c->a);
+        memset(p, 0, s->size);
+        return json_decode_fields(c, p, s);
+    }
+}
+
+/* Elements are decoded in place, so arr is consistent whenever this fails. */
+static int json_decode_field_array(json_context *c, json_field_array *arr, const json_field *f)
+{
+    size_t size = json_field_size(f->item, f->schema), capacity = 0;
+    char *e;
+    int ret;
+
+    if (PEEK(c) != '[')
+        return JSON_DECODE_TYPE_MISMATCH;
+    json_free_field_array(arr, f, c->a);
+    arr->e = NULL;
+    arr->size = 0;
+    c->json++;
+    json_skip_whitespace(c);
+    if (PEEK(c) == ']') {
+        c->json++;
+        return JSON_PARSE_OK;
+    }
+    for ( ; ; ) {
+        json_skip_whitespace(c);
+        if (arr->size == capacity) {
+            capacity += capacity >> 1 ? capacity >> 1 : 4;
+            arr->e = JSON_REALLOC(c->a, arr->e, capacity * size);
+        }
+        e = (char *) arr->e + arr->size * size;
+        memset(e, 0, size);
+        if (PEEK(c) == 'n')
+            ret = json_skip_literal(c, "null");
+        else
+            ret = json_decode_field(c, e, f->item, f->schema);
+        if (ret != JSON_PARSE_OK)
+            return ret;
+        arr->size++;
+        json_skip_whitespace(c);
+        if (PEEK(c) == ']') {
+            c->json++;
+            return JSON_PARSE_OK;
+        } else if (PEEK(c) == ',')
+            c->json++;
+        else
+            return JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+    }
+}
+
+/* Keys without escapes are matched in the text itself. */
+static int json_decode_key(json_context *c, const json_schema *s, const json_field **f)
+{
+    const char *k = c->json + 1;
+    char *unescaped;
+    size_t klen;
+    int ret;
+
+    if ((ret = json_skip_string(c)) != JSON_PARSE_OK)
+        return ret;
+    klen = c->json - k - 1;
+    if (memchr(k, '\\', klen) == NULL) {
+        *f = json_schema_find(s, k, klen);
+        return JSON_PARSE_OK;
+    }
+    c->json = k - 1;
+    if ((ret = json_parse_string_raw(c, &unescaped, &klen)) != JSON_PARSE_OK)
+        return ret;
+    *f = json_schema_find(s, unescaped, klen);
+    JSON_FREE(c->a, unescaped);
+    return JSON_PARSE_OK;
+}
+
+static int json_decode_fields(json_context *c, char *base, const json_schema *s)
+{
+    const json_field *f;
+    int ret;
+
+    EXPECT(c, '{');
+    json_skip_whitespace(c);
+    if (PEEK(c) == '}') {
+        c->json++;
+        return JSON_PARSE_OK;
+    }
+    for ( ; ; ) {
+        json_skip_whitespace(c);
+        if (PEEK(c) != '\"')
+            return JSON_PARSE_MISS_KEY;
+        if ((ret = json_decode_key(c, s, &f)) != JSON_PARSE_OK)
+            return ret;
+        json_skip_whitespace(c);
+        if (PEEK(c) != ':')
+            return JSON_PARSE_MISS_COLON;
+        c->json++;
+        json_skip_whitespace(c);
+        if (f == NULL)
+            ret = json_skip_value(c);
+        else if (PEEK(c) == 'n')
+            ret = json_skip_literal(c, "null");
+        else if (f->type == JSON_FIELD_ARRAY)
+            ret = json_decode_field_array(c, (json_field_array *) (base + f->offset), f);
+        else
+            ret = json_decode_field(c, base + f->offset, f->type, f->schema);
+        if (ret != JSON_PARSE_OK)
+            return ret;
+        json_skip_whitespace(c);
+        if (PEEK(c) == '}') {
+            c->json++;
+            return JSON_PARSE_OK;
+        } else if (PEEK(c) == ',')
+            c->json++;
+        else
+            return JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+    }
+}
+
+int json_decode_struct(void *out, const char *json, const json_schema *s)
+{
+    json_context c;
+    int ret;
+
+    assert(out != NULL && json != NULL && s != NULL);
+    json_context_init(&c, json, json + strlen(json), json_get_allocator());
+    memset(out, 0, s->size);
+    json_skip_whitespace(&c);
+    if (PEEK(&c) == '{')
+        ret = json_decode_fields(&c, (char *) out, s);
+    else if ((ret = json_skip_value(&c)) == JSON_PARSE_OK)
+        ret = JSON_DECODE_TYPE_MISMATCH;
+    if (ret == JSON_PARSE_OK) {
+        json_skip_whitespace(&c);
+        if (c.json != c.end)
+            ret = JSON_PARSE_ROOT_NOT_SINGULAR;
+    }
+    if (ret != JSON_PARSE_OK)
+        json_free_struct(out, s);
+    assert(c.top == 0);
+    JSON_FREE(c.a, c.stack);
+    return ret;
+}
+
+#ifndef JSON_PARSE_PARALLEL_MIN_SIZE
+#define JSON_PARSE_PARALLEL_MIN_SIZE 65536
+#endif
+
+typedef struct {
+    const char *json;
+    const size_t *off;  /* off[i] is the '[' or ',' before element i */
+    json_value *e;
+    size_t begin, end;
+    const json_allocator *a;
+    int ret;
+    int started;
+    pthread_t thread;
+} json_parse_chunk;
+
+/*
+ * Find the delimiters between top-level elements without validating them.
+ * Returns the number of elements, or 0 when the text needs the sequential
+ * parser (not an array, too small, or malformed in a way the scan can see).
+ */
+static size_t json_parse_prescan(const char *json, size_t **off, const json_allocator *a)
+{
+    const char *p;
+    size_t n = 0, cap = 1024, depth = 0, close;
+
+    *off = (size_t *) JSON_MALLOC(a, cap * sizeof(size_t));
+    (*off)[n++] = 0;
+    for (p = json; ; ++p) {
+        switch (*p) {
+        case '\"':
+            for (++p; *p != '\"'; ++p)
+                if (*p == '\0' || (*p == '\\' && *++p == '\0'))
+                    return 0;
+            break;
+        case '[':
+        case '{':
+            ++depth;
+            break;
+        case ']':
+        case '}':
+            if (--depth == 0)
+                goto close;
+            break;
+        case ',':
+            if (depth > 1)
+                break;
+            if (n == cap)
+                *off = (size_t *) JSON_REALLOC(a, *off, (cap += cap >> 1) * sizeof(size_t));
+            (*off)[n++] = p - json;
+            break;
+        case '\0':
+            return 0;
+        }
+    }
+close:
+    if (*p != ']' || (close = p - json) < JSON_PARSE_PARALLEL_MIN_SIZE)
+        return 0;
+    for (++p; *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'; ++p)
+        ;
+    if (*p != '\0')
+        return 0;
+    if (n == cap)
+        *off = (size_t *) JSON_REALLOC(a, *off, (cap + 1) * sizeof(size_t));
+    (*off)[n] = close;
+    return n;
+}
+
+static void *json_parse_chunk_run(void *arg)
+{
+    json_parse_chunk *k = (json_parse_chunk *) arg;
+    json_context c;
+    size_t i;
+
+    json_context_init(&c, NULL, NULL, k->a);
+    k->ret = JSON_PARSE_OK;
+    for (i = k->begin; i < k->end; ++i) {
+        c.json = k->json + k->off[i] + 1;
+        json_init(&k->e[i]);
+        json_parse_whitespace(&c);
+        if ((k->ret = json_parse_value(&c, &k->e[i])) != JSON_PARSE_OK)
+            break;
+        json_parse_whitespace(&c);
+        if (c.json != k->json + k->off[i + 1]) {
+            json_free_value(&k->e[i], c.a);
+            k->ret = JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+            break;
+        }
+    }
+    if (k->ret != JSON_PARSE_OK)
+        while (i-- > k->begin)
+            json_free_value(&k->e[i], c.a);
+    JSON_FREE(c.a, c.stack);
+    return NULL;
+}
+
+int json_parse_parallel(json_value *v, const char *json, unsigned nthreads)
+{
+    const json_allocator *a = json_get_allocator();
+    json_parse_chunk *k;
+    const char *p;
+    size_t *off, n, i, t, bytes;
+    int ret = JSON_PARSE_OK;
+
+    assert(v != NULL && json != NULL);
+    for (p = json; *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'; ++p)
+        ;
+    if (nthreads <= 1 || *p != '[')
+        return json_parse(v, json);
+    if ((n = json_parse_prescan(p, &off, a)) < nthreads) {
+        JSON_FREE(a, off);
+        return json_parse(v, json);
+    }
+
+    k = (json_parse_chunk *) JSON_MALLOC(a, nthreads * sizeof(json_parse_chunk));
+    json_init(v);
+    v->json_e = (json_value *) JSON_MALLOC(a, n * sizeof(json_value));
+    /* Split on element boundaries into chunks of about the same byte size. */
+    bytes = off[n] / nthreads + 1;
+    for (t = 0, i = 0; t < nthreads; ++t) {
+        k[t].json = p;
+        k[t].off = off;
+        k[t].e = v->json_e;
+        k[t].a = a;
+        k[t].begin = i;
+        while (i < n && (t == nthreads - 1 || off[i] < bytes * (t + 1)))
+            ++i;
+        k[t].end = i;
+    }
+    for (t = 1; t < nthreads; ++t)
+        k[t].started = pthread_create(&k[t].thread, NULL, json_parse_chunk_run, &k[t]) == 0;
+    json_parse_chunk_run(&k[0]);
+    for (t = 1; t < nthreads; ++t)
+        if (k[t].started)
+            pthread_join(k[t].thread, NULL);
+        else
+            json_parse_chunk_run(&k[t]);
+    for (t = 0; t < nthreads; ++t)
+        if (k[t].ret != JSON_PARSE_OK)
+            ret = k[t].ret;
+
+    if (ret == JSON_PARSE_OK) {
+        v->type = JSON_ARRAY;
+        v->json_size = n;
+    } else {
+        /* Let the sequential parser report the first error in text order. */
+        for (t = 0; t < nthreads; ++t)
+            if (k[t].ret == JSON_PARSE_OK)
+                for (i = k[t].begin; i < k[t].end; ++i)
+                    json_free_value(&v->json_e[i], a);
+        JSON_FREE(a, v->json_e);
+        ret = json_parse(v, json);
+    }
+    JSON_FREE(a, k);
+    JSON_FREE(a, off);
+    return ret;
+}
+
+typedef struct json_reclaim_node json_reclaim_node;
+struct json_reclaim_node {
+    json_reclaim_node *next;
+    const json_allocator *a;    /* the allocator the tree came from */
+    json_value v;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work, idle;
+    json_reclaim_node *head;
+    int busy;
+    int started;
+} json_reclaim = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0 };
+
+static void *json_reclaim_run(void *arg)
+{
+    json_reclaim_node *n, *next;
+
+    (void) arg;
+    pthread_mutex_lock(&json_reclaim.lock);
+    for ( ; ; ) {
+        while (json_reclaim.head == NULL) {
+            json_reclaim.busy = 0;
+            pthread_cond_broadcast(&json_reclaim.idle);
+            pthread_cond_wait(&json_reclaim.work, &json_reclaim.lock);
+        }
+        n = json_reclaim.head;
+        json_reclaim.head = NULL;
+        json_reclaim.busy = 1;
+        pthread_mutex_unlock(&json_reclaim.lock);
+        for ( ; n != NULL; n = next) {
+            next = n->next;
+            json_free_value(&n->v, n->a);
+            JSON_FREE(n->a, n);
+        }
+        pthread_mutex_lock(&json_reclaim.lock);
+    }
+    return NULL;
+}
+
+void json_free_deferred(json_value *v)
+{
+    const json_allocator *a = json_get_allocator();
+    json_reclaim_node *n;
+    pthread_t thread;
+
+    assert(v != NULL);
+    if ((v->type != JSON_ARRAY && v->type != JSON_OBJECT)
+            || (n = (json_reclaim_node *) JSON_MALLOC(a, sizeof(json_reclaim_node))) == NULL) {
+        json_free(v);
+        return;
+    }
+    n->a = a;
+    n->v = *v;
+    v->type = JSON_NULL;
+    pthread_mutex_lock(&json_reclaim.lock);
+    if (!json_reclaim.started && pthread_create(&thread, NULL, json_reclaim_run, NULL) == 0) {
+        pthread_detach(thread);
+        json_reclaim.started = 1;
+    }
+    if (json_reclaim.started) {
+        n->next = json_reclaim.head;
+        json_reclaim.head = n;
+        pthread_cond_signal(&json_reclaim.work);
+        n = NULL;
+    }
+    pthread_mutex_unlock(&json_reclaim.lock);
+    /* No reclaimer thread: pay for the teardown here. */
+    if (n != NULL) {
+        json_free_value(&n->v, a);
+        JSON_FREE(a, n);
+    }
+}
+
+void json_free_wait(void)
+{
+    pthread_mutex_lock(&json_reclaim.lock);
+    while (json_reclaim.head != NULL || json_reclaim.busy)
+        pthread_cond_wait(&json_reclaim.idle, &json_reclaim.lock);
+    pthread_mutex_unlock(&json_reclaim.lock);
+}
+
+static void json_share_value(json_value *v, const json_allocator *a)
+{
+    json_shared *b;
+    size_t i, size;
+    void *p;
+
+    if (v->flags & JSON_SHARED)
+        return;
+    switch (v->type) {
+    case JSON_STRING:
+        size = v->json_len + 1;
+        break;
+    case JSON_ARRAY:
+        for (i = 0; i < v->json_size; ++i)
+            json_share_value(&v->json_e[i], a);
+        size = v->json_size * sizeof(json_value);
+        break;
+    case JSON_OBJECT:
+        for (i = 0; i < v->json_osz; ++i)
+            json_share_value(&v->json_m[i].v, a);
+        size = v->json_osz * sizeof(json_member);
+        break;
+    default:
+        return;
+    }
+    if ((p = json_payload(v)) == NULL)
+        return;
+    b = (json_shared *) JSON_MALLOC(a, sizeof(json_shared) + size);
+    b->refs = 1;
+    b->index = NULL;
+    memcpy(b + 1, p, size);
+    JSON_FREE(a, p);
+    switch (v->type) {
+    case JSON_STRING: v->json_s = (char *) (b + 1); break;
+    case JSON_ARRAY:  v->json_e = (json_value *) (b + 1); break;
+    default:          v->json_m = (json_member *) (b + 1); break;
+    }
+    v->flags = (v->flags & ~JSON_CAPACITY_MASK) | JSON_SHARED;
+}
+
+void json_share(json_value *v)
+{
+    assert(v != NULL);
+    json_share_value(v, json_get_allocator());
+}
+
+/* Shared nodes and scalars are copied by reference, the rest level by level. */
+static void json_copy_value(json_value *dst, const json_value *src, const json_allocator *a)
+{
+    size_t i;
+
+    if ((src->flags & JSON_SHARED) || (src->type != JSON_STRING && src->type != JSON_ARRAY
+            && src->type != JSON_OBJECT)) {
+        *dst = *src;
+        json_retain(src);
+        return;
+    }
+    dst->type = src->type;
+    dst->flags = 0;
+    switch (src->type) {
+    case JSON_STRING:
+        dst->json_s = (char *) JSON_MALLOC(a, src->json_len + 1);
+        memcpy(dst->json_s, src->json_s, src->json_len + 1);
+        dst->json_len = src->json_len;
+        break;
+    case JSON_ARRAY:
+        dst->json_size = src->json_size;
+        dst->json_e = src->json_size > 0
+            ? (json_value *) JSON_MALLOC(a, src->json_size * sizeof(json_value)) : NULL;
+        for (i = 0; i < src->json_size; ++i)
+            json_copy_value(&dst->json_e[i], &src->json_e[i], a);
+        break;
+    default:
+        dst->json_osz = src->json_osz;
+        dst->json_m = src->json_osz > 0
+            ? (json_member *) JSON_MALLOC(a, src->json_osz * sizeof(json_member)) : NULL;
+        for (i = 0; i < src->json_osz; ++i) {
+            const json_member *m = &src->json_m[i];
+            dst->json_m[i].k = (char *) JSON_MALLOC(a, m->klen + 1);
+            memcpy(dst->json_m[i].k, m->k, m->klen + 1);
+            dst->json_m[i].klen = m->klen;
+            dst->json_m[i].khash = m->khash;
+            json_copy_value(&dst->json_m[i].v, &m->v, a);
+        }
+        break;
+    }
+}
+
+void json_copy(json_value *dst, const json_value *src)
+{
+    const json_allocator *a = json_get_allocator();
+
+    assert(dst != NULL && src != NULL && dst != src);
+    json_free_value(dst, a);
+    json_copy_value(dst, src, a);
+}
+
+void json_unshare(json_value *v)
+{
+    const json_allocator *a = json_get_allocator();
+    json_value old, view;
+
+    assert(v != NULL);
+    if (!(v->flags & JSON_SHARED))
+        return;
+    /* Copy one level; the children stay shared and gain a reference. */
+    old = view = *v;
+    view.flags &= ~JSON_SHARED;
+    json_copy_value(v, &view, a);
+    json_free_value(&old, a);
+}
+
+json_type json_get_type(const json_value *v)
+{
+    assert(v != NULL);
+    return v->type;
+}
+
+int json_get_boolean(const json_value *v)
+{
+    assert(v != NULL && (v->type == JSON_TRUE || v->type == JSON_FALSE));
+    return v->type == JSON_TRUE;
+}
+
+void json_set_boolean(json_value *v, int b)
+{
+    json_free(v);
+    v->type = b ? JSON_TRUE : JSON_FALSE;
+}
+
+double json_get_number(const json_value *v)
+{
+    assert(v != NULL && v->type == JSON_NUMBER);
+    return v->json_n;
+}
+
+void json_set_number(json_value *v, double n)
+{
+    json_free(v);
+    v->json_n = n;
+    v->type = JSON_NUMBER;
+}
+
+const char *json_get_string(const json_value *v)
+{
+    assert(v != NULL && v->type == JSON_STRING);
+    return v->json_s;
+}
+
+void json_set_string(json_value *v, const char *s, size_t len)
+{
+    const json_allocator *a = json_get_allocator();
+
+    assert(v != NULL && (s != NULL || len == 0));
+    json_free_value(v, a);
+    v->json_s = (char *) JSON_MALLOC(a, len + 1);
+    memcpy(v->json_s, s, len);
+    v->json_s[len] = 0;
+    v->json_len = len;
+    v->type = JSON_STRING;
+}
+
+size_t json_get_string_length(const json_value *v)
+{
+    assert(v != NULL && v->type == JSON_STRING);
+    return v->json_len;
+}
+
+json_value *json_get_array_element(const json_value *v, size_t index)
+{
+    assert(v != NULL && v->type == JSON_ARRAY);
+    assert(index < v->json_size);
+    return &v->json_e[index];
+}
+
+size_t json_get_array_size(const json_value *v)
+{
+    assert(v != NULL && v->type == JSON_ARRAY);
+    return v->json_size;
+}
+
+size_t json_get_object_size(const json_value *v)
+{
+    assert(v != NULL && v->type == JSON_OBJECT);
+    return v->json_osz;
+}
+
+const char *json_get_object_key(const json_value *v, size_t index)
+{
+    assert(v != NULL && v->type == JSON_OBJECT);
+    return v->json_m[index].k;
+}
+
+size_t json_get_object_key_length(const json_value *v, size_t index)
+{
+    assert(v != NULL && v->type == JSON_OBJECT);
+    return v->json_m[index].klen;
+}
+
+json_value *json_get_object_value(const json_value *v, size_t index)
+{
+    assert(v != NULL && v->type == JSON_OBJECT);
+    return &v->json_m[index].v;
+}
+
+/*
+ * Shared objects never change, so a lookup index can be cached on them.
+ * Readers race to build it; the first compare-and-swap publishes its
+ * table and the others free theirs.
+ */
+static const json_index *json_object_index(const json_value *v)
+{
+    const json_allocator *a = json_get_allocator();
+    json_shared *b = (json_shared *) v->json_m - 1;
+    json_index *ix, *expected = NULL;
+    size_t i, h, cap;
+
+    if ((ix = __atomic_load_n(&b->index, __ATOMIC_ACQUIRE)) != NULL)
+        return ix;
+    for (cap = 2 * JSON_INDEX_MIN_SIZE; cap < 2 * v->json_osz; cap <<= 1)
+        ;
+    if ((ix = (json_index *) JSON_MALLOC(a, sizeof(json_index) + cap * sizeof(size_t))) == NULL)
+        return NULL;
+    ix->mask = cap - 1;
+    memset(ix->slot, 0, cap * sizeof(size_t));
+    /* Later duplicates never displace the first, matching the linear scan. */
+    for (i = 0; i < v->json_osz; ++i) {
+        for (h = v->json_m[i].khash & ix->mask; ix->slot[h] != 0; h = (h + 1) & ix->mask)
+            ;
+        ix->slot[h] = i + 1;
+    }
+    if (!__atomic_compare_exchange_n(&b->index, &expected, ix, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        JSON_FREE(a, ix);
+        ix = expected;
+    }
+    return ix;
+}
+
+static size_t json_find_member(const json_value *v, const char *key, size_t klen, unsigned khash)
+{
+    const json_index *ix;
+    size_t i, h;
+
+    if ((v->flags & JSON_SHARED) && v->json_osz >= JSON_INDEX_MIN_SIZE
+            && (ix = json_object_index(v)) != NULL) {
+        for (h = khash & ix->mask; ix->slot[h] != 0; h = (h + 1) & ix->mask) {
+            const json_member *m = &v->json_m[ix->slot[h] - 1];
+            if (m->khash == khash && m->klen == klen && memcmp(m->k, key, klen) == 0)
+                return ix->slot[h] - 1;
+        }
+        return JSON_KEY_NOT_EXIST;
+    }
+    for (i = 0; i < v->json_osz; ++i) {
+        const json_member *m = &v->json_m[i];
+        if (m->khash == khash && m->klen == klen && memcmp(m->k, key, klen) == 0)
+            return i;
+    }
+    return JSON_KEY_NOT_EXIST;
+}
+
+size_t json_find_object_index(const json_value *v, const char *key, size_t klen)
+{
+    assert(v != NULL && v->type == JSON_OBJECT && (key != NULL || klen == 0));
+    return json_find_member(v, key, klen, json_hash_key(key, klen));
+}
+
+json_value *json_find_object_value(const json_value *v, const char *key, size_t klen)
+{
+    size_t index = json_find_object_index(v, key, klen);
+    return index != JSON_KEY_NOT_EXIST ? &v->json_m[index].v : NULL;
+}
+
+/* array-index = %x30 / ( %x31-39 *(%x30-39) ) */
+static size_t json_pointer_index(const char *k, size_t klen)
+{
+    size_t i, index = 0;
+
+    if (klen == 1 && k[0] == '-')
+        return JSON_POINTER_APPEND;
+    if (klen == 0 || (k[0] == '0' && klen > 1))
+        return JSON_KEY_NOT_EXIST;
+    for (i = 0; i < klen; ++i) {
+        if (!ISDIGIT(k[i]) || index > (JSON_POINTER_APPEND - 1 - (k[i] - '0')) / 10)
+            return JSON_KEY_NOT_EXIST;
+        index = index * 10 + (k[i] - '0');
+    }
+    return index;
+}
+
+int json_pointer_compile(json_pointer *p, const char *ptr, size_t len)
+{
+    const json_allocator *a = json_get_allocator();
+    json_pointer_segment *seg;
+    size_t i, n;
+    char *k;
+
+    assert(p != NULL && (ptr != NULL || len == 0));
+    p->s = NULL;
+    p->size = 0;
+    if (len == 0)
+        return JSON_PARSE_OK;
+    if (ptr[0] != '/')
+        return JSON_POINTER_INVALID;
+    for (i = 0, n = 0; i < len; ++i)
+        if (ptr[i] == '/')
+            ++n;
+    /* Segments and their unescaped tokens share one block. */
+    p->s = (json_pointer_segment *) JSON_MALLOC(a, n * sizeof(json_pointer_segment) + len);
+    k = (char *) (p->s + n);
+    for (i = 1, seg = p->s; seg < p->s + n; ++seg, ++i) {
+        seg->k = k;
+        for ( ; i < len && ptr[i] != '/'; ++i) {
+            if (ptr[i] != '~')
+                *k++ = ptr[i];
+            else if (i + 1 < len && (ptr[i + 1] == '0' || ptr[i + 1] == '1'))
+                *k++ = ptr[++i] == '0' ? '~' : '/';
+            else {
+                JSON_FREE(a, p->s);
+                p->s = NULL;
+                return JSON_POINTER_INVALID;
+            }
+        }
+        seg->klen = k - seg->k;
+        *k++ = '\0';
+        seg->khash = json_hash_key(seg->k, seg->klen);
+        seg->index = json_pointer_index(seg->k, seg->klen);
+    }
+    p->size = n;
+    return JSON_PARSE_OK;
+}
+
+void json_pointer_free(json_pointer *p)
+{
+    const json_allocator *a = json_get_allocator();
+
+    assert(p != NULL);
+    JSON_FREE(a, p->s);
+    p->s = NULL;
+    p->size = 0;
+}
+
+json_value *json_pointer_get(const json_pointer *p, const json_value *v)
+{
+    size_t i, index;
+
+    assert(p != NULL && v != NULL);
+    for (i = 0; i < p->size; ++i) {
+        const json_pointer_segment *seg = &p->s[i];
+        if (v->type == JSON_OBJECT) {
+            if ((index = json_find_member(v, seg->k, seg->klen, seg->khash)) == JSON_KEY_NOT_EXIST)
+                return NULL;
+            v = &v->json_m[index].v;
+        } else if (v->type == JSON_ARRAY && seg->index < v->json_size) {
+            v = &v->json_e[seg->index];
+        } else {
+            return NULL;
+        }
+    }
+    return (json_value *) v;
+}
+
+json_value *json_pointer_cow(const json_pointer *p, json_value *v)
+{
+    size_t i, index;
+
+    assert(p != NULL && v != NULL);
+    for (i = 0; i < p->size; ++i) {
+        const json_pointer_segment *seg = &p->s[i];
+        if (v->type == JSON_OBJECT) {
+            if ((index = json_find_member(v, seg->k, seg->klen, seg->khash)) == JSON_KEY_NOT_EXIST)
+                return NULL;
+            json_unshare(v);
+            v = &v->json_m[index].v;
+        } else if (v->type == JSON_ARRAY && seg->index < v->json_size) {
+            json_unshare(v);
+            v = &v->json_e[seg->index];
+        } else {
+            return NULL;
+        }
+    }
+    return v;
+}
+
+/* Compare the raw key at c->json with seg and leave c->json after the key. */
+static int json_seek_key(json_context *c, const json_pointer_segment *seg, int *match)
+{
+    const char *k = c->json + 1;
+    size_t klen;
+    char *s;
+    int ret;
+
+    if ((ret = json_skip_string(c)) != JSON_PARSE_OK)
+        return ret;
+    klen = c->json - k - 1;
+    if (memchr(k, '\\', klen) == NULL) {
+        *match = klen == seg->klen && memcmp(k, seg->k, klen) == 0;
+        return JSON_PARSE_OK;
+    }
+    /* Escaped keys are rare, decode them the slow way. */
+    c->json = k - 1;
+    if ((ret = json_parse_string_raw(c, &s, &klen)) == JSON_PARSE_OK) {
+        *match = klen == seg->klen && memcmp(s, seg->k, klen) == 0;
+        JSON_FREE(c->a, s);
+    }
+    return ret;
+}
+
+/* Leave c->json at the value of the member named by seg. */
+static int json_seek_member(json_context *c, const json_pointer_segment *seg)
+{
+    int ret, match;
+
+    EXPECT(c, '{');
+    json_skip_whitespace(c);
+    if (PEEK(c) == '}')
+        return JSON_POINTER_NOT_FOUND;
+    for ( ; ; ) {
+        json_skip_whitespace(c);
+        if (PEEK(c) != '\"')
+            return JSON_PARSE_MISS_KEY;
+        if ((ret = json_seek_key(c, seg, &match)) != JSON_PARSE_OK)
+            return ret;
+        json_skip_whitespace(c);
+        if (PEEK(c) != ':')
+            return JSON_PARSE_MISS_COLON;
+        c->json++;
+        json_skip_whitespace(c);
+        if (match)
+            return JSON_PARSE_OK;
+        if ((ret = json_skip_value(c)) != JSON_PARSE_OK)
+            return ret;
+        json_skip_whitespace(c);
+        if (PEEK(c) == '}')
+            return JSON_POINTER_NOT_FOUND;
+        else if (PEEK(c) == ',')
+            c->json++;
+        else
+            return JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+    }
+}
+
+/* Leave c->json at the element indexed by seg. */
+static int json_seek_element(json_context *c, const json_pointer_segment *seg)
+{
+    size_t i;
+    int ret;
+
+    EXPECT(c, '[');
+    for (i = 0; ; ++i) {
+        json_skip_whitespace(c);
+        if (PEEK(c) == ']')
+            return JSON_POINTER_NOT_FOUND;
+        if (i == seg->index)
+            return JSON_PARSE_OK;
+        if ((ret = json_skip_value(c)) != JSON_PARSE_OK)
+            return ret;
+        json_skip_whitespace(c);
+        if (PEEK(c) == ']')
+            return JSON_POINTER_NOT_FOUND;
+        else if (PEEK(c) == ',') {
+            c->json++;
+            if (PEEK(c) == ']')
+                return JSON_PARSE_INVALID_VALUE;
+        } else
+            return JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+    }
+}
+
+int json_parse_pointer(json_value *v, const char *json, const json_pointer *p)
+{
+    json_context c;
+    size_t i;
+    int ret = JSON_PARSE_OK;
+
+    assert(v != NULL && p != NULL);
+    json_context_init(&c, json, json + strlen(json), json_get_allocator());
+    json_init(v);
+    json_skip_whitespace(&c);
+    for (i = 0; i < p->size && ret == JSON_PARSE_OK; ++i) {
+        switch (PEEK(&c)) {
+        case '{': ret = json_seek_member(&c, &p->s[i]); break;
+        case '[': ret = json_seek_element(&c, &p->s[i]); break;
+        default:
+            if ((ret = json_skip_value(&c)) == JSON_PARSE_OK)
+                ret = JSON_POINTER_NOT_FOUND;
+        }
+    }
+    if (ret == JSON_PARSE_OK && (ret = json_parse_value(&c, v)) == JSON_PARSE_OK
+            && p->size == 0) {
+        json_parse_whitespace(&c);
+        if (c.json[0] != '\0') {
+            json_free_value(v, c.a);
+            ret = JSON_PARSE_ROOT_NOT_SINGULAR;
+        }
+    }
+    assert(c.top == 0);
+    JSON_FREE(c.a, c.stack);
+    return ret;
+}
+
+/*
+ * Queries compile to a vector of steps. A filter's expression is a tree of
+ * terms in one vector, linked by index. Its @-paths become JSON Pointers,
+ * and are also merged into a projection, so json_parse_query builds only
+ * what the filter reads before deciding on a candidate.
+ */
+enum { JSON_QUERY_MEMBER, JSON_QUERY_INDEX, JSON_QUERY_WILDCARD, JSON_QUERY_FILTER };
+
+enum {
+    JSON_QUERY_OR, JSON_QUERY_AND, JSON_QUERY_NOT, JSON_QUERY_EXISTS,
+    JSON_QUERY_EQ, JSON_QUERY_NE, JSON_QUERY_LT, JSON_QUERY_LE, JSON_QUERY_GT, JSON_QUERY_GE
+};
+
+struct json_query_step {
+    int type;
+    json_pointer_segment seg;   /* member key or element index */
+    size_t filter;              /* root term */
+    json_projection paths;      /* everything the filter reads */
+};
+
+struct json_query_term {
+    int op;
+    size_t lhs, rhs;            /* operands of ||, && and ! */
+    json_pointer path;          /* relative to @ */
+    json_value literal;
+};
+
+static size_t json_query_add_step(json_query *q, int type, const json_allocator *a)
+{
+    json_query_step *s;
+
+    q->steps = (json_query_step *) JSON_REALLOC(a, q->steps, (q->size + 1) * sizeof(json_query_step));
+    s = &q->steps[q->size];
+    memset(s, 0, sizeof(json_query_step));
+    s->type = type;
+    s->seg.index = JSON_KEY_NOT_EXIST;
+    return q->size++;
+}
+
+static size_t json_query_add_term(json_query *q, int op, const json_allocator *a)
+{
+    json_query_term *t;
+
+    q->terms = (json_query_term *) JSON_REALLOC(a, q->terms, (q->nterms + 1) * sizeof(json_query_term));
+    t = &q->terms[q->nterms];
+    t->op = op;
+    t->lhs = t->rhs = 0;
+    t->path.s = NULL;
+    t->path.size = 0;
+    json_init(&t->literal);
+    return q->nterms++;
+}
+
+#define JSON_QUERY_IS_NAME(ch) \
+    (((ch) >= 'a' && (ch) <= 'z') || ((ch) >= 'A' && (ch) <= 'Z') || ISDIGIT(ch) \
+        || (ch) == '_' || (ch) == '$' || (ch) == '-' || (u_char) (ch) >= 0x80)
+
+/* .name, 'name' (verbatim) or "name" (with JSON escapes) */
+static int json_query_name(json_context *c, char **k, size_t *klen)
+{
+    const char *from = c->json, *p = c->json;
+
+    if (*p == '\"')
+        return json_parse_string_raw(c, k, klen) == JSON_PARSE_OK ? JSON_PARSE_OK : JSON_QUERY_INVALID;
+    if (*p == '\'') {
+        for (from = ++p; *p != '\'' && *p != '\0'; ++p)
+            ;
+        if (*p != '\'')
+            return JSON_QUERY_INVALID;
+        *klen = p++ - from;
+    } else {
+        for ( ; JSON_QUERY_IS_NAME(*p); ++p)
+            ;
+        if ((*klen = p - from) == 0)
+            return JSON_QUERY_INVALID;
+    }
+    *k = (char *) JSON_MALLOC(c->a, *klen + 1);
+    memcpy(*k, from, *klen);
+    (*k)[*klen] = '\0';
+    c->json = p;
+    return JSON_PARSE_OK;
+}
+
+static int json_query_index(json_context *c, size_t *index)
+{
+    const char *p = c->json;
+
+    for (*index = 0; ISDIGIT(*p); ++p) {
+        if (*index > (JSON_POINTER_APPEND - 1 - (*p - '0')) / 10)
+            return JSON_QUERY_INVALID;
+        *index = *index * 10 + (*p - '0');
+    }
+    if (p == c->json || (*c->json == '0' && p - c->json > 1))
+        return JSON_QUERY_INVALID;
+    c->json = p;
+    return JSON_PARSE_OK;
+}
+
+/* @ followed by .name, [n] and ['name'], written to t as a JSON Pointer. */
+static int json_query_path(json_context *c, json_context *t)
+{
+    size_t klen, i;
+    char *k;
+    int ret;
+
+    assert(*c->json == '@');
+    c->json++;
+    t->top = 0;
+    for ( ; ; ) {
+        if (*c->json == '.') {
+            c->json++;
+            if ((ret = json_query_name(c, &k, &klen)) != JSON_PARSE_OK)
+                return ret;
+        } else if (*c->json == '[') {
+            c->json++;
+            json_parse_whitespace(c);
+            if (ISDIGIT(*c->json)) {
+                k = (char *) c->json;
+                if ((ret = json_query_index(c, &klen)) != JSON_PARSE_OK)
+                    return ret;
+                klen = c->json - k;
+                PUTC(t, '/');
+                PUTS(t, k, klen);
+                k = NULL;
+            } else if ((ret = json_query_name(c, &k, &klen)) != JSON_PARSE_OK)
+                return ret;
+            json_parse_whitespace(c);
+            if (*c->json != ']') {
+                JSON_FREE(c->a, k);
+                return JSON_QUERY_INVALID;
+            }
+            c->json++;
+            if (k == NULL)
+                continue;
+        } else
+            return JSON_PARSE_OK;
+        PUTC(t, '/');
+        for (i = 0; i < klen; ++i) {
+            if (k[i] == '~') {
+                PUTS(t, "~0", 2);
+            } else if (k[i] == '/') {
+                PUTS(t, "~1", 2);
+            } else
+                PUTC(t, k[i]);
+        }
+        JSON_FREE(c->a, k);
+    }
+}
+
+static int json_query_or(json_context *c, json_context *t, json_query *q, size_t step, size_t *term);
+
+/* ( expr ) / ! unary / @path [ op literal ] */
+static int json_query_unary(json_context *c, json_context *t, json_query *q, size_t step, size_t *term)
+{
+    static const struct { const char *s; int op; } ops[] = {
+        { "==", JSON_QUERY_EQ }, { "!=", JSON_QUERY_NE }, { "<=", JSON_QUERY_LE },
+        { ">=", JSON_QUERY_GE }, { "<", JSON_QUERY_LT }, { ">", JSON_QUERY_GT },
+    };
+    json_query_term *x;
+    size_t i, operand;
+    int ret;
+
+    json_parse_whitespace(c);
+    if (*c->json == '(') {
+        c->json++;
+        if ((ret = json_query_or(c, t, q, step, term)) != JSON_PARSE_OK)
+            return ret;
+        json_parse_whitespace(c);
+        if (*c->json != ')')
+            return JSON_QUERY_INVALID;
+        c->json++;
+        return JSON_PARSE_OK;
+    }
+    if (*c->json == '!') {
+        c->json++;
+        if ((ret = json_query_unary(c, t, q, step, &operand)) != JSON_PARSE_OK)
+            return ret;
+        *term = json_query_add_term(q, JSON_QUERY_NOT, c->a);
+        q->terms[*term].lhs = operand;
+        return JSON_PARSE_OK;
+    }
+    if (*c->json != '@')
+        return JSON_QUERY_INVALID;
+    *term = json_query_add_term(q, JSON_QUERY_EXISTS, c->a);
+    if ((ret = json_query_path(c, t)) != JSON_PARSE_OK)
+        return ret;
+    x = &q->terms[*term];
+    json_pointer_compile(&x->path, t->stack, t->top);
+    json_projection_add(&q->steps[step].paths, t->stack, t->top);
+    json_parse_whitespace(c);
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i)
+        if (strncmp(c->json, ops[i].s, strlen(ops[i].s)) == 0) {
+            c->json += strlen(ops[i].s);
+            x->op = ops[i].op;
+            json_parse_whitespace(c);
+            if (json_parse_value(c, &x->literal) != JSON_PARSE_OK)
+                return JSON_QUERY_INVALID;
+            break;
+        }
+    return JSON_PARSE_OK;
+}
+
+static int json_query_and(json_context *c, json_context *t, json_query *q, size_t step, size_t *term)
+{
+    size_t rhs, lhs;
+    int ret;
+
+    if ((ret = json_query_unary(c, t, q, step, term)) != JSON_PARSE_OK)
+        return ret;
+    for ( ; ; ) {
+        json_parse_whitespace(c);
+        if (c->json[0] != '&' || c->json[1] != '&')
+            return JSON_PARSE_OK;
+        c->json += 2;
+        if ((ret = json_query_unary(c, t, q, step, &rhs)) != JSON_PARSE_OK)
+            return ret;
+        lhs = *term;
+        *term = json_query_add_term(q, JSON_QUERY_AND, c->a);
+        q->terms[*term].lhs = lhs;
+        q->terms[*term].rhs = rhs;
+    }
+}
+
+static int json_query_or(json_context *c, json_context *t, json_query *q, size_t step, size_t *term)
+{
+    size_t rhs, lhs;
+    int ret;
+
+    if ((ret = json_query_and(c, t, q, step, term)) != JSON_PARSE_OK)
+        return ret;
+    for ( ; ; ) {
+        json_parse_whitespace(c);
+        if (c->json[0] != '|' || c->json[1] != '|')
+            return JSON_PARSE_OK;
+        c->json += 2;
+        if ((ret = json_query_and(c, t, q, step, &rhs)) != JSON_PARSE_OK)
+            return ret;
+        lhs = *term;
+        *term = json_query_add_term(q, JSON_QUERY_OR, c->a);
+        q->terms[*term].lhs = lhs;
+        q->terms[*term].rhs = rhs;
+    }
+}
+
+/* [*] / [?expr] / [n] / ['name'] / ["name"], after the '[' */
+static int json_query_bracket(json_context *c, json_context *t, json_query *q)
+{
+    size_t step;
+    int ret;
+
+    json_parse_whitespace(c);
+    if (*c->json == '*') {
+        c->json++;
+        json_query_add_step(q, JSON_QUERY_WILDCARD, c->a);
+    } else if (*c->json == '?') {
+        c->json++;
+        step = json_query_add_step(q, JSON_QUERY_FILTER, c->a);
+        json_projection_init(&q->steps[step].paths);
+        if ((ret = json_query_or(c, t, q, step, &q->steps[step].filter)) != JSON_PARSE_OK)
+            return ret;
+    } else if (ISDIGIT(*c->json)) {
+        step = json_query_add_step(q, JSON_QUERY_INDEX, c->a);
+        if ((ret = json_query_index(c, &q->steps[step].seg.index)) != JSON_PARSE_OK)
+            return ret;
+    } else if (*c->json == '\'' || *c->json == '\"') {
+        step = json_query_add_step(q, JSON_QUERY_MEMBER, c->a);
+        if ((ret = json_query_name(c, &q->steps[step].seg.k, &q->steps[step].seg.klen)) != JSON_PARSE_OK)
+            return ret;
+    } else
+        return JSON_QUERY_INVALID;
+    json_parse_whitespace(c);
+    if (*c->json != ']')
+        return JSON_QUERY_INVALID;
+    c->json++;
+    return JSON_PARSE_OK;
+}
+
+int json_query_compile(json_query *q, const char *query, size_t len)
+{
+    const json_allocator *a = json_get_allocator();
+    json_context c, t;
+    json_query_step *s;
+    char *text;
+    size_t step;
+    int ret = JSON_PARSE_OK;
+
+    assert(q != NULL && (query != NULL || len == 0));
+    q->steps = NULL;
+    q->terms = NULL;
+    q->size = q->nterms = 0;
+    /* The text is copied so that it ends in a NUL, like a document. */
+    text = (char *) JSON_MALLOC(a, len + 1);
+    memcpy(text, query, len);
+    text[len] = '\0';
+    json_context_init(&c, text, text + len, a);
+    json_context_init(&t, NULL, NULL, a);
+    if (*c.json++ != '$')
+        ret = JSON_QUERY_INVALID;
+    while (ret == JSON_PARSE_OK && c.json < c.end) {
+        if (*c.json == '[') {
+            c.json++;
+            ret = json_query_bracket(&c, &t, q);
+        } else if (*c.json == '.' && c.json[1] == '*') {
+            c.json += 2;
+            json_query_add_step(q, JSON_QUERY_WILDCARD, a);
+        } else if (*c.json == '.' && c.json[1] != '\'' && c.json[1] != '\"') {
+            c.json++;
+            step = json_query_add_step(q, JSON_QUERY_MEMBER, a);
+            s = &q->steps[step];
+            ret = json_query_name(&c, &s->seg.k, &s->seg.klen);
+        } else
+            ret = JSON_QUERY_INVALID;
+    }
+    if (ret == JSON_PARSE_OK && c.json != c.end)
+        ret = JSON_QUERY_INVALID;
+    for (step = 0; step < q->size; ++step) {
+        s = &q->steps[step];
+        if (s->type == JSON_QUERY_MEMBER && s->seg.k != NULL)
+            s->seg.khash = json_hash_key(s->seg.k, s->seg.klen);
+    }
+    JSON_FREE(a, t.stack);
+    JSON_FREE(a, c.stack);
+    JSON_FREE(a, text);
+    if (ret != JSON_PARSE_OK)
+        json_query_free(q);
+    return ret;
+}
+
+void json_query_free(json_query *q)
+{
+    const json_allocator *a = json_get_allocator();
+    size_t i;
+
+    assert(q != NULL);
+    for (i = 0; i < q->size; ++i) {
+        JSON_FREE(a, q->steps[i].seg.k);
+        json_projection_free(&q->steps[i].paths);
+    }
+    for (i = 0; i < q->nterms; ++i) {
+        json_pointer_free(&q->terms[i].path);
+        json_free_value(&q->terms[i].literal, a);
+    }
+    JSON_FREE(a, q->steps);
+    JSON_FREE(a, q->terms);
+    q->steps = NULL;
+    q->terms = NULL;
+    q->size = q->nterms = 0;
+}
+
+static int json_query_test(const json_query *q, size_t term, const json_value *v)
+{
+    const json_query_term *t = &q->terms[term];
+    const json_value *x, *l = &t->literal;
+    size_t n;
+    int cmp;
+
+    switch (t->op) {
+    case JSON_QUERY_OR:  return json_query_test(q, t->lhs, v) || json_query_test(q, t->rhs, v);
+    case JSON_QUERY_AND: return json_query_test(q, t->lhs, v) && json_query_test(q, t->rhs, v);
+    case JSON_QUERY_NOT: return !json_query_test(q, t->lhs, v);
+    }
+    x = json_pointer_get(&t->path, v);
+    switch (t->op) {
+    case JSON_QUERY_EXISTS: return x != NULL;
+    case JSON_QUERY_EQ:     return x != NULL && json_is_equal(x, l);
+    case JSON_QUERY_NE:     return x == NULL || !json_is_equal(x, l);
+    }
+    if (x == NULL)
+        return 0;
+    if (x->type == JSON_NUMBER && l->type == JSON_NUMBER)
+        cmp = x->json_n < l->json_n ? -1 : x->json_n > l->json_n;
+    else if (x->type == JSON_STRING && l->type == JSON_STRING) {
+        n = x->json_len < l->json_len ? x->json_len : l->json_len;
+        if ((cmp = memcmp(x->json_s, l->json_s, n)) == 0)
+            cmp = x->json_len < l->json_len ? -1 : x->json_len > l->json_len;
+    } else
+        return 0;
+    switch (t->op) {
+    case JSON_QUERY_LT: return cmp < 0;
+    case JSON_QUERY_LE: return cmp <= 0;
+    case JSON_QUERY_GT: return cmp > 0;
+    default:            return cmp >= 0;
+    }
+}
+
+static void json_query_walk(const json_query *q, size_t i, const json_value *v,
+        json_value **out, size_t cap, size_t *count)
+{
+    const json_query_step *s;
+    const json_value *e;
+    size_t j, n, index;
+
+    if (i == q->size) {
+        if (*count < cap)
+            out[*count] = (json_value *) v;
+        ++*count;
+        return;
+    }
+    s = &q->steps[i];
+    switch (s->type) {
+    case JSON_QUERY_MEMBER:
+        if (v->type == JSON_OBJECT
+                && (index = json_find_member(v, s->seg.k, s->seg.klen, s->seg.khash)) != JSON_KEY_NOT_EXIST)
+            json_query_walk(q, i + 1, &v->json_m[index].v, out, cap, count);
+        break;
+    case JSON_QUERY_INDEX:
+        if (v->type == JSON_ARRAY && s->seg.index < v->json_size)
+            json_query_walk(q, i + 1, &v->json_e[s->seg.index], out, cap, count);
+        break;
+    default:
+        if (v->type != JSON_ARRAY && v->type != JSON_OBJECT)
+            break;
+        n = v->type == JSON_ARRAY ? v->json_size : v->json_osz;
+        for (j = 0; j < n; ++j) {
+            e = v->type == JSON_ARRAY ? &v->json_e[j] : &v->json_m[j].v;
+            if (s->type == JSON_QUERY_WILDCARD || json_query_test(q, s->filter, e))
+                json_query_walk(q, i + 1, e, out, cap, count);
+        }
+        break;
+    }
+}
+
+size_t json_query_select(const json_query *q, const json_value *v, json_value **out, size_t cap)
+{
+    size_t count = 0;
+
+    assert(q != NULL && v != NULL && (out != NULL || cap == 0));
+    json_query_walk(q, 0, v, out, cap, &count);
+    return count;
+}
+
+static int json_query_stream(json_context *c, const json_query *q, size_t i, size_t *count);
+
+/* A filter builds just the paths it reads; a candidate that passes is read again. */
+static int json_query_stream_candidate(json_context *c, const json_query *q, size_t i, size_t *count)
+{
+    const json_query_step *s = &q->steps[i];
+    const char *start = c->json;
+    json_value e;
+    int ret, kept, pass;
+
+    if (s->type != JSON_QUERY_FILTER)
+        return json_query_stream(c, q, i + 1, count);
+    json_init(&e);
+    if ((ret = json_parse_projected(c, &e, &s->paths, 0, &kept)) != JSON_PARSE_OK)
+        return ret;
+    pass = json_query_test(q, s->filter, &e);
+    json_free_value(&e, c->a);
+    if (!pass)
+        return JSON_PARSE_OK;
+    c->json = start;
+    return json_query_stream(c, q, i + 1, count);
+}
+
+static int json_query_stream_object(json_context *c, const json_query *q, size_t i, size_t *count)
+{
+    const json_query_step *s = &q->steps[i];
+    int ret, match = 0, found = 0;
+
+    EXPECT(c, '{');
+    json_skip_whitespace(c);
+    if (PEEK(c) == '}') {
+        c->json++;
+        return JSON_PARSE_OK;
+    }
+    for ( ; ; ) {
+        json_skip_whitespace(c);
+        if (PEEK(c) != '\"')
+            return JSON_PARSE_MISS_KEY;
+        if (s->type == JSON_QUERY_MEMBER && !found)
+            ret = json_seek_key(c, &s->seg, &match);
+        else
+            ret = json_skip_string(c);
+        if (ret != JSON_PARSE_OK)
+            return ret;
+        json_skip_whitespace(c);
+        if (PEEK(c) != ':')
+            return JSON_PARSE_MISS_COLON;
+        c->json++;
+        json_skip_whitespace(c);
+        if (s->type == JSON_QUERY_MEMBER) {
+            /* like json_find_member, only the first of duplicate keys counts */
+            if (match && !found) {
+                found = 1;
+                ret = json_query_stream(c, q, i + 1, count);
+            } else
+                ret = json_skip_value(c);
+        } else
+            ret = json_query_stream_candidate(c, q, i, count);
+        if (ret != JSON_PARSE_OK)
+            return ret;
+        json_skip_whitespace(c);
+        if (PEEK(c) == '}') {
+            c->json++;
+            return JSON_PARSE_OK;
+        } else if (PEEK(c) == ',')
+            c->json++;
+        else
+            return JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+    }
+}
+
+static int json_query_stream_array(json_context *c, const json_query *q, size_t i, size_t *count)
+{
+    const json_query_step *s = &q->steps[i];
+    size_t j;
+    int ret;
+
+    EXPECT(c, '[');
+    for (j = 0; ; ++j) {
+        json_skip_whitespace(c);
+        if (PEEK(c) == ']') {
+            c->json++;
+            return JSON_PARSE_OK;
+        }
+        if (s->type != JSON_QUERY_INDEX)
+            ret = json_query_stream_candidate(c, q, i, count);
+        else if (j == s->seg.index)
+            ret = json_query_stream(c, q, i + 1, count);
+        else
+            ret = json_skip_value(c);
+        if (ret != JSON_PARSE_OK)
+            return ret;
+        json_skip_whitespace(c);
+        if (PEEK(c) == ']')
+            continue;
+        else if (PEEK(c) == ',') {
+            c->json++;
+            if (PEEK(c) == ']')
+                return JSON_PARSE_INVALID_VALUE;
+        } else
+            return JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+    }
+}
+
+/* Matches are pushed on the context stack as they are found. */
+static int json_query_stream(json_context *c, const json_query *q, size_t i, size_t *count)
+{
+    json_value e;
+    int ret;
+
+    if (i == q->size) {
+        json_init(&e);
+        if ((ret = json_parse_value(c, &e)) != JSON_PARSE_OK)
+            return ret;
+        memcpy(json_context_push(c, sizeof(json_value)), &e, sizeof(json_value));
+        ++*count;
+        return JSON_PARSE_OK;
+    }
+    switch (PEEK(c)) {
+    case '{':
+        if (q->steps[i].type != JSON_QUERY_INDEX)
+            return json_query_stream_object(c, q, i, count);
+        break;
+    case '[':
+        if (q->steps[i].type != JSON_QUERY_MEMBER)
+            return json_query_stream_array(c, q, i, count);
+        break;
+    }
+    return json_skip_value(c);
+}
+
+int json_parse_query(json_value *v, const char *json, const json_query *q)
+{
+    json_context c;
+    size_t count = 0, size;
+    int ret;
+
+    assert(v != NULL && q != NULL);
+    json_context_init(&c, json, json + strlen(json), json_get_allocator());
+    json_init(v);
+    json_skip_whitespace(&c);
+    if ((ret = json_query_stream(&c, q, 0, &count)) == JSON_PARSE_OK) {
+        json_skip_whitespace(&c);
+        if (c.json != c.end)
+            ret = JSON_PARSE_ROOT_NOT_SINGULAR;
+    }
+    if (ret == JSON_PARSE_OK) {
+        v->type = JSON_ARRAY;
+        v->json_size = count;
+        v->json_e = NULL;
+        if (count > 0) {
+            size = count * sizeof(json_value);
+            memcpy(v->json_e = (json_value *) JSON_MALLOC(c.a, size), json_context_pop(&c, size), size);
+        }
+    } else
+        for ( ; count > 0; --count)
+            json_free_value(json_context_pop(&c, sizeof(json_value)), c.a);
+    assert(c.top == 0);
+    JSON_FREE(c.a, c.stack);
+    return ret;
+}
+
+#ifndef JSON_PARSE_STRINGIFY_INIT_SIZE
+# define JSON_PARSE_STRINGIFY_INIT_SIZE 256
+#endif
+
+
+/*
+ * Decode the sequence at s[*pos] and leave *pos on its last byte. Invalid,
+ * truncated and overlong sequences return JSON_UTF8_INVALID without moving
+ * *pos; the parser accepts such bytes, so they are written back verbatim.
+ */
+#define JSON_UTF8_INVALID 0xffffffffu
+
+static unsigned json_decode_utf8(const u_char* s, size_t len, size_t* pos)
+{
+    static const unsigned min[] = { 0, 0x80, 0x800, 0x10000 };
+    const u_char* ch = s + *pos;
+    unsigned u;
+    size_t i, n;
+
+    if (*ch >= 0xc0 && *ch <= 0xdf)
+        u = *ch & 0x1f, n = 1;
+    else if (*ch >= 0xe0 && *ch <= 0xef)
+        u = *ch & 0x0f, n = 2;
+    else if (*ch >= 0xf0 && *ch <= 0xf7)
+        u = *ch & 0x07, n = 3;
+    else
+        return JSON_UTF8_INVALID;
+    if (n >= len - *pos)
+        return JSON_UTF8_INVALID;
+    for (i = 1; i <= n; ++i) {
+        if ((ch[i] & 0xc0) != 0x80)
+            return JSON_UTF8_INVALID;
+        u = (u << 6) | (ch[i] & 0x3f);
+    }
+    if (u < min[n] || u > 0x10ffff)
+        return JSON_UTF8_INVALID;
+    *pos += n;
+    return u;
+}
+
+/* The plain stringifier and the one for JSON_STRINGIFY_UTF8. */
+#define JSON_VARIANT(name) name
+#define JSON_VARIANT_STRINGIFY_OPTS 0
+#include "json_parser_variant.h"
+#define JSON_VARIANT(name) name##_1
+#define JSON_VARIANT_STRINGIFY_OPTS JSON_STRINGIFY_UTF8
+#include "json_parser_variant.h"
+
+int json_stringify_opts(const json_value* v, char** json, size_t* length, unsigned flags)
+{
+    json_context c;
+    int ret;
+    STAT_TIMER(t);
+
+    assert(v != NULL);
+    assert(json != NULL);
+    assert(flags < JSON_STRINGIFY_OPTIONS);
+    json_context_init(&c, NULL, NULL, json_get_allocator());
+    c.stack = JSON_MALLOC(c.a, c.size = JSON_PARSE_STRINGIFY_INIT_SIZE);
+    ret = flags & JSON_STRINGIFY_UTF8 ? json_stringify_value_1(&c, v) : json_stringify_value(&c, v);
+    if (ret != JSON_STRINGIFY_OK) {
+        JSON_FREE(c.a, c.stack);
+        *json = NULL;
+        return ret;
+    }
+    if (length)
+        *length = c.top;
+    PUTC(&c, '\0');
+    *json = c.stack;
+    STAT_PHASE(JSON_PHASE_STRINGIFY, t);
+    return JSON_STRINGIFY_OK;
+}
+
+int json_stringify(const json_value* v, char** json, size_t* length)
+{
+    return json_stringify_opts(v, json, length, 0);
+}
+
+/*
+ * Canonical stringify. Each object's members are sorted through a vector of
+ * json_sort_key on a scratch stack shared by the whole call: nested objects
+ * push their vectors above their parent's and pop them when done.
+ */
+typedef struct {
+    uint64_t prefix;        /* first 8 key bytes, ranked, big-endian */
+    const json_member* m;
+} json_sort_key;
+
+/*
+ * UTF-8 bytes compare in code point order, RFC 8785 wants UTF-16 order:
+ * U+E000..U+FFFF (leads 0xee, 0xef) sort after the surrogate pairs of
+ * U+10000 and up (leads 0xf0..0xf4). The remap is a bijection, so any
+ * bytes still have a total order.
+ */
+static unsigned json_utf16_rank(u_char b)
+{
+    return b >= 0xf0 ? b - 2u : b >= 0xee ? b + 0x10u : b;
+}
+
+static int json_sort_key_compare(const json_sort_key* a, const json_sort_key* b)
+{
+    size_t i, n;
+
+    if (a->prefix != b->prefix)
+        return a->prefix < b->prefix ? -1 : 1;
+    /* Equal prefixes mean equal first min(n, 8) bytes. */
+    n = a->m->klen < b->m->klen ? a->m->klen : b->m->klen;
+    for (i = n < 8 ? n : 8; i < n; ++i)
+        if (a->m->k[i] != b->m->k[i])
+            return json_utf16_rank((u_char) a->m->k[i]) < json_utf16_rank((u_char) b->m->k[i]) ? -1 : 1;
+    if (a->m->klen != b->m->klen)
+        return a->m->klen < b->m->klen ? -1 : 1;
+    return a->m < b->m ? -1 : a->m > b->m;
+}
+
+static int json_sort_key_qsort(const void* a, const void* b)
+{
+    return json_sort_key_compare((const json_sort_key*) a, (const json_sort_key*) b);
+}
+
+static void json_sort_keys(json_sort_key* keys, size_t n)
+{
+    size_t i, j;
+    json_sort_key k;
+
+    if (n > 16) {
+        qsort(keys, n, sizeof(json_sort_key), json_sort_key_qsort);
+        return;
+    }
+    for (i = 1; i < n; ++i) {
+        k = keys[i];
+        for (j = i; j > 0 && json_sort_key_compare(&k, &keys[j - 1]) < 0; --j)
+            keys[j] = keys[j - 1];
+        keys[j] = k;
+    }
+}
+
+/* Only '"', '\\' and control characters are escaped, the rest is copied. */
+static void json_canonical_string(json_context* c, const char* s, size_t len)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    size_t size = len * 6 + 2;
+    char* p;
+    char* head;
+
+    p = head = json_context_push(c, size);
+    *p++ = '"';
+    for (size_t i = 0; i < len; ++i) {
+        u_char ch = (u_char) s[i];
+        if (ch >= 0x20 && ch != '"' && ch != '\\') {
+            *p++ = s[i];
+            continue;
+        }
+        *p++ = '\\';
+        switch (ch) {
+        case '"':  *p++ = '"'; break;
+        case '\\': *p++ = '\\'; break;
+        case '\b': *p++ = 'b'; break;
+        case '\t': *p++ = 't'; break;
+        case '\n': *p++ = 'n'; break;
+        case '\f': *p++ = 'f'; break;
+        case '\r': *p++ = 'r'; break;
+        default:
+            *p++ = 'u'; *p++ = '0'; *p++ = '0';
+            *p++ = hex_digits[ch >> 4];
+            *p++ = hex_digits[ch & 15];
+            break;
+        }
+    }
+    *p++ = '"';
+    c->top -= size - (p - head);
+}
+
+/*
+ * ECMAScript Number::toString: the shortest digits that read back as n,
+ * in plain notation for 1e-7 <= |n| < 1e21 and exponent notation outside.
+ * For normal numbers any shorter form that round-trips is the 15-digit
+ * rounding with trailing zeros, so only 15 to 17 digits need to be tried;
+ * subnormals have fewer bits and may need fewer digits.
+ */
+static int json_canonical_number(json_context* c, double n)
+{
+    char buf[32], digits[20];
+    char* p;
+    int precision, k, e, i;
+    long long integer;
+
+    if (isnan(n) || isinf(n))
+        return JSON_STRINGIFY_NUMBER_INVALID;
+    if (n == 0) {
+        PUTC(c, '0');
+        return JSON_STRINGIFY_OK;
+    }
+    /* Exact integers, the common case, print as themselves. */
+    if (n > -9007199254740992.0 && n < 9007199254740992.0 && n == (double) (integer = (long long) n)) {
+        c->top -= 24 - sprintf(json_context_push(c, 24), "%lld", integer);
+        return JSON_STRINGIFY_OK;
+    }
+    precision = n > -2.2250738585072014e-308 && n < 2.2250738585072014e-308 ? 1 : 15;
+    for ( ; precision < 17; ++precision) {
+        sprintf(buf, "%.*e", precision - 1, n);
+        if (json_strtod(buf, NULL) == n)
+            break;
+    }
+    if (precision == 17)
+        sprintf(buf, "%.16e", n);
+    /* buf is [-]d[.ddd]e(+|-)xx */
+    p = buf;
+    if (*p == '-') {
+        PUTC(c, '-');
+        ++p;
+    }
+    for (k = 0; *p != 'e'; ++p)
+        if (*p != '.')
+            digits[k++] = *p;
+    while (k > 1 && digits[k - 1] == '0')
+        --k;
+    e = atoi(p + 1) + 1;    /* n = 0.digits * 10^e */
+    if (k <= e && e <= 21) {
+        PUTS(c, digits, k);
+        for (i = k; i < e; ++i)
+            PUTC(c, '0');
+    } else if (0 < e && e <= 21) {
+        PUTS(c, digits, e);
+        PUTC(c, '.');
+        PUTS(c, digits + e, k - e);
+    } else if (-6 < e && e <= 0) {
+        PUTS(c, "0.", 2);
+        for (i = e; i < 0; ++i)
+            PUTC(c, '0');
+        PUTS(c, digits, k);
+    } else {
+        PUTC(c, digits[0]);
+        if (k > 1) {
+            PUTC(c, '.');
+            PUTS(c, digits + 1, k - 1);
+        }
+        c->top -= 8 - sprintf(json_context_push(c, 8), "e%+d", e - 1);
+    }
+    return JSON_STRINGIFY_OK;
+}
+
+static int json_canonical_value(json_context* c, json_context* scratch, const json_value* v)
+{
+    size_t i, j, n, base;
+    json_sort_key* keys;
+    const json_member* m;
+    int ret;
+
+    switch (v->type) {
+    case JSON_NUMBER:
+        return json_canonical_number(c, v->json_n);
+    case JSON_STRING:
+        json_canonical_string(c, v->json_s, v->json_len);
+        return JSON_STRINGIFY_OK;
+    case JSON_ARRAY:
+        PUTC(c, '[');
+        for (i = 0; i < v->json_size; ++i) {
+            if (i > 0)
+                PUTC(c, ',');
+            if ((ret = json_canonical_value(c, scratch, &v->json_e[i])) != JSON_STRINGIFY_OK)
+                return ret;
+        }
+        PUTC(c, ']');
+        return JSON_STRINGIFY_OK;
+    case JSON_OBJECT:
+        n = v->json_osz;
+        PUTC(c, '{');
+        if (n == 0) {
+            PUTC(c, '}');
+            return JSON_STRINGIFY_OK;
+        }
+        base = scratch->top;
+        keys = (json_sort_key*) json_context_push(scratch, n * sizeof(json_sort_key));
+        for (i = 0; i < n; ++i) {
+            m = &v->json_m[i];
+            keys[i].m = m;
+            keys[i].prefix = 0;
+            for (j = 0; j < 8; ++j)
+                keys[i].prefix = keys[i].prefix << 8 | (j < m->klen ? json_utf16_rank((u_char) m->k[j]) : 0);
+        }
+        json_sort_keys(keys, n);
+        for (i = 0; i < n; ++i) {
+            /* nested objects may move the scratch stack */
+            m = ((json_sort_key*) (scratch->stack + base))[i].m;
+            if (i > 0)
+                PUTC(c, ',');
+            json_canonical_string(c, m->k, m->klen);
+            PUTC(c, ':');
+            if ((ret = json_canonical_value(c, scratch, &m->v)) != JSON_STRINGIFY_OK)
+                return ret;
+        }
+        scratch->top = base;
+        PUTC(c, '}');
+        return JSON_STRINGIFY_OK;
+    default:
+        return json_stringify_value(c, v);
+    }
+}
+
+int json_stringify_canonical(const json_value* v, char** json, size_t* length)
+{
+    json_context c, scratch;
+    int ret;
+
+    assert(v != NULL);
+    assert(json != NULL);
+    json_context_init(&c, NULL, NULL, json_get_allocator());
+    json_context_init(&scratch, NULL, NULL, c.a);
+    c.stack = JSON_MALLOC(c.a, c.size = JSON_PARSE_STRINGIFY_INIT_SIZE);
+    ret = json_canonical_value(&c, &scratch, v);
+    JSON_FREE(c.a, scratch.stack);
+    if (ret != JSON_STRINGIFY_OK) {
+        JSON_FREE(c.a, c.stack);
+        *json = NULL;
+        return ret;
+    }
+    if (length)
+        *length = c.top;
+    PUTC(&c, '\0');
+    *json = c.stack;
+    return JSON_STRINGIFY_OK;
+}
+
+static int json_encode_fields(json_context* c, const char* base, const json_schema* s);
+
+static int json_encode_field(json_context* c, const char* p, json_field_type type, const json_schema* s)
+{
+    const char* str;
+
+    switch (type) {
+    case JSON_FIELD_BOOL:
+        if (*(const int*) p) {
+            PUTS(c, "true", 4);
+        } else {
+            PUTS(c, "false", 5);
+        }
+        break;
+    case JSON_FIELD_INT:
+        c->top -= 32 - sprintf(json_context_push(c, 32), "%d", *(const int*) p);
+        break;
+    case JSON_FIELD_INT64:
+        c->top -= 32 - sprintf(json_context_push(c, 32), "%lld", *(const long long*) p);
+        break;
+    case JSON_FIELD_DOUBLE:
+        /* %g would write nan or inf, which are not JSON. */
+        if (!isfinite(*(const double*) p))
+            return JSON_STRINGIFY_NUMBER_INVALID;
+        c->top -= 32 - sprintf(json_context_push(c, 32), "%.17g", *(const double*) p);
+        break;
+    case JSON_FIELD_STRING:
+        if ((str = *(const char* const*) p) == NULL) {
+            PUTS(c, "null", 4);
+        } else
+            json_stringify_string(c, str, strlen(str));
+        break;
+    default:
+        return json_encode_fields(c, p, s);
+    }
+    return JSON_STRINGIFY_OK;
+}
+
+static int json_encode_fields(json_context* c, const char* base, const json_schema* s)
+{
+    int ret;
+
+    PUTC(c, '{');
+    for (size_t i = 0; i < s->count; ++i) {
+        const json_field* f = &s->fields[i];
+        PUTS(c, s->keys + s->kpos[i], s->kpos[i + 1] - s->kpos[i]);
+        if (f->type == JSON_FIELD_ARRAY) {
+            const json_field_array* arr = (const json_field_array*) (base + f->offset);
+            size_t size = json_field_size(f->item, f->schema);
+            PUTC(c, '[');
+            for (size_t j = 0; j < arr->size; ++j) {
+                if (j > 0)
+                    PUTC(c, ',');
+                if ((ret = json_encode_field(c, (const char*) arr->e + j * size, f->item, f->schema)) != JSON_STRINGIFY_OK)
+                    return ret;
+            }
+            PUTC(c, ']');
+        } else if ((ret = json_encode_field(c, base + f->offset, f->type, f->schema)) != JSON_STRINGIFY_OK)
+            return ret;
+    }
+    PUTC(c, '}');
+    return JSON_STRINGIFY_OK;
+}
+
+int json_encode_struct(const void* in, const json_schema* s, char** json, size_t* length)
+{
+    json_context c;
+    int ret;
+
+    assert(in != NULL && s != NULL && json != NULL);
+    json_context_init(&c, NULL, NULL, json_get_allocator());
+    c.stack = JSON_MALLOC(c.a, c.size = JSON_PARSE_STRINGIFY_INIT_SIZE);
+    if ((ret = json_encode_fields(&c, (const char*) in, s)) != JSON_STRINGIFY_OK) {
+        JSON_FREE(c.a, c.stack);
+        *json = NULL;
+        return ret;
+    }
+    if (length)
+        *length = c.top;
+    PUTC(&c, '\0');
+    *json = c.stack;
+    return JSON_STRINGIFY_OK;
+}
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#ifndef JSON_STRINGIFY_PARALLEL_MIN_SIZE
+#define JSON_STRINGIFY_PARALLEL_MIN_SIZE 1024
+#endif
+
+typedef struct {
+    const json_value* v;
+    size_t begin, end;
+    const json_allocator* a;
+    json_context c;
+    int started;
+    pthread_t thread;
+} json_stringify_chunk;
+
+/* Serialize elements or members [begin, end) of k->v, comma separated. */
+static void* json_stringify_chunk_run(void* arg)
+{
+    json_stringify_chunk* k = (json_stringify_chunk*) arg;
+    size_t i;
+
+    json_context_init(&k->c, NULL, NULL, k->a);
+    for (i = k->begin; i < k->end; ++i) {
+        if (i > k->begin)
+            PUTC(&k->c, ',');
+        if (k->v->type == JSON_ARRAY)
+            json_stringify_value(&k->c, &k->v->json_e[i]);
+        else
+            json_stringify_object_member(&k->c, &k->v->json_m[i]);
+    }
+    return NULL;
+}
+
+/* Returns the number of chunks, or 0 if v is better serialized on one thread. */
+static unsigned json_stringify_split(const json_value* v, unsigned nthreads, json_stringify_chunk** chunks,
+        const json_allocator* a)
+{
+    json_stringify_chunk* k;
+    size_t n;
+    unsigned t;
+
+    if (nthreads <= 1 || (v->type != JSON_ARRAY && v->type != JSON_OBJECT))
+        return 0;
+    n = v->type == JSON_ARRAY ? v->json_size : v->json_osz;
+    if (n < JSON_STRINGIFY_PARALLEL_MIN_SIZE || n < 2)
+        return 0;
+    /* No chunk may be empty: callers put a comma before every chunk but the first. */
+    if (nthreads > n)
+        nthreads = (unsigned) n;
+    *chunks = k = (json_stringify_chunk*) JSON_MALLOC(a, nthreads * sizeof(json_stringify_chunk));
+    for (t = 0; t < nthreads; ++t) {
+        k[t].v = v;
+        k[t].a = a;
+        k[t].begin = n * t / nthreads;
+        k[t].end = n * (t + 1) / nthreads;
+    }
+    for (t = 1; t < nthreads; ++t)
+        k[t].started = pthread_create(&k[t].thread, NULL, json_stringify_chunk_run, &k[t]) == 0;
+    json_stringify_chunk_run(&k[0]);
+    for (t = 1; t < nthreads; ++t)
+        if (k[t].started)
+            pthread_join(k[t].thread, NULL);
+        else
+            json_stringify_chunk_run(&k[t]);
+    return nthreads;
+}
+
+int json_stringify_parallel(const json_value* v, char** json, size_t* length, unsigned nthreads)
+{
+    const json_allocator* a = json_get_allocator();
+    json_stringify_chunk* k;
+    unsigned t, n;
+    size_t size;
+    char* p;
+
+    assert(v != NULL);
+    assert(json != NULL);
+    if ((n = json_stringify_split(v, nthreads, &k, a)) == 0)
+        return json_stringify(v, json, length);
+    for (t = 0, size = 2 + n - 1; t < n; ++t)
+        size += k[t].c.top;
+    p = *json = (char*) JSON_MALLOC(a, size + 1);
+    *p++ = v->type == JSON_ARRAY ? '[' : '{';
+    for (t = 0; t < n; ++t) {
+        if (t > 0 && k[t].c.top > 0)
+            *p++ = ',';
+        memcpy(p, k[t].c.stack, k[t].c.top);
+        p += k[t].c.top;
+        JSON_FREE(a, k[t].c.stack);
+    }
+    *p++ = v->type == JSON_ARRAY ? ']' : '}';
+    *p = '\0';
+    if (length)
+        *length = p - *json;
+    JSON_FREE(a, k);
+    return JSON_STRINGIFY_OK;
+}
+
+static int json_writev_all(int fd, struct iovec* iov, size_t iovcnt)
+{
+    ssize_t n;
+
+    while (iovcnt > 0) {
+        if ((n = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : (int) iovcnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for ( ; iovcnt > 0 && (size_t) n >= iov->iov_len; --iovcnt, ++iov)
+            n -= iov->iov_len;
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* Gather the per-thread buffers straight into fd instead of joining them. */
+int json_stringify_parallel_fd(const json_value* v, int fd, unsigned nthreads)
+{
+    static char open_close[] = "[]{},";
+    const json_allocator* a = json_get_allocator();
+    json_stringify_chunk* k;
+    struct iovec* iov;
+    struct iovec one;
+    unsigned t, n;
+    size_t i = 0;
+    char* json;
+    int ret;
+
+    assert(v != NULL);
+    if ((n = json_stringify_split(v, nthreads, &k, a)) == 0) {
+        if ((ret = json_stringify(v, &json, &one.iov_len)) != JSON_STRINGIFY_OK)
+            return ret;
+        one.iov_base = json;
+        ret = json_writev_all(fd, &one, 1) == 0 ? JSON_STRINGIFY_OK : JSON_STRINGIFY_WRITE_ERROR;
+        JSON_FREE(a, json);
+        return ret;
+    }
+    iov = (struct iovec*) JSON_MALLOC(a, (2 * n + 1) * sizeof(struct iovec));
+    iov[i].iov_base = open_close + (v->type == JSON_ARRAY ? 0 : 2);
+    iov[i++].iov_len = 1;
+    for (t = 0; t < n; ++t) {
+        if (t > 0 && k[t].c.top > 0) {
+            iov[i].iov_base = open_close + 4;
+            iov[i++].iov_len = 1;
+        }
+        iov[i].iov_base = k[t].c.stack;
+        iov[i++].iov_len = k[t].c.top;
+    }
+    iov[i].iov_base = open_close + (v->type == JSON_ARRAY ? 1 : 3);
+    iov[i++].iov_len = 1;
+    ret = json_writev_all(fd, iov, i) == 0 ? JSON_STRINGIFY_OK : JSON_STRINGIFY_WRITE_ERROR;
+    for (t = 0; t < n; ++t)
+        JSON_FREE(a, k[t].c.stack);
+    JSON_FREE(a, iov);
+    JSON_FREE(a, k);
+    return ret;
+}
+
+/*
+ * Binary format, host byte order, every node 4-byte aligned:
+ *   blob    "JPB1" u32 length, root node at offset 8
+ *   literal u32 type
+ *   number  u32 type, f64
+ *   string  u32 type, u32 len, bytes, '\0', padding
+ *   array   u32 type, u32 size, u32 n, u32 off[n], elements
+ *   object  u32 type, u32 size, u32 n, {u32 khash, koff, voff}[n], key, value, ...
+ * size covers the node and all its descendants and offsets are from the
+ * start of the blob, so any child is reached in O(1).
+ */
+#define JSON_BINARY_MAGIC      "JPB1"
+#define JSON_BINARY_HEADER     8
+#define JSON_BINARY_CONTAINER  12
+#define JSON_BINARY_ALIGN(n)   (((n) + 3) & ~(size_t) 3)
+
+static uint32_t json_binary_u32(const char *p)
+{
+    uint32_t u;
+    memcpy(&u, p, sizeof(u));
+    return u;
+}
+
+static void json_binary_put_u32(json_context *c, size_t at, size_t u)
+{
+    uint32_t u32 = (uint32_t) u;
+    memcpy(c->stack + at, &u32, sizeof(u32));
+}
+
+static void json_binary_push_u32(json_context *c, size_t u)
+{
+    uint32_t u32 = (uint32_t) u;
+    memcpy(json_context_push(c, sizeof(u32)), &u32, sizeof(u32));
+}
+
+static void json_binary_push_string(json_context *c, const char *s, size_t len)
+{
+    size_t size = JSON_BINARY_ALIGN(len + 1);
+
+    json_binary_push_u32(c, JSON_STRING);
+    json_binary_push_u32(c, len);
+    memset(json_context_push(c, size), 0, size);
+    if (len > 0)
+        memcpy(c->stack + c->top - size, s, len);
+}
+
+static void json_encode_binary_value(json_context *c, const json_value *v)
+{
+    size_t start = c->top, table, i, n;
+
+    switch (v->type) {
+    case JSON_NUMBER:
+        json_binary_push_u32(c, JSON_NUMBER);
+        memcpy(json_context_push(c, sizeof(double)), &v->json_n, sizeof(double));
         break;
+    case JSON_STRING:
+        json_binary_push_string(c, v->json_s, v->json_len);
+        break;
+    case JSON_ARRAY:
     case JSON_OBJECT:
-        for ( ; v->json_osz > 0; v->json_osz--)
-            json_free_object_member(&v->json_m[v->json_osz - 1]);
-        free(v->json_m);
+        n = v->type == JSON_ARRAY ? v->json_size : v->json_osz;
+        json_binary_push_u32(c, v->type);
+        json_binary_push_u32(c, 0);
+        json_binary_push_u32(c, n);
+        table = c->top;
+        if (n > 0)
+            json_context_push(c, n * (v->type == JSON_ARRAY ? 4 : 12));
+        for (i = 0; i < n; ++i) {
+            if (v->type == JSON_ARRAY) {
+                json_binary_put_u32(c, table + i * 4, c->top);
+                json_encode_binary_value(c, &v->json_e[i]);
+            } else {
+                json_binary_put_u32(c, table + i * 12, v->json_m[i].khash);
+                json_binary_put_u32(c, table + i * 12 + 4, c->top);
+                json_binary_push_string(c, v->json_m[i].k, v->json_m[i].klen);
+                json_binary_put_u32(c, table + i * 12 + 8, c->top);
+                json_encode_binary_value(c, &v->json_m[i].v);
+            }
+        }
+        json_binary_put_u32(c, start + 4, c->top - start);
         break;
     default:
-        ;
+        json_binary_push_u32(c, v->type);
     }
-    v->type = JSON_NULL;
 }
 
-static void json_free_object_member(json_member *m)
+int json_encode_binary(const json_value *v, char **bin, size_t *length)
+{
+    json_context c;
+
+    assert(v != NULL && bin != NULL);
+    json_context_init(&c, NULL, NULL, json_get_allocator());
+    memcpy(json_context_push(&c, 4), JSON_BINARY_MAGIC, 4);
+    json_binary_push_u32(&c, 0);
+    json_encode_binary_value(&c, v);
+    if (c.top > UINT32_MAX) {
+        JSON_FREE(c.a, c.stack);
+        *bin = NULL;
+        return JSON_BINARY_TOO_LARGE;
+    }
+    json_binary_put_u32(&c, 4, c.top);
+    *bin = c.stack;
+    if (length)
+        *length = c.top;
+    return JSON_STRINGIFY_OK;
+}
+
+/* Size of the node at off if its fixed part fits below end, else 0. */
+static size_t json_binary_node_size(const char *bin, size_t off, size_t end)
+{
+    size_t size, n;
+
+    if (off > end || end - off < 4 || off % 4 != 0)
+        return 0;
+    switch (json_binary_u32(bin + off)) {
+    case JSON_NULL:
+    case JSON_FALSE:
+    case JSON_TRUE:
+        return 4;
+    case JSON_NUMBER:
+        return end - off >= 12 ? 12 : 0;
+    case JSON_STRING:
+        if (end - off < 8)
+            return 0;
+        n = json_binary_u32(bin + off + 4);
+        size = 8 + JSON_BINARY_ALIGN(n + 1);
+        return size <= end - off && bin[off + 8 + n] == '\0' ? size : 0;
+    case JSON_ARRAY:
+    case JSON_OBJECT:
+        if (end - off < JSON_BINARY_CONTAINER)
+            return 0;
+        size = json_binary_u32(bin + off + 4);
+        n = json_binary_u32(bin + off + 8);
+        if (size < JSON_BINARY_CONTAINER || size > end - off
+                || (size - JSON_BINARY_CONTAINER) / (json_binary_u32(bin + off) == JSON_ARRAY ? 4 : 12) < n)
+            return 0;
+        return size;
+    default:
+        return 0;
+    }
+}
+
+/* Children must follow their table in order, so the blob is a tree. depth
+ * counts the enclosing containers, at most JSON_PARSE_MAX_DEPTH. */
+static int json_decode_binary_value(const char *bin, size_t off, size_t size, json_value *v,
+        size_t depth, const json_allocator *a)
+{
+    size_t n, i, pos, csize, ksize, len;
+    const char *table;
+    json_type type = (json_type) json_binary_u32(bin + off);
+
+    switch (type) {
+    case JSON_NUMBER:
+        memcpy(&v->json_n, bin + off + 4, sizeof(double));
+        break;
+    case JSON_STRING:
+        len = json_binary_u32(bin + off + 4);
+        v->json_s = (char *) JSON_MALLOC(a, len + 1);
+        memcpy(v->json_s, bin + off + 8, len + 1);
+        v->json_len = len;
+        break;
+    case JSON_ARRAY:
+    case JSON_OBJECT:
+        if (depth == JSON_PARSE_MAX_DEPTH)
+            return JSON_BINARY_INVALID;
+        n = json_binary_u32(bin + off + 8);
+        table = bin + off + JSON_BINARY_CONTAINER;
+        pos = off + JSON_BINARY_CONTAINER + n * (type == JSON_ARRAY ? 4 : 12);
+        if (type == JSON_ARRAY) {
+            v->json_e = n > 0 ? (json_value *) JSON_MALLOC(a, n * sizeof(json_value)) : NULL;
+            v->json_size = 0;
+        } else {
+            v->json_m = n > 0 ? (json_member *) JSON_MALLOC(a, n * sizeof(json_member)) : NULL;
+            v->json_osz = 0;
+        }
+        v->type = type;
+        for (i = 0; i < n; ++i) {
+            json_member *m = type == JSON_OBJECT ? &v->json_m[i] : NULL;
+            json_value *e = type == JSON_ARRAY ? &v->json_e[i] : &m->v;
+            json_init(e);
+            if (m != NULL) {
+                if (json_binary_u32(table + i * 12 + 4) != pos
+                        || (ksize = json_binary_node_size(bin, pos, off + size)) == 0
+                        || json_binary_u32(bin + pos) != JSON_STRING)
+                    goto invalid;
+                len = json_binary_u32(bin + pos + 4);
+                m->k = (char *) JSON_MALLOC(a, len + 1);
+                memcpy(m->k, bin + pos + 8, len + 1);
+                m->klen = len;
+                m->khash = json_hash_key(m->k, len);
+                pos += ksize;
+            }
+            if (json_binary_u32(table + i * (type == JSON_ARRAY ? 4 : 12) + (m != NULL ? 8 : 0)) != pos
+                    || (csize = json_binary_node_size(bin, pos, off + size)) == 0
+                    || json_decode_binary_value(bin, pos, csize, e, depth + 1, a) != JSON_PARSE_OK) {
+                if (m != NULL)
+                    JSON_FREE(a, m->k);
+                goto invalid;
+            }
+            pos += csize;
+            if (type == JSON_ARRAY)
+                v->json_size++;
+            else
+                v->json_osz++;
+        }
+        if (pos != off + size)
+            goto invalid;
+        return JSON_PARSE_OK;
+    default:
+        break;
+    }
+    v->type = type;
+    return JSON_PARSE_OK;
+invalid:
+    json_free_value(v, a);
+    return JSON_BINARY_INVALID;
+}
+
+int json_decode_binary(json_value *v, const char *bin, size_t length)
+{
+    size_t size;
+
+    assert(v != NULL && (bin != NULL || length == 0));
+    json_init(v);
+    if (length < JSON_BINARY_HEADER || memcmp(bin, JSON_BINARY_MAGIC, 4) != 0
+            || json_binary_u32(bin + 4) != length
+            || (size = json_binary_node_size(bin, JSON_BINARY_HEADER, length)) != length - JSON_BINARY_HEADER)
+        return JSON_BINARY_INVALID;
+    return json_decode_binary_value(bin, JSON_BINARY_HEADER, size, v, 0, json_get_allocator());
+}
+
+/* A view is only handed out after its node's fixed part was bounds-checked. */
+static int json_view_at(const json_view *r, size_t off, size_t end, json_view *e)
+{
+    if (off <= r->off || json_binary_node_size(r->bin, off, end) == 0)
+        return JSON_BINARY_INVALID;
+    e->bin = r->bin;
+    e->length = r->length;
+    e->off = off;
+    return JSON_PARSE_OK;
+}
+
+int json_view_init(json_view *r, const char *bin, size_t length)
+{
+    assert(r != NULL && (bin != NULL || length == 0));
+    if (length < JSON_BINARY_HEADER || memcmp(bin, JSON_BINARY_MAGIC, 4) != 0
+            || json_binary_u32(bin + 4) != length
+            || json_binary_node_size(bin, JSON_BINARY_HEADER, length) == 0)
+        return JSON_BINARY_INVALID;
+    r->bin = bin;
+    r->length = length;
+    r->off = JSON_BINARY_HEADER;
+    return JSON_PARSE_OK;
+}
+
+json_type json_view_get_type(const json_view *r)
+{
+    assert(r != NULL);
+    return (json_type) json_binary_u32(r->bin + r->off);
+}
+
+double json_view_get_number(const json_view *r)
+{
+    double n;
+
+    assert(json_view_get_type(r) == JSON_NUMBER);
+    memcpy(&n, r->bin + r->off + 4, sizeof(double));
+    return n;
+}
+
+const char *json_view_get_string(const json_view *r, size_t *len)
+{
+    assert(json_view_get_type(r) == JSON_STRING);
+    if (len)
+        *len = json_binary_u32(r->bin + r->off + 4);
+    return r->bin + r->off + 8;
+}
+
+size_t json_view_get_size(const json_view *r)
+{
+    assert(json_view_get_type(r) == JSON_ARRAY || json_view_get_type(r) == JSON_OBJECT);
+    return json_binary_u32(r->bin + r->off + 8);
+}
+
+int json_view_get_array_element(const json_view *r, size_t index, json_view *e)
+{
+    assert(json_view_get_type(r) == JSON_ARRAY && e != NULL);
+    assert(index < json_view_get_size(r));
+    return json_view_at(r, json_binary_u32(r->bin + r->off + JSON_BINARY_CONTAINER + index * 4),
+        r->off + json_binary_u32(r->bin + r->off + 4), e);
+}
+
+int json_view_get_object_member(const json_view *r, size_t index, json_view *k, json_view *e)
+{
+    const char *entry = r->bin + r->off + JSON_BINARY_CONTAINER + index * 12;
+    size_t end = r->off + json_binary_u32(r->bin + r->off + 4);
+    int ret;
+
+    assert(json_view_get_type(r) == JSON_OBJECT && k != NULL && e != NULL);
+    assert(index < json_view_get_size(r));
+    if ((ret = json_view_at(r, json_binary_u32(entry + 4), end, k)) != JSON_PARSE_OK)
+        return ret;
+    if (json_view_get_type(k) != JSON_STRING)
+        return JSON_BINARY_INVALID;
+    return json_view_at(r, json_binary_u32(entry + 8), end, e);
+}
+
+int json_view_find_object_value(const json_view *r, const char *key, size_t klen, json_view *e)
+{
+    unsigned khash = json_hash_key(key, klen);
+    const char *s;
+    size_t i, n, len;
+    json_view k;
+    int ret;
+
+    assert(json_view_get_type(r) == JSON_OBJECT && (key != NULL || klen == 0));
+    for (i = 0, n = json_view_get_size(r); i < n; ++i) {
+        if (json_binary_u32(r->bin + r->off + JSON_BINARY_CONTAINER + i * 12) != khash)
+            continue;
+        if ((ret = json_view_get_object_member(r, i, &k, e)) != JSON_PARSE_OK)
+            return ret;
+        s = json_view_get_string(&k, &len);
+        if (len == klen && memcmp(s, key, klen) == 0)
+            return JSON_PARSE_OK;
+    }
+    return JSON_POINTER_NOT_FOUND;
+}
+
+/*
+ * MessagePack and CBOR share the buffer machinery of json_stringify and the
+ * scratch stack of json_parse. Integral doubles that fit in 64 bits are
+ * written as integers, everything else as float64; decoded integers become
+ * doubles like JSON numbers do. Containers nest at most JSON_PARSE_MAX_DEPTH
+ * deep, so untrusted input cannot exhaust the C stack.
+ */
+#define JSON_CODEC_NEED(c, n) \
+    do { if ((uint64_t) ((c)->end - (c)->json) < (uint64_t) (n)) return JSON_BINARY_INVALID; } while (0)
+
+typedef int (*json_codec_decode)(json_context *c, json_value *v);
+
+static int json_codec_integral(double n, long long *i)
+{
+    if (n >= -9223372036854775808.0 && n < 9223372036854775808.0
+            && n == (double) (long long) n && !(n == 0 && signbit(n))) {
+        *i = (long long) n;
+        return 1;
+    }
+    return 0;
+}
+
+/* Push head followed by the low bytes of u in big-endian order. */
+static void json_codec_put(json_context *c, unsigned head, uint64_t u, size_t bytes)
+{
+    unsigned char *p = (unsigned char *) json_context_push(c, 1 + bytes);
+
+    *p++ = (unsigned char) head;
+    while (bytes-- > 0)
+        *p++ = (unsigned char) (u >> (bytes * 8));
+}
+
+static uint64_t json_codec_get(json_context *c, size_t bytes)
+{
+    uint64_t u = 0;
+
+    while (bytes-- > 0)
+        u = (u << 8) | (unsigned char) *c->json++;
+    return u;
+}
+
+static int json_codec_number(json_value *v, double n)
+{
+    if (!isfinite(n))
+        return JSON_BINARY_UNSUPPORTED;
+    v->json_n = n;
+    v->type = JSON_NUMBER;
+    return JSON_PARSE_OK;
+}
+
+static int json_codec_string(json_context *c, json_value *v, uint64_t len)
+{
+    JSON_CODEC_NEED(c, len);
+    v->json_s = (char *) JSON_MALLOC(c->a, len + 1);
+    memcpy(v->json_s, c->json, len);
+    v->json_s[len] = '\0';
+    v->json_len = len;
+    v->type = JSON_STRING;
+    c->json += len;
+    return JSON_PARSE_OK;
+}
+
+/* A CBOR break byte ends a container of indefinite length, otherwise n items do. */
+static int json_codec_end(json_context *c, uint64_t n, int indefinite, size_t i, int *ret)
+{
+    if (!indefinite)
+        return i == n;
+    if (c->json == c->end) {
+        *ret = JSON_BINARY_INVALID;
+        return 1;
+    }
+    if ((unsigned char) *c->json == 0xff) {
+        c->json++;
+        return 1;
+    }
+    return 0;
+}
+
+static int json_codec_array(json_context *c, json_value *v, uint64_t n, int indefinite,
+        json_codec_decode decode)
+{
+    size_t size = 0;
+    int ret = JSON_PARSE_OK;
+    json_value e;
+
+    if (c->nest == JSON_PARSE_MAX_DEPTH)
+        return JSON_BINARY_INVALID;
+    c->nest++;
+    while (!json_codec_end(c, n, indefinite, size, &ret)) {
+        json_init(&e);
+        if ((ret = decode(c, &e)) != JSON_PARSE_OK)
+            break;
+        memcpy(json_context_push(c, sizeof(json_value)), &e, sizeof(json_value));
+        ++size;
+    }
+    c->nest--;
+    if (ret != JSON_PARSE_OK) {
+        for ( ; size > 0; --size)
+            json_free_value(json_context_pop(c, sizeof(json_value)), c->a);
+        return ret;
+    }
+    v->type = JSON_ARRAY;
+    v->json_size = size;
+    size *= sizeof(json_value);
+    if (size > 0)
+        memcpy(v->json_e = (json_value *) JSON_MALLOC(c->a, size), json_context_pop(c, size), size);
+    else
+        v->json_e = NULL;
+    return JSON_PARSE_OK;
+}
+
+static int json_codec_object(json_context *c, json_value *v, uint64_t n, int indefinite,
+        json_codec_decode decode)
+{
+    size_t size = 0;
+    int ret = JSON_PARSE_OK;
+    json_value k;
+    json_member m;
+
+    if (c->nest == JSON_PARSE_MAX_DEPTH)
+        return JSON_BINARY_INVALID;
+    c->nest++;
+    while (!json_codec_end(c, n, indefinite, size, &ret)) {
+        json_init(&k);
+        if ((ret = decode(c, &k)) != JSON_PARSE_OK)
+            break;
+        if (k.type != JSON_STRING) {
+            json_free_value(&k, c->a);
+            ret = JSON_BINARY_UNSUPPORTED;
+            break;
+        }
+        m.k = k.json_s;
+        m.klen = k.json_len;
+        m.khash = json_hash_key(m.k, m.klen);
+        json_init(&m.v);
+        if ((ret = decode(c, &m.v)) != JSON_PARSE_OK) {
+            JSON_FREE(c->a, m.k);
+            break;
+        }
+        memcpy(json_context_push(c, sizeof(json_member)), &m, sizeof(json_member));
+        ++size;
+    }
+    c->nest--;
+    if (ret != JSON_PARSE_OK) {
+        for ( ; size > 0; --size)
+            json_free_object_member(json_context_pop(c, sizeof(json_member)), c->a);
+        return ret;
+    }
+    v->type = JSON_OBJECT;
+    v->json_osz = size;
+    size *= sizeof(json_member);
+    if (size > 0)
+        memcpy(v->json_m = (json_member *) JSON_MALLOC(c->a, size), json_context_pop(c, size), size);
+    else
+        v->json_m = NULL;
+    return JSON_PARSE_OK;
+}
+
+typedef void (*json_codec_encode)(json_context *c, const json_value *v);
+
+static int json_codec_encode_root(const json_value *v, char **out, size_t *length, json_codec_encode encode)
 {
-    json_free(&m->v);
-    free(m->k);
+    json_context c;
+
+    assert(v != NULL && out != NULL);
+    json_context_init(&c, NULL, NULL, json_get_allocator());
+    encode(&c, v);
+    *out = c.stack;
+    if (length)
+        *length = c.top;
+    return JSON_STRINGIFY_OK;
 }
 
-int json_parse(json_value *v, const char *json)
+static int json_codec_decode_root(json_value *v, const char *buf, size_t length, json_codec_decode decode)
 {
-    int ret;
     json_context c;
+    int ret;
 
-    assert(v != NULL);
-    c.json = json;
-    c.stack = NULL;
-    c.size = c.top = 0;
+    assert(v != NULL && (buf != NULL || length == 0));
+    json_context_init(&c, buf, buf + length, json_get_allocator());
     json_init(v);
-    json_parse_whitespace(&c);
-    if ((ret = json_parse_value(&c, v)) == JSON_PARSE_OK) {
-        json_parse_whitespace(&c);
-        if (c.json[0] != '\0') {
-            v->type = JSON_NULL;
-            ret = JSON_PARSE_ROOT_NOT_SINGULAR;
-        }
+    if ((ret = decode(&c, v)) == JSON_PARSE_OK && c.json != c.end) {
+        json_free_value(v, c.a);
+        ret = JSON_PARSE_ROOT_NOT_SINGULAR;
     }
     assert(c.top == 0);
-    free(c.stack);
+    JSON_FREE(c.a, c.stack);
     return ret;
 }
 
-json_type json_get_type(const json_value *v)
+/* MessagePack: https://github.com/msgpack/msgpack/blob/master/spec.md */
+static void json_msgpack_put_size(json_context *c, size_t n, unsigned fix, unsigned fixmax,
+        unsigned h8, unsigned h16)
 {
-    assert(v != NULL);
-    return v->type;
+    assert(n <= UINT32_MAX);
+    if (n <= fixmax)
+        json_codec_put(c, fix | (unsigned) n, 0, 0);
+    else if (h8 != 0 && n <= 0xff)
+        json_codec_put(c, h8, n, 1);
+    else if (n <= 0xffff)
+        json_codec_put(c, h16, n, 2);
+    else
+        json_codec_put(c, h16 + 1, n, 4);
 }
 
-int json_get_boolean(const json_value *v)
+static void json_encode_msgpack_value(json_context *c, const json_value *v)
 {
-    assert(v != NULL && (v->type == JSON_TRUE || v->type == JSON_FALSE));
-    return v->type == JSON_TRUE;
+    long long i;
+    uint64_t u;
+    size_t k;
+
+    switch (v->type) {
+    case JSON_NULL:  json_codec_put(c, 0xc0, 0, 0); break;
+    case JSON_FALSE: json_codec_put(c, 0xc2, 0, 0); break;
+    case JSON_TRUE:  json_codec_put(c, 0xc3, 0, 0); break;
+    case JSON_NUMBER:
+        if (!json_codec_integral(v->json_n, &i)) {
+            memcpy(&u, &v->json_n, sizeof(u));
+            json_codec_put(c, 0xcb, u, 8);
+        } else if (i >= 0) {
+            if (i < 0x80)
+                json_codec_put(c, (unsigned) i, 0, 0);
+            else
+                json_codec_put(c, i <= 0xff ? 0xcc : i <= 0xffff ? 0xcd : i <= 0xffffffffLL ? 0xce : 0xcf,
+                    i, i <= 0xff ? 1 : i <= 0xffff ? 2 : i <= 0xffffffffLL ? 4 : 8);
+        } else {
+            if (i >= -32)
+                json_codec_put(c, (unsigned) (i & 0xff), 0, 0);
+            else
+                json_codec_put(c, i >= -0x80 ? 0xd0 : i >= -0x8000 ? 0xd1 : i >= -0x80000000LL ? 0xd2 : 0xd3,
+                    (uint64_t) i, i >= -0x80 ? 1 : i >= -0x8000 ? 2 : i >= -0x80000000LL ? 4 : 8);
+        }
+        break;
+    case JSON_STRING:
+        json_msgpack_put_size(c, v->json_len, 0xa0, 31, 0xd9, 0xda);
+        if (v->json_len > 0)
+            memcpy(json_context_push(c, v->json_len), v->json_s, v->json_len);
+        break;
+    case JSON_ARRAY:
+        json_msgpack_put_size(c, v->json_size, 0x90, 15, 0, 0xdc);
+        for (k = 0; k < v->json_size; ++k)
+            json_encode_msgpack_value(c, &v->json_e[k]);
+        break;
+    case JSON_OBJECT:
+        json_msgpack_put_size(c, v->json_osz, 0x80, 15, 0, 0xde);
+        for (k = 0; k < v->json_osz; ++k) {
+            json_msgpack_put_size(c, v->json_m[k].klen, 0xa0, 31, 0xd9, 0xda);
+            if (v->json_m[k].klen > 0)
+                memcpy(json_context_push(c, v->json_m[k].klen), v->json_m[k].k, v->json_m[k].klen);
+            json_encode_msgpack_value(c, &v->json_m[k].v);
+        }
+        break;
+    }
 }
 
-void json_set_boolean(json_value *v, int b)
+static int json_decode_msgpack_value(json_context *c, json_value *v)
 {
-    json_free(v);
-    v->type = b ? JSON_TRUE : JSON_FALSE;
+    unsigned char b;
+    uint64_t u;
+    float f;
+    double d;
+
+    JSON_CODEC_NEED(c, 1);
+    b = (unsigned char) *c->json++;
+    if (b <= 0x7f)
+        return json_codec_number(v, b);
+    if (b >= 0xe0)
+        return json_codec_number(v, (signed char) b);
+    if (b <= 0x8f)
+        return json_codec_object(c, v, b & 0x0f, 0, json_decode_msgpack_value);
+    if (b <= 0x9f)
+        return json_codec_array(c, v, b & 0x0f, 0, json_decode_msgpack_value);
+    if (b <= 0xbf)
+        return json_codec_string(c, v, b & 0x1f);
+    switch (b) {
+    case 0xc0: v->type = JSON_NULL; return JSON_PARSE_OK;
+    case 0xc2: v->type = JSON_FALSE; return JSON_PARSE_OK;
+    case 0xc3: v->type = JSON_TRUE; return JSON_PARSE_OK;
+    case 0xca:
+        JSON_CODEC_NEED(c, 4);
+        u = json_codec_get(c, 4);
+        {
+            uint32_t u32 = (uint32_t) u;
+            memcpy(&f, &u32, sizeof(f));
+        }
+        return json_codec_number(v, f);
+    case 0xcb:
+        JSON_CODEC_NEED(c, 8);
+        u = json_codec_get(c, 8);
+        memcpy(&d, &u, sizeof(d));
+        return json_codec_number(v, d);
+    case 0xcc: case 0xcd: case 0xce: case 0xcf:
+        JSON_CODEC_NEED(c, 1 << (b - 0xcc));
+        return json_codec_number(v, (double) json_codec_get(c, 1 << (b - 0xcc)));
+    case 0xd0: JSON_CODEC_NEED(c, 1); return json_codec_number(v, (int8_t) json_codec_get(c, 1));
+    case 0xd1: JSON_CODEC_NEED(c, 2); return json_codec_number(v, (int16_t) json_codec_get(c, 2));
+    case 0xd2: JSON_CODEC_NEED(c, 4); return json_codec_number(v, (int32_t) json_codec_get(c, 4));
+    case 0xd3: JSON_CODEC_NEED(c, 8); return json_codec_number(v, (double) (int64_t) json_codec_get(c, 8));
+    case 0xd9: case 0xda: case 0xdb:
+        JSON_CODEC_NEED(c, 1 << (b - 0xd9));
+        return json_codec_string(c, v, json_codec_get(c, 1 << (b - 0xd9)));
+    case 0xdc: case 0xdd:
+        JSON_CODEC_NEED(c, 2 << (b - 0xdc));
+        return json_codec_array(c, v, json_codec_get(c, 2 << (b - 0xdc)), 0, json_decode_msgpack_value);
+    case 0xde: case 0xdf:
+        JSON_CODEC_NEED(c, 2 << (b - 0xde));
+        return json_codec_object(c, v, json_codec_get(c, 2 << (b - 0xde)), 0, json_decode_msgpack_value);
+    case 0xc1:
+        return JSON_BINARY_INVALID;
+    default:    /* bin, ext and fixext have no JSON counterpart */
+        return JSON_BINARY_UNSUPPORTED;
+    }
 }
 
-double json_get_number(const json_value *v)
+int json_encode_msgpack(const json_value *v, char **out, size_t *length)
 {
-    assert(v != NULL && v->type == JSON_NUMBER);
-    return v->json_n;
+    return json_codec_encode_root(v, out, length, json_encode_msgpack_value);
 }
 
-void json_set_number(json_value *v, double n)
+int json_decode_msgpack(json_value *v, const char *buf, size_t length)
 {
-    json_free(v);
-    v->json_n = n;
-    v->type = JSON_NUMBER;
+    return json_codec_decode_root(v, buf, length, json_decode_msgpack_value);
 }
 
-const char *json_get_string(const json_value *v)
+/* CBOR: RFC 8949 */
+static void json_cbor_put_head(json_context *c, unsigned major, uint64_t u)
 {
-    assert(v != NULL && v->type == JSON_STRING);
-    return v->json_s;
+    if (u < 24)
+        json_codec_put(c, major << 5 | (unsigned) u, 0, 0);
+    else if (u <= 0xff)
+        json_codec_put(c, major << 5 | 24, u, 1);
+    else if (u <= 0xffff)
+        json_codec_put(c, major << 5 | 25, u, 2);
+    else if (u <= 0xffffffff)
+        json_codec_put(c, major << 5 | 26, u, 4);
+    else
+        json_codec_put(c, major << 5 | 27, u, 8);
 }
 
-void json_set_string(json_value *v, const char *s, size_t len)
+static void json_encode_cbor_value(json_context *c, const json_value *v)
 {
-    assert(v != NULL && (s != NULL || len == 0));
-    json_free(v);
-    v->json_s = (char *) malloc(len + 1);
-    memcpy(v->json_s, s, len);
-    v->json_s[len] = 0;
+    long long i;
+    uint64_t u;
+    size_t k;
+
+    switch (v->type) {
+    case JSON_NULL:  json_codec_put(c, 0xf6, 0, 0); break;
+    case JSON_FALSE: json_codec_put(c, 0xf4, 0, 0); break;
+    case JSON_TRUE:  json_codec_put(c, 0xf5, 0, 0); break;
+    case JSON_NUMBER:
+        if (!json_codec_integral(v->json_n, &i)) {
+            memcpy(&u, &v->json_n, sizeof(u));
+            json_codec_put(c, 0xfb, u, 8);
+        } else if (i >= 0)
+            json_cbor_put_head(c, 0, (uint64_t) i);
+        else
+            json_cbor_put_head(c, 1, (uint64_t) -(i + 1));
+        break;
+    case JSON_STRING:
+        json_cbor_put_head(c, 3, v->json_len);
+        if (v->json_len > 0)
+            memcpy(json_context_push(c, v->json_len), v->json_s, v->json_len);
+        break;
+    case JSON_ARRAY:
+        json_cbor_put_head(c, 4, v->json_size);
+        for (k = 0; k < v->json_size; ++k)
+            json_encode_cbor_value(c, &v->json_e[k]);
+        break;
+    case JSON_OBJECT:
+        json_cbor_put_head(c, 5, v->json_osz);
+        for (k = 0; k < v->json_osz; ++k) {
+            json_cbor_put_head(c, 3, v->json_m[k].klen);
+            if (v->json_m[k].klen > 0)
+                memcpy(json_context_push(c, v->json_m[k].klen), v->json_m[k].k, v->json_m[k].klen);
+            json_encode_cbor_value(c, &v->json_m[k].v);
+        }
+        break;
+    }
+}
+
+/* Read an initial byte and its argument; ai 31 (indefinite length) has none. */
+static int json_cbor_get_head(json_context *c, unsigned *major, unsigned *ai, uint64_t *u)
+{
+    unsigned char b;
+
+    JSON_CODEC_NEED(c, 1);
+    b = (unsigned char) *c->json++;
+    *major = b >> 5;
+    *ai = b & 0x1f;
+    if (*ai < 24)
+        *u = *ai;
+    else if (*ai <= 27) {
+        JSON_CODEC_NEED(c, 1 << (*ai - 24));
+        *u = json_codec_get(c, 1 << (*ai - 24));
+    } else if (*ai == 31 && *major >= 2 && *major <= 5)
+        *u = 0;
+    else
+        return JSON_BINARY_INVALID;
+    return JSON_PARSE_OK;
+}
+
+static double json_cbor_half(unsigned h)
+{
+    unsigned exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+    double d;
+
+    if (exp == 0)
+        d = ldexp(mant, -24);
+    else if (exp != 31)
+        d = ldexp(mant + 1024, (int) exp - 25);
+    else
+        d = mant == 0 ? INFINITY : NAN;
+    return h & 0x8000 ? -d : d;
+}
+
+/* Concatenate the definite-length chunks of an indefinite text string. */
+static int json_cbor_chunks(json_context *c, json_value *v)
+{
+    size_t head = c->top, len;
+    unsigned major, ai;
+    uint64_t u;
+    int ret;
+
+    for ( ; ; ) {
+        if (c->json < c->end && (unsigned char) *c->json == 0xff) {
+            c->json++;
+            break;
+        }
+        if ((ret = json_cbor_get_head(c, &major, &ai, &u)) == JSON_PARSE_OK
+                && (major != 3 || ai == 31 || (uint64_t) (c->end - c->json) < u))
+            ret = JSON_BINARY_INVALID;
+        if (ret != JSON_PARSE_OK) {
+            c->top = head;
+            return ret;
+        }
+        if (u > 0)
+            memcpy(json_context_push(c, u), c->json, u);
+        c->json += u;
+    }
+    len = c->top - head;
+    v->json_s = (char *) JSON_MALLOC(c->a, len + 1);
+    if (len > 0)
+        memcpy(v->json_s, json_context_pop(c, len), len);
+    v->json_s[len] = '\0';
     v->json_len = len;
     v->type = JSON_STRING;
+    return JSON_PARSE_OK;
 }
 
-size_t json_get_string_length(const json_value *v)
+static int json_decode_cbor_value(json_context *c, json_value *v)
 {
-    assert(v != NULL && v->type == JSON_STRING);
-    return v->json_len;
+    unsigned major, ai;
+    uint64_t u;
+    float f;
+    double d;
+    int ret;
+
+    /* Tags only annotate the item that follows. */
+    do {
+        if ((ret = json_cbor_get_head(c, &major, &ai, &u)) != JSON_PARSE_OK)
+            return ret;
+    } while (major == 6);
+    switch (major) {
+    case 0: return json_codec_number(v, (double) u);
+    case 1: return json_codec_number(v, -1.0 - (double) u);
+    case 3: return ai == 31 ? json_cbor_chunks(c, v) : json_codec_string(c, v, u);
+    case 4: return json_codec_array(c, v, u, ai == 31, json_decode_cbor_value);
+    case 5: return json_codec_object(c, v, u, ai == 31, json_decode_cbor_value);
+    case 7:
+        switch (ai) {
+        case 20: v->type = JSON_FALSE; return JSON_PARSE_OK;
+        case 21: v->type = JSON_TRUE; return JSON_PARSE_OK;
+        case 22: v->type = JSON_NULL; return JSON_PARSE_OK;
+        case 25: return json_codec_number(v, json_cbor_half((unsigned) u));
+        case 26:
+            {
+                uint32_t u32 = (uint32_t) u;
+                memcpy(&f, &u32, sizeof(f));
+            }
+            return json_codec_number(v, f);
+        case 27:
+            memcpy(&d, &u, sizeof(d));
+            return json_codec_number(v, d);
+        default:    /* undefined and other simple values */
+            return JSON_BINARY_UNSUPPORTED;
+        }
+    default:        /* byte strings */
+        return JSON_BINARY_UNSUPPORTED;
+    }
 }
 
-json_value *json_get_array_element(const json_value *v, size_t index)
+int json_encode_cbor(const json_value *v, char **out, size_t *length)
 {
-    assert(v != NULL && v->type == JSON_ARRAY);
-    assert(index < v->json_size);
-    return &v->json_e[index];
+    return json_codec_encode_root(v, out, length, json_encode_cbor_value);
 }
 
-size_t json_get_array_size(const json_value *v)
+int json_decode_cbor(json_value *v, const char *buf, size_t length)
 {
-    assert(v != NULL && v->type == JSON_ARRAY);
-    return v->json_size;
+    return json_codec_decode_root(v, buf, length, json_decode_cbor_value);
 }
 
-size_t json_get_object_size(const json_value *v)
+/*
+ * Pair each member of lhs from i on with an unused member of rhs that has
+ * the same key and an equal value; the first i are already paired in order.
+ * Equality is an equivalence, so taking the first match never blocks a
+ * later one, and duplicate keys are matched one to one in either direction.
+ */
+static int json_is_equal_members(const json_value *lhs, const json_value *rhs, size_t i)
 {
-    assert(v != NULL && v->type == JSON_OBJECT);
-    return v->json_osz;
+    const json_allocator *a = json_get_allocator();
+    unsigned char local[64], *used = local;
+    size_t n = rhs->json_osz, j;
+    int ret = 1;
+
+    if (n > sizeof(local))
+        used = (unsigned char *) JSON_MALLOC(a, n);
+    memset(used, 1, i);
+    memset(used + i, 0, n - i);
+    for ( ; i < lhs->json_osz; ++i) {
+        const json_member *m = &lhs->json_m[i];
+        /* Scan on from the first member with the key. */
+        if ((j = json_find_member(rhs, m->k, m->klen, m->khash)) == JSON_KEY_NOT_EXIST)
+            j = n;
+        for ( ; j < n; ++j)
+            if (!used[j] && rhs->json_m[j].klen == m->klen && memcmp(rhs->json_m[j].k, m->k, m->klen) == 0
+                    && json_is_equal(&m->v, &rhs->json_m[j].v))
+                break;
+        if (j == n) {
+            ret = 0;
+            break;
+        }
+        used[j] = 1;
+    }
+    if (used != local)
+        JSON_FREE(a, used);
+    return ret;
 }
 
-const char *json_get_object_key(const json_value *v, size_t index)
+int json_is_equal(const json_value *lhs, const json_value *rhs)
 {
-    assert(v != NULL && v->type == JSON_OBJECT);
-    return v->json_m[index].k;
+    size_t i;
+
+    assert(lhs != NULL && rhs != NULL);
+    if (lhs->type != rhs->type)
+        return 0;
+    switch (lhs->type) {
+    case JSON_NUMBER:
+        return lhs->json_n == rhs->json_n;
+    case JSON_STRING:
+        return lhs->json_len == rhs->json_len && memcmp(lhs->json_s, rhs->json_s, lhs->json_len) == 0;
+    case JSON_ARRAY:
+        if (lhs->json_size != rhs->json_size)
+            return 0;
+        if (lhs->json_e == rhs->json_e)
+            return 1;
+        for (i = 0; i < lhs->json_size; ++i)
+            if (!json_is_equal(&lhs->json_e[i], &rhs->json_e[i]))
+                return 0;
+        return 1;
+    case JSON_OBJECT:
+        if (lhs->json_osz != rhs->json_osz)
+            return 0;
+        if (lhs->json_m == rhs->json_m)
+            return 1;
+        /* Members are usually in the same order. */
+        for (i = 0; i < lhs->json_osz; ++i)
+            if (lhs->json_m[i].klen != rhs->json_m[i].klen
+                    || memcmp(lhs->json_m[i].k, rhs->json_m[i].k, lhs->json_m[i].klen) != 0
+                    || !json_is_equal(&lhs->json_m[i].v, &rhs->json_m[i].v))
+                break;
+        return i == lhs->json_osz || json_is_equal_members(lhs, rhs, i);
+    default:
+        return 1;
+    }
 }
 
-size_t json_get_object_key_length(const json_value *v, size_t index)
+/*
+ * In-place edits of a private container. Vectors double like the context
+ * stack, so n inserts copy O(n) elements. Make room in the vector p of
+ * size elements for one more.
+ */
+static void *json_vector_reserve(json_value *v, void *p, size_t size, size_t width, const json_allocator *a)
 {
-    assert(v != NULL && v->type == JSON_OBJECT);
-    return v->json_m[index].klen;
+    unsigned k = v->flags >> JSON_CAPACITY_SHIFT;
+
+    if (k != 0 && size < (size_t) 1 << (k - 1))
+        return p;
+    for (k = 2; ((size_t) 1 << k) <= size; ++k)
+        ;
+    v->flags = (v->flags & ~JSON_CAPACITY_MASK) | (k + 1) << JSON_CAPACITY_SHIFT;
+    return JSON_REALLOC(a, p, ((size_t) 1 << k) * width);
 }
 
-json_value *json_get_object_value(const json_value *v, size_t index)
+static void json_array_put(json_value *v, size_t index, const json_value *e, const json_allocator *a)
 {
-    assert(v != NULL && v->type == JSON_OBJECT);
-    return &v->json_m[index].v;
+    v->json_e = (json_value *) json_vector_reserve(v, v->json_e, v->json_size, sizeof(json_value), a);
+    memmove(&v->json_e[index + 1], &v->json_e[index], (v->json_size - index) * sizeof(json_value));
+    v->json_e[index] = *e;
+    v->json_size++;
 }
 
-#ifndef JSON_PARSE_STRINGIFY_INIT_SIZE
-# define JSON_PARSE_STRINGIFY_INIT_SIZE 256
-#endif
+static void json_array_take(json_value *v, size_t index, json_value *e, const json_allocator *a)
+{
+    *e = v->json_e[index];
+    memmove(&v->json_e[index], &v->json_e[index + 1], (--v->json_size - index) * sizeof(json_value));
+    if (v->json_size == 0) {
+        JSON_FREE(a, v->json_e);
+        v->json_e = NULL;
+        v->flags &= ~JSON_CAPACITY_MASK;
+    }
+}
 
-#define PUTS(c, s, len)   memcpy(json_context_push(c, len), s, len);
+static void json_object_put(json_value *v, size_t index, const json_member *m, const json_allocator *a)
+{
+    v->json_m = (json_member *) json_vector_reserve(v, v->json_m, v->json_osz, sizeof(json_member), a);
+    memmove(&v->json_m[index + 1], &v->json_m[index], (v->json_osz - index) * sizeof(json_member));
+    v->json_m[index] = *m;
+    v->json_osz++;
+}
 
-static unsigned json_decode_utf8(const u_char* ch, size_t* pos)
-{
-    unsigned u = 0;
-    ch += *pos;
-    unsigned hex = *ch;
-    if (hex <= 0xdf) {
-        u |= (*ch & 0x1f);
-        u <<= 6, ch++, (*pos)++;
-        u |= (*ch & 0x3f);
-    } else if (hex <= 0xef) {
-        u |= (*ch & 0x0f);
-        u <<= 6, ch++, (*pos)++;
-        u |= (*ch & 0x3f);
-        u <<= 6, ch++, (*pos)++;
-        u |= (*ch & 0x3f);
-    } else if (hex <= 0xf7) {
-        u |= (*ch & 0x07);
-        u <<= 6, ch++, (*pos)++;
-        u |= (*ch & 0x3f);
-        u <<= 6, ch++, (*pos)++;
-        u |= (*ch & 0x3f);
-        u <<= 6, ch++, (*pos)++;
-        u |= (*ch & 0x3f);
+static void json_object_take(json_value *v, size_t index, json_member *m, const json_allocator *a)
+{
+    *m = v->json_m[index];
+    memmove(&v->json_m[index], &v->json_m[index + 1], (--v->json_osz - index) * sizeof(json_member));
+    if (v->json_osz == 0) {
+        JSON_FREE(a, v->json_m);
+        v->json_m = NULL;
+        v->flags &= ~JSON_CAPACITY_MASK;
     }
-    return u;
 }
 
-static void json_stringify_string(json_context* c, const json_value* v)
+/* Append a member with a copy of the key and a null value; returns its index. */
+static size_t json_object_append(json_value *v, const char *k, size_t klen, unsigned khash,
+        const json_allocator *a)
 {
-    static const char hex_digits[] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
-    size_t size;
-    u_char* p;
-    u_char* head;
+    json_member m;
 
-    assert(v->json_s != NULL);
-    size = v->json_len * 6 + 2;
-    p = head = json_context_push(c, size);
-    *p++ = '"';
-    for (size_t i = 0; i < v->json_len; ++i) {
-        u_char ch = (u_char) v->json_s[i];
-        switch (ch) {
-        case '\\': *p++ = '\\'; *p++ = '\\'; break;
-        case '"':  *p++ = '\\'; *p++ = '"'; break;
-        case '/':  *p++ = '\\'; *p++ = '/'; break;
-        case '\t': *p++ = '\\'; *p++ = 't'; break;
-        case '\b': *p++ = '\\'; *p++ = 'b'; break;
-        case '\n': *p++ = '\\'; *p++ = 'n'; break;
-        case '\r': *p++ = '\\'; *p++ = 'r'; break;
-        case '\f': *p++ = '\\'; *p++ = 'f'; break;
-        default:
-            if (ch < 0x20) {
-                *p++ = '\\'; *p++ = 'u'; *p++ = '0'; *p++ = '0';
-                *p++ = hex_digits[ch >> 4];
-                *p++ = hex_digits[ch & 15];
-            } else if (ch > 0x7f) { /* Handle UTF-8. */
-                unsigned u = json_decode_utf8((const u_char*) v->json_s, &i);;
-                if (u <= 0xffff) {
-                    *p++ = '\\'; *p++ = 'u';
-                    *p++ = hex_digits[u >> 12];
-                    *p++ = hex_digits[(u >> 8) & 15];
-                    *p++ = hex_digits[(u >> 4) & 15];
-                    *p++ = hex_digits[u & 15];
-                } else if (u <= 0x10ffff) { /* Transfer codepoint to surrogate pair. */
-                    unsigned h, l;
-                    u -= 0x10000;
-                    h = (u - (l = u % 0x400)) / 0x400;
-                    h += 0xd800, l += 0xdc00;
-                    *p++ = '\\'; *p++ = 'u';
-                    *p++ = hex_digits[h >> 12];
-                    *p++ = hex_digits[(h >> 8) & 15];
-                    *p++ = hex_digits[(h >> 4) & 15];
-                    *p++ = hex_digits[h & 15];
-                    *p++ = '\\'; *p++ = 'u';
-                    *p++ = hex_digits[l >> 12];
-                    *p++ = hex_digits[(l >> 8) & 15];
-                    *p++ = hex_digits[(l >> 4) & 15];
-                    *p++ = hex_digits[l & 15];
-                }
-            } else {
-                *p++ = v->json_s[i];
+    m.k = (char *) JSON_MALLOC(a, klen + 1);
+    memcpy(m.k, k, klen);
+    m.k[klen] = '\0';
+    m.klen = klen;
+    m.khash = khash;
+    json_init(&m.v);
+    json_object_put(v, v->json_osz, &m, a);
+    return v->json_osz - 1;
+}
+
+static void json_merge_patch_value(json_value *target, const json_value *patch, const json_allocator *a)
+{
+    json_member removed;
+    size_t i, index;
+
+    if (patch->type != JSON_OBJECT) {
+        json_free_value(target, a);
+        json_copy_value(target, patch, a);
+        return;
+    }
+    if (target->type != JSON_OBJECT) {
+        json_free_value(target, a);
+        target->type = JSON_OBJECT;
+        target->json_m = NULL;
+        target->json_osz = 0;
+    } else
+        json_unshare(target);
+    for (i = 0; i < patch->json_osz; ++i) {
+        const json_member *m = &patch->json_m[i];
+        index = json_find_member(target, m->k, m->klen, m->khash);
+        if (m->v.type == JSON_NULL) {
+            if (index != JSON_KEY_NOT_EXIST) {
+                json_object_take(target, index, &removed, a);
+                json_free_object_member(&removed, a);
             }
-            break;
+            continue;
         }
+        if (index == JSON_KEY_NOT_EXIST)
+            index = json_object_append(target, m->k, m->klen, m->khash, a);
+        json_merge_patch_value(&target->json_m[index].v, &m->v, a);
     }
-    *p++ = '"';
-    c->top -= size - (p - head);
 }
 
-static int json_stringify_value(json_context* c, const json_value* v);
-static void json_stringify_object_member(json_context* c, const json_member* m)
+int json_merge_patch(json_value *target, const json_value *patch)
 {
-    assert(m->k != NULL);
-    PUTC(c, '"');
-    PUTS(c, m->k, m->klen);
-    PUTC(c, '"');
-    PUTC(c, ':');
-    json_stringify_value(c, &m->v);
+    assert(target != NULL && patch != NULL && target != patch);
+    json_merge_patch_value(target, patch, json_get_allocator());
+    return JSON_PARSE_OK;
 }
 
-static int json_stringify_value(json_context* c, const json_value* v)
+/*
+ * JSON Patch keeps an undo log instead of a copy of the document. Each entry
+ * names its container by the child indices from the root, since later edits
+ * may move the vectors above it, and holds whatever the edit displaced.
+ * Unsharing a node on the way is logged too, holding a reference to the
+ * shared original. Undoing in reverse order walks back through the exact
+ * intermediate states, sharing included.
+ */
+enum { JSON_UNDO_ROOT, JSON_UNDO_SET, JSON_UNDO_INSERT, JSON_UNDO_REMOVE, JSON_UNDO_UNSHARE };
+
+typedef struct {
+    int op;
+    int moved;          /* the value travels with a move, see json_patch_rollback */
+    size_t path, depth; /* offset and count of child indices in json_patcher.path */
+    size_t index;       /* of the element or member in the container */
+    json_member saved;  /* replaced value, removed element or member, or shared original */
+} json_undo;
+
+typedef struct {
+    json_value *doc;
+    json_context undo;
+    json_context path;
+    const json_allocator *a;
+} json_patcher;
+
+static json_undo *json_patch_log(json_patcher *t, int op, size_t path, size_t depth, size_t index, int moved)
 {
-    switch (v->type) {
-    case JSON_NULL:  PUTS(c, "null", 4); break;
-    case JSON_TRUE:  PUTS(c, "true", 4); break;
-    case JSON_FALSE: PUTS(c, "false", 5); break;
-    case JSON_NUMBER:
-        c->top -= 32 - sprintf(json_context_push(c, 32), "%.17g", v->json_n);
-        break;
-    case JSON_OBJECT:
-        PUTC(c, '{');
-        for (size_t i = 0; i < v->json_osz; ++i) {
-            json_stringify_object_member(c, &v->json_m[i]);
-            PUTC(c, ',');
+    json_undo *u = (json_undo *) json_context_push(&t->undo, sizeof(json_undo));
+
+    u->op = op;
+    u->moved = moved;
+    u->path = path;
+    u->depth = depth;
+    u->index = index;
+    u->saved.k = NULL;
+    json_init(&u->saved.v);
+    return u;
+}
+
+/* Unshare the node reached by depth indices at path, logging the original. */
+static void json_patch_unshare(json_patcher *t, json_value *v, size_t path, size_t depth)
+{
+    json_undo *u;
+
+    if (!(v->flags & JSON_SHARED))
+        return;
+    u = json_patch_log(t, JSON_UNDO_UNSHARE, path, depth, 0, 0);
+    u->saved.v = *v;
+    json_retain(v);
+    json_unshare(v);
+}
+
+/* Walk to the container of p's last token, unsharing it and every node
+ * above it, and append the child indices taken to t->path. */
+static json_value *json_patch_parent(json_patcher *t, const json_pointer *p, size_t *depth)
+{
+    json_value *v = t->doc;
+    size_t i, index, path = t->path.top;
+
+    for (i = 0; i + 1 < p->size; ++i) {
+        const json_pointer_segment *seg = &p->s[i];
+        json_patch_unshare(t, v, path, i);
+        if (v->type == JSON_OBJECT
+                && (index = json_find_member(v, seg->k, seg->klen, seg->khash)) != JSON_KEY_NOT_EXIST)
+            v = &v->json_m[index].v;
+        else if (v->type == JSON_ARRAY && seg->index < v->json_size)
+            v = &v->json_e[index = seg->index];
+        else
+            return NULL;
+        memcpy(json_context_push(&t->path, sizeof(size_t)), &index, sizeof(size_t));
+    }
+    json_patch_unshare(t, v, path, i);
+    *depth = i;
+    return v;
+}
+
+static json_value *json_patch_container(json_patcher *t, const json_undo *u)
+{
+    json_value *v = t->doc;
+    size_t i, index;
+
+    for (i = 0; i < u->depth; ++i) {
+        memcpy(&index, t->path.stack + u->path + i * sizeof(size_t), sizeof(size_t));
+        v = v->type == JSON_OBJECT ? &v->json_m[index].v : &v->json_e[index];
+    }
+    return v;
+}
+
+/* Place *e at p: add inserts into arrays and objects, replace only overwrites. */
+static int json_patch_put(json_patcher *t, const json_pointer *p, json_value *e, int add, int moved)
+{
+    size_t path = t->path.top, depth, index;
+    const json_pointer_segment *seg;
+    json_value *parent, *slot;
+    json_undo *u;
+
+    if (p->size == 0) {
+        u = json_patch_log(t, JSON_UNDO_ROOT, path, 0, 0, moved);
+        u->saved.v = *t->doc;
+        *t->doc = *e;
+        return JSON_PARSE_OK;
+    }
+    if ((parent = json_patch_parent(t, p, &depth)) == NULL)
+        goto not_found;
+    seg = &p->s[p->size - 1];
+    if (parent->type == JSON_OBJECT) {
+        index = json_find_member(parent, seg->k, seg->klen, seg->khash);
+        if (index == JSON_KEY_NOT_EXIST) {
+            if (!add)
+                goto not_found;
+            index = json_object_append(parent, seg->k, seg->klen, seg->khash, t->a);
+            parent->json_m[index].v = *e;
+            json_patch_log(t, JSON_UNDO_INSERT, path, depth, index, moved);
+            return JSON_PARSE_OK;
         }
-        if (v->json_osz > 0)
-            json_context_pop(c, 1);   /* Delete the last ',' */
-        PUTC(c, '}');
-        break;
-    case JSON_ARRAY:
-        PUTC(c, '[');
-        for (size_t i = 0; i < v->json_size; ++i) {
-            json_stringify_value(c, &v->json_e[i]);
-            PUTC(c, ',');
+        slot = &parent->json_m[index].v;
+    } else if (parent->type == JSON_ARRAY) {
+        index = seg->index == JSON_POINTER_APPEND && add ? parent->json_size : seg->index;
+        if (add && index <= parent->json_size) {
+            json_array_put(parent, index, e, t->a);
+            json_patch_log(t, JSON_UNDO_INSERT, path, depth, index, moved);
+            return JSON_PARSE_OK;
         }
-        if (v->json_size)
-            json_context_pop(c, 1);  /* Delete the last ',' */
-        PUTC(c, ']');
-        break;
-    case JSON_STRING: json_stringify_string(c, v); break;
+        if (add || index >= parent->json_size)
+            goto not_found;
+        slot = &parent->json_e[index];
+    } else
+        goto not_found;
+    u = json_patch_log(t, JSON_UNDO_SET, path, depth, index, moved);
+    u->saved.v = *slot;
+    *slot = *e;
+    return JSON_PARSE_OK;
+not_found:
+    return JSON_POINTER_NOT_FOUND;
+}
+
+/* Remove the value at p; with out set, the caller takes it over. */
+static int json_patch_remove(json_patcher *t, const json_pointer *p, json_value *out)
+{
+    size_t path = t->path.top, depth, index;
+    const json_pointer_segment *seg;
+    json_value *parent;
+    json_undo *u;
+
+    if (p->size == 0)
+        return JSON_PATCH_INVALID;
+    if ((parent = json_patch_parent(t, p, &depth)) == NULL)
+        goto not_found;
+    seg = &p->s[p->size - 1];
+    if (parent->type == JSON_OBJECT
+            && (index = json_find_member(parent, seg->k, seg->klen, seg->khash)) != JSON_KEY_NOT_EXIST) {
+        u = json_patch_log(t, JSON_UNDO_REMOVE, path, depth, index, out != NULL);
+        json_object_take(parent, index, &u->saved, t->a);
+    } else if (parent->type == JSON_ARRAY && seg->index < parent->json_size) {
+        u = json_patch_log(t, JSON_UNDO_REMOVE, path, depth, seg->index, out != NULL);
+        json_array_take(parent, seg->index, &u->saved.v, t->a);
+    } else
+        goto not_found;
+    if (out != NULL) {
+        *out = u->saved.v;
+        json_init(&u->saved.v);
     }
-    return JSON_STRINGIFY_OK;
+    return JSON_PARSE_OK;
+not_found:
+    return JSON_POINTER_NOT_FOUND;
 }
 
-int json_stringify(const json_value* v, char** json, size_t* length)
+/*
+ * A move logs a remove and a put that share one value. Undoing the put
+ * hands the value over in carry instead of freeing it, and undoing the
+ * remove puts carry back where the value came from.
+ */
+static void json_patch_rollback(json_patcher *t)
 {
-    json_context c;
+    json_value carry, cur, *c, *slot;
+    json_member m;
+    json_undo *u;
+
+    json_init(&carry);
+    while (t->undo.top > 0) {
+        u = (json_undo *) json_context_pop(&t->undo, sizeof(json_undo));
+        c = json_patch_container(t, u);
+        switch (u->op) {
+        case JSON_UNDO_ROOT:
+        case JSON_UNDO_SET:
+            slot = u->op == JSON_UNDO_ROOT ? t->doc
+                : c->type == JSON_OBJECT ? &c->json_m[u->index].v : &c->json_e[u->index];
+            cur = *slot;
+            *slot = u->saved.v;
+            break;
+        case JSON_UNDO_UNSHARE:
+            /* c is back to the private copy json_unshare made. */
+            json_free_value(c, t->a);
+            *c = u->saved.v;
+            continue;
+        case JSON_UNDO_INSERT:
+            if (c->type == JSON_OBJECT) {
+                json_object_take(c, u->index, &m, t->a);
+                JSON_FREE(t->a, m.k);
+                cur = m.v;
+            } else
+                json_array_take(c, u->index, &cur, t->a);
+            break;
+        default:
+            if (u->moved) {
+                u->saved.v = carry;
+                json_init(&carry);
+            }
+            if (c->type == JSON_OBJECT)
+                json_object_put(c, u->index, &u->saved, t->a);
+            else
+                json_array_put(c, u->index, &u->saved.v, t->a);
+            continue;
+        }
+        if (u->moved)
+            carry = cur;
+        else
+            json_free_value(&cur, t->a);
+    }
+}
+
+#define JSON_PATCH_IS(v, name) ((v)->json_len == sizeof(name) - 1 && memcmp((v)->json_s, name, sizeof(name) - 1) == 0)
+
+static int json_patch_apply(json_patcher *t, const json_value *op)
+{
+    const json_value *name, *path, *from, *value, *src;
+    json_pointer p, f;
+    json_value e;
+    size_t i;
     int ret;
-    
-    assert(v != NULL);
-    assert(json != NULL);
-    c.stack = malloc(c.size = JSON_PARSE_STRINGIFY_INIT_SIZE);
-    c.top = 0;
-    if ((ret = json_stringify_value(&c, v)) != JSON_STRINGIFY_OK) {
-        free(c.stack);
-        *json = NULL;
+
+    if (op->type != JSON_OBJECT
+            || (name = json_find_object_value(op, "op", 2)) == NULL || name->type != JSON_STRING
+            || (path = json_find_object_value(op, "path", 4)) == NULL || path->type != JSON_STRING)
+        return JSON_PATCH_INVALID;
+    value = json_find_object_value(op, "value", 5);
+    from = json_find_object_value(op, "from", 4);
+    if ((ret = json_pointer_compile(&p, path->json_s, path->json_len)) != JSON_PARSE_OK)
         return ret;
+    f.s = NULL;
+    f.size = 0;
+    if (JSON_PATCH_IS(name, "move") || JSON_PATCH_IS(name, "copy")) {
+        if (from == NULL || from->type != JSON_STRING)
+            ret = JSON_PATCH_INVALID;
+        else
+            ret = json_pointer_compile(&f, from->json_s, from->json_len);
+    } else if (!JSON_PATCH_IS(name, "remove") && value == NULL)
+        ret = JSON_PATCH_INVALID;
+    if (ret != JSON_PARSE_OK)
+        goto out;
+
+    if (JSON_PATCH_IS(name, "add") || JSON_PATCH_IS(name, "replace")) {
+        json_copy_value(&e, value, t->a);
+        if ((ret = json_patch_put(t, &p, &e, JSON_PATCH_IS(name, "add"), 0)) != JSON_PARSE_OK)
+            json_free_value(&e, t->a);
+    } else if (JSON_PATCH_IS(name, "remove")) {
+        ret = json_patch_remove(t, &p, NULL);
+    } else if (JSON_PATCH_IS(name, "test")) {
+        if ((src = json_pointer_get(&p, t->doc)) == NULL)
+            ret = JSON_POINTER_NOT_FOUND;
+        else if (!json_is_equal(src, value))
+            ret = JSON_PATCH_TEST_FAILED;
+    } else if (JSON_PATCH_IS(name, "copy")) {
+        if ((src = json_pointer_get(&f, t->doc)) == NULL)
+            ret = JSON_POINTER_NOT_FOUND;
+        else {
+            json_copy_value(&e, src, t->a);
+            if ((ret = json_patch_put(t, &p, &e, 1, 0)) != JSON_PARSE_OK)
+                json_free_value(&e, t->a);
+        }
+    } else if (JSON_PATCH_IS(name, "move")) {
+        /* A location cannot be moved into one of its own children. */
+        for (i = 0; i < f.size && i < p.size; ++i)
+            if (f.s[i].klen != p.s[i].klen || memcmp(f.s[i].k, p.s[i].k, f.s[i].klen) != 0)
+                break;
+        if (i == f.size && i < p.size)
+            ret = JSON_PATCH_INVALID;
+        else if (i == f.size && i == p.size)
+            ret = json_pointer_get(&f, t->doc) != NULL ? JSON_PARSE_OK : JSON_POINTER_NOT_FOUND;
+        else if ((ret = json_patch_remove(t, &f, &e)) == JSON_PARSE_OK
+                && (ret = json_patch_put(t, &p, &e, 1, 1)) != JSON_PARSE_OK) {
+            /* The remove now owns the value again. */
+            json_undo *u = (json_undo *) (t->undo.stack + t->undo.top) - 1;
+            u->moved = 0;
+            u->saved.v = e;
+        }
+    } else
+        ret = JSON_PATCH_INVALID;
+out:
+    json_pointer_free(&p);
+    json_pointer_free(&f);
+    return ret;
+}
+
+int json_patch(json_value *doc, const json_value *patch)
+{
+    json_patcher t;
+    json_undo *u;
+    size_t i;
+    int ret = JSON_PARSE_OK;
+
+    assert(doc != NULL && patch != NULL && doc != patch);
+    if (patch->type != JSON_ARRAY)
+        return JSON_PATCH_INVALID;
+    t.doc = doc;
+    t.a = json_get_allocator();
+    json_context_init(&t.undo, NULL, NULL, t.a);
+    json_context_init(&t.path, NULL, NULL, t.a);
+    for (i = 0; i < patch->json_size && ret == JSON_PARSE_OK; ++i)
+        ret = json_patch_apply(&t, &patch->json_e[i]);
+    if (ret != JSON_PARSE_OK)
+        json_patch_rollback(&t);
+    /* Whatever is still logged was displaced for good. */
+    while (t.undo.top > 0) {
+        u = (json_undo *) json_context_pop(&t.undo, sizeof(json_undo));
+        JSON_FREE(t.a, u->saved.k);
+        json_free_value(&u->saved.v, t.a);
     }
-    if (length)
-        *length = c.top;
-    PUTC(&c, '\0');
-    *json = c.stack;
-    return JSON_STRINGIFY_OK;
+    JSON_FREE(t.a, t.undo.stack);
+    JSON_FREE(t.a, t.path.stack);
+    return ret;
 }
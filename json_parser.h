@@ -7,6 +7,21 @@
 #include <math.h>
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
+
+/*
+ * Threading model:
+ * - A finished tree may be read by any number of threads at once through
+ *   the const functions (getters, lookups, pointers, stringify, encoders,
+ *   views) without locks. Writers need exclusive access to what they change.
+ * - JSON_SHARED nodes are never written; they may be copied and freed from
+ *   any thread. The lookup index of a shared object is built lazily by the
+ *   first reader and published atomically.
+ * - Parsing keeps its state in a per-call context, or in a json_parser that
+ *   belongs to one thread. Parsing leaves errno as it was.
+ * - json_parser and json_pool objects are single-threaded. Statistics are
+ *   per thread, and the process-wide allocator is read atomically.
+ */
 
 typedef enum {
     JSON_NULL,
@@ -44,11 +59,17 @@ struct json_value {
 #define json_m   u.o.m
 #define json_osz   u.o.objsize
     json_type type;
+    unsigned flags;
 };
 
+/* The string or vector lives in a refcounted block shared between trees;
+ * the node and everything below it are immutable. Other flag bits are internal. */
+#define JSON_SHARED 1
+
 struct json_member {
     char *k;
     size_t klen;
+    unsigned khash;
     json_value v;
 };
 
@@ -72,10 +93,113 @@ enum {
     JSON_STRINGIFY_OBJECT_NULL,
     JSON_STRINGIFY_ARRAY_NULL,
     JSON_STRINGIFY_OBJECT_MEMBER_NULL,
+    JSON_POINTER_INVALID,
+    JSON_POINTER_NOT_FOUND,
+    JSON_STRINGIFY_WRITE_ERROR,
+    JSON_BINARY_INVALID,
+    JSON_BINARY_TOO_LARGE,
+    JSON_BINARY_UNSUPPORTED,
+    JSON_PATCH_INVALID,
+    JSON_PATCH_TEST_FAILED,
+    JSON_SCHEMA_INVALID,
+    JSON_DECODE_TYPE_MISMATCH,
+    JSON_PARSE_CAPACITY_EXCEEDED,
+    JSON_STRINGIFY_NUMBER_INVALID,
+    JSON_QUERY_INVALID,
+    JSON_PARSE_INVALID_UTF8,
+    JSON_PARSE_TOO_DEEP,
+    JSON_PARSE_NUMBER_NOT_INTEGER,
+};
+
+#define JSON_KEY_NOT_EXIST   ((size_t) -1)
+#define JSON_POINTER_APPEND  ((size_t) -2)   /* the "-" array index */
+
+/* A JSON Pointer (RFC 6901) split into its reference tokens. */
+typedef struct {
+    char *k;            /* unescaped token */
+    size_t klen;
+    unsigned khash;
+    size_t index;       /* array index, JSON_POINTER_APPEND or JSON_KEY_NOT_EXIST */
+} json_pointer_segment;
+
+typedef struct {
+    json_pointer_segment *s;
+    size_t size;
+} json_pointer;
+
+/*
+ * Every allocation the library makes goes through a json_allocator: the
+ * calling thread's override if set, else the process-wide one, else libc.
+ * Memory returned to the caller (e.g. by json_stringify) comes from it too.
+ * Allocators used with the *_parallel functions must be thread-safe.
+ */
+typedef struct {
+    void *(*malloc)(void *ud, size_t size);
+    void *(*realloc)(void *ud, void *ptr, size_t size);
+    void (*free)(void *ud, void *ptr);
+    void *ud;
+} json_allocator;
+
+/* NULL restores malloc/realloc/free; set it before any other call. */
+void json_set_allocator(const json_allocator *a);
+/* Returns the previous override; NULL falls back to the process-wide one. */
+const json_allocator *json_set_thread_allocator(const json_allocator *a);
+const json_allocator *json_get_allocator(void);
+
+/*
+ * Size-class pool sized for json_value and json_member vectors, keys and
+ * short strings. Not thread-safe: use one per thread or per request.
+ * Destroying the pool releases everything allocated from it at once.
+ */
+typedef struct json_pool json_pool;
+json_pool *json_pool_create(void);
+void json_pool_destroy(json_pool *p);
+void json_pool_allocator(json_pool *p, json_allocator *a);
+
+/* Filled in only when the library is built with -DJSON_ENABLE_STATS. */
+enum {
+    JSON_PHASE_PARSE,       /* json_parse */
+    JSON_PHASE_STRING,      /* string and key decoding */
+    JSON_PHASE_NUMBER,      /* strtod */
+    JSON_PHASE_FREE,        /* json_free */
+    JSON_PHASE_STRINGIFY,   /* json_stringify */
+    JSON_PHASE_COUNT
 };
 
-#define json_init(v) do { (v)->type = JSON_NULL; } while (0)
+typedef struct {
+    size_t allocs, reallocs, frees, alloc_bytes;
+    size_t stack_grows;     /* scratch stack reallocs */
+    size_t max_depth;
+    size_t nodes[JSON_OBJECT + 1];  /* parsed values by json_type */
+    unsigned long long cycles[JSON_PHASE_COUNT];
+} json_stats;
+
+/* Counters of the calling thread. */
+void json_stats_get(json_stats *s);
+void json_stats_reset(void);
+
+#define json_init(v) do { (v)->type = JSON_NULL; (v)->flags = 0; } while (0)
 void json_free(json_value *v);
+/*
+ * Detach v (leaving it null) and free it on a background reclaimer thread.
+ * The current allocator must be thread-safe; json_pool is not.
+ */
+void json_free_deferred(json_value *v);
+/* Block until every tree passed to json_free_deferred has been freed. */
+void json_free_wait(void);
+
+/*
+ * Copy-on-write sharing. json_share freezes v so that json_copy of it (or
+ * of any node below it) takes O(1) and shares the storage. Refcounts are
+ * atomic, so shared trees may be read, copied and freed from any thread
+ * as long as they all use one thread-safe allocator. Before changing the
+ * children of a shared node, call json_unshare on it (or use
+ * json_pointer_cow); it copies that one level and keeps sharing the rest.
+ */
+void json_share(json_value *v);
+/* dst must be initialized; private subtrees of src are deep-copied. */
+void json_copy(json_value *dst, const json_value *src);
+void json_unshare(json_value *v);
 #define json_set_null(v) json_free(v)
 
 int json_get_boolean(const json_value *v);
@@ -89,6 +213,92 @@ void json_set_string(json_value *v, const char *s, size_t len);
 size_t json_get_string_length(const json_value *v);
 
 int json_parse(json_value *v, const char *json);
+
+/*
+ * Where json_parse_ex failed. line and column are 1-based and count bytes.
+ * excerpt is the failing line (a window of it if long) with control bytes
+ * blanked, and excerpt_column is the error's 0-based position in it. Only
+ * code is set when the parse succeeds.
+ */
+#define JSON_ERROR_EXCERPT_SIZE 48
+
+typedef struct {
+    int code;
+    size_t offset;
+    size_t line, column;
+    char excerpt[JSON_ERROR_EXCERPT_SIZE];
+    size_t excerpt_column;
+} json_error;
+
+int json_parse_ex(json_value *v, const char *json, json_error *e);
+
+/*
+ * Parse options. Every combination is compiled into its own parser, so
+ * an option costs nothing in the parsers that do not have it. With none
+ * json_parse_opts is json_parse_ex.
+ */
+#define JSON_PARSE_VALIDATE_UTF8    1   /* strings are well-formed UTF-8, no lone surrogate escapes */
+#define JSON_PARSE_DEPTH_LIMIT      2   /* at most JSON_PARSE_MAX_DEPTH (512) nested arrays and objects */
+#define JSON_PARSE_INTEGERS         4   /* no fraction or exponent; read without strtod */
+#define JSON_PARSE_OPTIONS          8   /* flags are below this */
+
+int json_parse_opts(json_value *v, const char *json, unsigned flags, json_error *e);
+/*
+ * Check that the len bytes at json are one JSON text, with the result
+ * json_parse would give, but build nothing: no allocation, unescaping or
+ * number conversion. json need not be NUL-terminated; a NUL inside it is
+ * an error.
+ */
+int json_validate(const char *json, size_t len);
+
+/*
+ * Parse into caller buffers with no heap allocation. nodes (aligned like a
+ * pointer) holds the array and object vectors and the scratch stack;
+ * strings holds the strings and keys. The tree points into them, so drop
+ * or reuse the buffers instead of calling json_free. If they are too small
+ * for a valid text, nothing is parsed, JSON_PARSE_CAPACITY_EXCEEDED is
+ * returned and the *_needed sizes are set; buffers of the sizes below
+ * always suffice and skip the measuring pass.
+ */
+typedef struct {
+    void *nodes;
+    size_t nodes_size, nodes_needed;
+    char *strings;
+    size_t strings_size, strings_needed;
+} json_buffers;
+
+/*
+ * Worst case for n bytes of text. A value takes a byte and an element or
+ * member also the ',', ']' or '}' after it, plus '""' and ':' for a key,
+ * so there are at most n / 2 + 1 values; decoded strings never outgrow
+ * their text.
+ */
+#define JSON_MAX_VALUES(n)  ((size_t) (n) / 2 + 1)
+#define JSON_NODE_BYTES_PER_CHAR \
+    ((sizeof(json_value) + 1) / 2 > (sizeof(json_member) + 4) / 5 ? \
+        (sizeof(json_value) + 1) / 2 : (sizeof(json_member) + 4) / 5)
+#define JSON_FIXED_NODES_SIZE(n)    ((2 * JSON_NODE_BYTES_PER_CHAR + 1) * (size_t) (n) + 8)
+#define JSON_FIXED_STRINGS_SIZE(n)  ((size_t) (n))
+
+int json_parse_fixed(json_value *v, const char *json, json_buffers *b);
+
+/*
+ * Keeps the scratch stack of json_parse between calls. Not thread-safe;
+ * keep one per thread. After a parse, a stack that grew past shrink_size
+ * is cut back to it (0 releases it every time).
+ */
+typedef struct {
+    char *stack;
+    size_t size;
+    size_t shrink_size;
+    const json_allocator *a;
+} json_parser;
+
+void json_parser_init(json_parser *p);
+void json_parser_free(json_parser *p);
+int json_parser_parse(json_parser *p, json_value *v, const char *json);
+/* Parse a large top-level array on nthreads threads; same result as json_parse. */
+int json_parse_parallel(json_value *v, const char *json, unsigned nthreads);
 json_type json_get_type(const json_value *v);
 
 json_value *json_get_array_element(const json_value *v, size_t index);
@@ -98,7 +308,187 @@ size_t json_get_object_size(const json_value *v);
 const char *json_get_object_key(const json_value *v, size_t index);
 size_t json_get_object_key_length(const json_value *v, size_t index);
 json_value *json_get_object_value(const json_value *v, size_t index);
+size_t json_find_object_index(const json_value *v, const char *key, size_t klen);
+json_value *json_find_object_value(const json_value *v, const char *key, size_t klen);
+/* Objects are equal when their members pair up one to one, in any order. */
+int json_is_equal(const json_value *lhs, const json_value *rhs);
+
+/* A set of pointers merged into a trie; n[0] is the document root. */
+typedef struct {
+    char *k;
+    size_t klen;
+    size_t index;
+    size_t child, next; /* first child and next sibling, 0 if none */
+    int leaf;           /* keep the whole subtree */
+} json_projection_node;
+
+typedef struct {
+    json_projection_node *n;
+    size_t size, capacity;
+} json_projection;
+
+int json_pointer_compile(json_pointer *p, const char *ptr, size_t len);
+void json_pointer_free(json_pointer *p);
+json_value *json_pointer_get(const json_pointer *p, const json_value *v);
+/* Like json_pointer_get, but first unshares every node above the target. */
+json_value *json_pointer_cow(const json_pointer *p, json_value *v);
+/*
+ * Patches edit doc in place, touching only the containers on their paths
+ * (shared ones are unshared first). json_patch (RFC 6902) applies every
+ * operation or, if one fails, none: the document is restored exactly, with
+ * the nodes it unshared shared again, and the failing operation's error
+ * returned. A merge patch (RFC 7386) cannot fail.
+ */
+int json_merge_patch(json_value *target, const json_value *patch);
+int json_patch(json_value *doc, const json_value *patch);
+/* Parse only the value addressed by p, skipping every other subtree.
+ * Parsing stops once the value is found; the rest of the text is not checked. */
+int json_parse_pointer(json_value *v, const char *json, const json_pointer *p);
+
+void json_projection_init(json_projection *p);
+int json_projection_add(json_projection *p, const char *ptr, size_t len);
+void json_projection_free(json_projection *p);
+/* Parse only the members and elements on a projected path. Skipped array
+ * elements before a kept one become null; the whole text is validated. */
+int json_parse_projection(json_value *v, const char *json, const json_projection *p);
+
+/*
+ * A JSONPath-like query, compiled once and run on trees or on text:
+ *   $                          the document
+ *   .name  ['name']  ["name"]  a member ("name" takes JSON escapes)
+ *   [n]                        an array element
+ *   .*  [*]                    every element or member value
+ *   [?expr]  [?(expr)]         the elements or member values expr accepts
+ * In expr, @ is the candidate and @.name[n]... a path below it. A path
+ * alone tests that it exists; path == != < <= > >= literal compares it
+ * with a JSON literal, and !, &&, || and parentheses combine tests. Order
+ * comparisons hold between two numbers or two strings (bytewise) only,
+ * and a missing path fails all comparisons but !=.
+ */
+typedef struct json_query_step json_query_step;
+typedef struct json_query_term json_query_term;
+
+typedef struct {
+    json_query_step *steps;
+    size_t size;
+    json_query_term *terms;
+    size_t nterms;
+} json_query;
+
+int json_query_compile(json_query *q, const char *query, size_t len);
+void json_query_free(json_query *q);
+/* Store up to cap matches in document order; returns how many there are. */
+size_t json_query_select(const json_query *q, const json_value *v, json_value **out, size_t cap);
+/* Parse the matches into an array, building nothing else; the whole text is validated. */
+int json_parse_query(json_value *v, const char *json, const json_query *q);
+
+/*
+ * Decode straight from text into C structs described by field tables,
+ * without building a tree. Members with no field are skipped (but still
+ * validated) and null leaves a field as it is; any other value of the
+ * wrong type is JSON_DECODE_TYPE_MISMATCH. Strings and array storage come
+ * from the current allocator; release them with json_free_struct.
+ */
+typedef enum {
+    JSON_FIELD_BOOL,    /* int */
+    JSON_FIELD_INT,     /* int; the number must be integral and in range */
+    JSON_FIELD_INT64,   /* long long, likewise */
+    JSON_FIELD_DOUBLE,  /* double */
+    JSON_FIELD_STRING,  /* char *, NUL-terminated */
+    JSON_FIELD_OBJECT,  /* struct described by schema, embedded at offset */
+    JSON_FIELD_ARRAY    /* json_field_array of item */
+} json_field_type;
+
+typedef struct json_schema json_schema;
+
+typedef struct {
+    const char *name;
+    size_t offset;
+    json_field_type type;
+    json_field_type item;       /* element type of an array, not an array itself */
+    const json_schema *schema;  /* for objects and arrays of them */
+} json_field;
+
+typedef struct {
+    void *e;
+    size_t size;
+} json_field_array;
+
+typedef struct {
+    unsigned khash;
+    size_t klen;
+    size_t field;       /* index + 1, 0 for an empty slot */
+} json_schema_slot;
+
+/* fields must outlive the schema, and nested schemas must outlive it too. */
+struct json_schema {
+    const json_field *fields;
+    size_t count;
+    size_t size;                /* of the struct */
+    json_schema_slot *slots;    /* open addressing on key hashes */
+    size_t mask;
+    char *keys;                 /* escaped "name": of each field, after a ',' but the first */
+    size_t *kpos;               /* field i's is keys[kpos[i]..kpos[i + 1]) */
+};
+
+int json_schema_compile(json_schema *s, const json_field *fields, size_t count, size_t size);
+void json_schema_free(json_schema *s);
+/* out is zeroed first, and again if decoding fails. */
+int json_decode_struct(void *out, const char *json, const json_schema *s);
+void json_free_struct(void *out, const json_schema *s);
+/* Write every field in table order; a NULL string is written as null. A NaN
+ * or infinite double fails with JSON_STRINGIFY_NUMBER_INVALID. */
+int json_encode_struct(const void *in, const json_schema *s, char **json, size_t *length);
 
 int json_stringify(const json_value* v, char** json, size_t* length);
+/* Compiled per option set like json_parse_opts. UTF8 leaves non-ASCII and '/' unescaped. */
+#define JSON_STRINGIFY_UTF8         1
+#define JSON_STRINGIFY_OPTIONS      2
+int json_stringify_opts(const json_value* v, char** json, size_t* length, unsigned flags);
+/* Serialize the children of a large root on nthreads threads; same bytes as json_stringify. */
+int json_stringify_parallel(const json_value* v, char** json, size_t* length, unsigned nthreads);
+int json_stringify_parallel_fd(const json_value* v, int fd, unsigned nthreads);
+/*
+ * Canonical form (RFC 8785): members sorted by key in UTF-16 order, no
+ * whitespace, ECMAScript number formatting and minimal string escapes.
+ * Equal trees give equal bytes, ready for hashing or signing. Duplicate
+ * keys keep their order. NaN and infinities fail with
+ * JSON_STRINGIFY_NUMBER_INVALID.
+ */
+int json_stringify_canonical(const json_value* v, char** json, size_t* length);
+
+/*
+ * Compact binary form for caches: native doubles, length-prefixed strings
+ * and offset tables. Blobs are in host byte order and limited to 4GB.
+ * Decoding fails with JSON_BINARY_INVALID past 512 nested containers.
+ */
+int json_encode_binary(const json_value *v, char **bin, size_t *length);
+int json_decode_binary(json_value *v, const char *bin, size_t length);
+
+/* Read a binary blob in place (e.g. mmap'd) without decoding it. */
+typedef struct {
+    const char *bin;
+    size_t length;
+    size_t off;         /* of the node this view is on */
+} json_view;
+
+int json_view_init(json_view *r, const char *bin, size_t length);
+json_type json_view_get_type(const json_view *r);
+double json_view_get_number(const json_view *r);
+const char *json_view_get_string(const json_view *r, size_t *len);
+size_t json_view_get_size(const json_view *r);
+int json_view_get_array_element(const json_view *r, size_t index, json_view *e);
+int json_view_get_object_member(const json_view *r, size_t index, json_view *k, json_view *e);
+int json_view_find_object_value(const json_view *r, const char *key, size_t klen, json_view *e);
+
+/*
+ * Direct MessagePack and CBOR codecs. Map keys must be strings; binary,
+ * extension types, undefined and non-finite floats are JSON_BINARY_UNSUPPORTED.
+ * Decoding fails with JSON_BINARY_INVALID past 512 nested arrays and maps.
+ */
+int json_encode_msgpack(const json_value *v, char **out, size_t *length);
+int json_decode_msgpack(json_value *v, const char *buf, size_t length);
+int json_encode_cbor(const json_value *v, char **out, size_t *length);
+int json_decode_cbor(json_value *v, const char *buf, size_t length);
 
 #endif //JSON_PARSER_H__
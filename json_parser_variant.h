@@ -0,0 +1,459 @@
+/*
+ * The recursive parser and stringifier, written once and compiled by
+ * json_parser.c for every option set. Before each #include it defines
+ * JSON_VARIANT(name), the function names of that instance, and either
+ * JSON_VARIANT_PARSE_OPTS or JSON_VARIANT_STRINGIFY_OPTS, a constant set
+ * of JSON_PARSE_* or JSON_STRINGIFY_* flags. Tests of the constant fold
+ * away, so each instance has only the branches its options need; the
+ * instance with no options is the plain json_parse and json_stringify.
+ * Not a public header, and without an include guard on purpose.
+ */
+
+#ifdef JSON_VARIANT_PARSE_OPTS
+
+static int JSON_VARIANT(json_parse_number)(json_context *c, json_value *v)
+{
+    char *p, *end;
+    p = (char *) c->json;
+
+    /* validate number */
+    if (*p == '-')
+        ++p;
+    if (*p == '0')
+        ++p;
+    else {
+        if (!ISDIGIT1TO9(*p))
+            return JSON_PARSE_INVALID_VALUE;
+        for (++p; ISDIGIT(*p); ++p)
+            ;
+    }
+    if ((JSON_VARIANT_PARSE_OPTS & JSON_PARSE_INTEGERS) && (*p == '.' || *p == 'e' || *p == 'E'))
+        return JSON_PARSE_NUMBER_NOT_INTEGER;
+    if (*p == '.') {
+        ++p;
+        if (!ISDIGIT(*p))
+            return JSON_PARSE_INVALID_VALUE;
+        for (++p; ISDIGIT(*p); ++p)
+            ;
+    }
+    if (*p == 'e' || *p == 'E') {
+        ++p;
+        if (*p == '-' || *p == '+')
+            ++p;
+        if (!ISDIGIT(*p))
+            return JSON_PARSE_INVALID_VALUE;
+        for (++p; ISDIGIT(*p); ++p)
+            ;
+    }
+
+    STAT_TIMER(t);
+    /* Below 10^19 the digits fit in 64 bits and the cast rounds once, as strtod does. */
+    if ((JSON_VARIANT_PARSE_OPTS & JSON_PARSE_INTEGERS) && p - c->json <= 19 + (*c->json == '-')) {
+        const char *q = c->json + (*c->json == '-');
+        uint64_t u = 0;
+
+        for ( ; q < p; ++q)
+            u = u * 10 + (*q - '0');
+        v->json_n = *c->json == '-' ? -(double) u : (double) u;
+        STAT_PHASE(JSON_PHASE_NUMBER, t);
+        c->json = p;
+        v->type = JSON_NUMBER;
+        return JSON_PARSE_OK;
+    }
+    /* The text is a validated number, so only overflow yields infinity
+     * and the result is tested instead of errno, which json_strtod keeps.
+     * After a "0" token strtod may read on ("06e999"), but the caller
+     * rejects what follows the token anyway. */
+    v->json_n = json_strtod(c->json, &end);
+    STAT_PHASE(JSON_PHASE_NUMBER, t);
+    if (isinf(v->json_n) && end == p)
+        return JSON_PARSE_NUMBER_TOO_BIG;
+    c->json = p;
+    v->type = JSON_NUMBER;
+    return JSON_PARSE_OK;
+}
+
+static int JSON_VARIANT(json_parse_string_raw)(json_context *c, char **str, size_t *len)
+{
+    size_t head;
+    unsigned u, low = 0;  /* low surrogate */
+    const char *p, *esc;  /* esc: the backslash of a \u escape */
+
+    EXPECT(c, '\"');
+    head = c->top;
+    p = c->json;
+    for ( ; ; ) {
+        char ch = *p++;
+        switch (ch) {
+        case '\"':
+            *len = c->top - head;
+            *str = (char *) JSON_MALLOC(c->sa, *len + 1);
+            /* An empty string may not have touched the stack yet. */
+            if (*len > 0)
+                memcpy(*str, (const char *) json_context_pop(c, *len), *len);
+            (*str)[*len] = 0;
+            c->json = p;
+            return JSON_PARSE_OK;
+        case '\\':
+            switch (*p++) {
+            case '\\': PUTC(c, '\\'); break;
+            case '/':  PUTC(c, '/' ); break;
+            case '"': PUTC(c, '"'); break;
+            case 't':  PUTC(c, '\t'); break;
+            case 'b':  PUTC(c, '\b'); break;
+            case 'f':  PUTC(c, '\f'); break;
+            case 'n':  PUTC(c, '\n'); break;
+            case 'r':  PUTC(c, '\r'); break;
+            case 'u':  /* UTF-8 */
+                esc = p - 2;
+                if (!(p = json_parse_hex4(p, &u)))
+                    STRING_ERROR(JSON_PARSE_INVALID_UNICODE_HEX, esc);
+                if (u >= 0xd800 && u <= 0xdbff) { /* high surrogate */
+                    if (p[0] != '\\' || p[1] != 'u')
+                        STRING_ERROR(JSON_PARSE_INVALID_UNICODE_SURROGATE, esc);
+                    if (!(p = json_parse_hex4(p + 2, &low)))
+                        STRING_ERROR(JSON_PARSE_INVALID_UNICODE_HEX, esc + 6);
+                    if (low > 0xdfff || low < 0xdc00)
+                        STRING_ERROR(JSON_PARSE_INVALID_UNICODE_SURROGATE, esc + 6);
+                    u = 0x10000 + (u - 0xD800) * 0x400 + (low - 0xDC00);
+                } else if ((JSON_VARIANT_PARSE_OPTS & JSON_PARSE_VALIDATE_UTF8) && u >= 0xdc00 && u <= 0xdfff)
+                    STRING_ERROR(JSON_PARSE_INVALID_UNICODE_SURROGATE, esc);
+                json_encode_utf8(c, u);
+                break;
+            default:
+                c->top = head;
+                c->json = p - 2;
+                return JSON_PARSE_INVALID_STRING_ESCAPE;
+            }
+            break;
+        case '\0':
+            c->top = head;
+            c->json = p - 1;
+            return JSON_PARSE_MISS_QUOTATION_MARK;
+        default:
+            if (ch >= '\x00' && ch <= '\x1F') {
+                c->top = head;
+                c->json = p - 1;
+                return JSON_PARSE_INVALID_STRING_CHAR;
+            }
+            if ((JSON_VARIANT_PARSE_OPTS & JSON_PARSE_VALIDATE_UTF8) && (u_char) ch >= 0x80) {
+                size_t n = json_utf8_length((const u_char *) p - 1);
+                if (n == 0) {
+                    c->top = head;
+                    c->json = p - 1;
+                    return JSON_PARSE_INVALID_UTF8;
+                }
+                PUTS(c, p - 1, n);
+                p += n - 1;
+                break;
+            }
+            PUTC(c, ch);
+        }
+    }
+}
+
+static int JSON_VARIANT(json_parse_string)(json_context *c, json_value *v)
+{
+    int ret;
+    char *s;
+    size_t len;
+    STAT_TIMER(t);
+
+    ret = JSON_VARIANT(json_parse_string_raw)(c, &s, &len);
+    STAT_PHASE(JSON_PHASE_STRING, t);
+    if (ret == JSON_PARSE_OK) {
+        v->json_s = s;
+        v->json_len = len;
+        v->type = JSON_STRING;
+    }
+    return ret;
+}
+
+static int JSON_VARIANT(json_parse_value)(json_context *c, json_value *v);
+
+static int JSON_VARIANT(json_parse_array)(json_context *c, json_value *v)
+{
+    size_t size;
+    int ret;
+
+    if ((JSON_VARIANT_PARSE_OPTS & JSON_PARSE_DEPTH_LIMIT) && c->nest > JSON_PARSE_MAX_DEPTH)
+        return JSON_PARSE_TOO_DEEP;
+    EXPECT(c, '[');
+    size = 0;
+    for ( ; ; ) {
+        json_parse_whitespace(c);
+        if (*c->json == ']') {
+            c->json++;
+            v->type = JSON_ARRAY;
+            v->json_size = size;
+            size *= sizeof(json_value);
+            if (size > 0)
+                memcpy(v->json_e = (json_value *) JSON_MALLOC(c->a, size), json_context_pop(c, size), size);
+            else
+                v->json_e = NULL;
+            return JSON_PARSE_OK;
+        } else {
+            json_value e;
+            json_init(&e);
+            if ((ret = JSON_VARIANT(json_parse_value)(c, &e)) != JSON_PARSE_OK) {
+                goto free;
+            }
+            memcpy(json_context_push(c, sizeof(json_value)), &e, sizeof(json_value));
+            ++size;
+            json_parse_whitespace(c);
+            if (*c->json == ']') {
+                continue;
+            } else if (*c->json == ',') {
+                c->json++;
+                if (*c->json == ']') {
+                    ret = JSON_PARSE_INVALID_VALUE;
+                    goto free;
+                }
+            } else {
+                ret = JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+                goto free;
+            }
+        }
+    }
+free:
+    for ( ; size > 0; --size)
+        json_free_value(json_context_pop(c, sizeof(json_value)), c->a);
+    return ret;
+}
+
+static int JSON_VARIANT(json_parse_object)(json_context *c, json_value *v)
+{
+    size_t size;
+    int ret;
+    char *s;
+    size_t len;
+    json_member m;
+
+    if ((JSON_VARIANT_PARSE_OPTS & JSON_PARSE_DEPTH_LIMIT) && c->nest > JSON_PARSE_MAX_DEPTH)
+        return JSON_PARSE_TOO_DEEP;
+    EXPECT(c, '{');
+    json_parse_whitespace(c);
+    if (*c->json == '}') {
+        c->json++;
+        v->type = JSON_OBJECT;
+        v->json_m = NULL;
+        v->json_osz = 0;
+        return JSON_PARSE_OK;
+    }
+    m.k = NULL;
+    size = 0;
+    for ( ; ; ) {
+        json_parse_whitespace(c);
+        if (*c->json != '\"') {
+            ret = JSON_PARSE_MISS_KEY;
+            goto free;
+        }
+        {
+            STAT_TIMER(t);
+            ret = JSON_VARIANT(json_parse_string_raw)(c, &s, &len);
+            STAT_PHASE(JSON_PHASE_STRING, t);
+        }
+        if (ret != JSON_PARSE_OK)
+            goto free;
+        m.k = s;
+        m.klen = len;
+        m.khash = json_hash_key(s, len);
+        json_parse_whitespace(c);
+        if (*c->json != ':') {
+            ret = JSON_PARSE_MISS_COLON;
+            goto miss_colon;
+        } else {
+            c->json++;
+        }
+        json_parse_whitespace(c);
+        json_init(&m.v);
+        if ((ret = JSON_VARIANT(json_parse_value)(c, &m.v)) != JSON_PARSE_OK)
+            goto miss_colon;
+        memcpy(json_context_push(c, sizeof(json_member)), &m, sizeof(json_member));
+        ++size;
+        json_parse_whitespace(c);
+        if (*c->json == '}') {
+            c->json++;
+            v->type = JSON_OBJECT;
+            v->json_osz = size;
+            size *= sizeof(json_member);
+            memcpy(v->json_m = (json_member *) JSON_MALLOC(c->a, size), json_context_pop(c, size), size);
+            return JSON_PARSE_OK;
+        } else if (*c->json == ',') {
+            c->json++;
+            continue;
+        } else {
+            ret = JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+            goto free;
+        }
+        m.k = NULL;
+    }
+miss_colon:
+    JSON_FREE(c->a, m.k);
+free:
+    for ( ; size > 0; --size)
+        json_free_object_member(json_context_pop(c, sizeof(json_member)), c->a);
+    return ret;
+}
+
+/* value = null / false / true / number / array / object */
+static int JSON_VARIANT(json_parse_value)(json_context *c, json_value *v)
+{
+    int ret;
+
+    STAT_ENTER(c);
+    /* Counts the values on the path to this one, checked by arrays and objects. */
+    if (JSON_VARIANT_PARSE_OPTS & JSON_PARSE_DEPTH_LIMIT)
+        c->nest++;
+    switch (*c->json) {
+    case 'n':  ret = json_parse_literal(c, v, "null", JSON_NULL); break;
+    case 't':  ret = json_parse_literal(c, v, "true", JSON_TRUE); break;
+    case 'f':  ret = json_parse_literal(c, v, "false", JSON_FALSE); break;
+    case '\"': ret = JSON_VARIANT(json_parse_string)(c, v); break;
+    case '[':  ret = JSON_VARIANT(json_parse_array)(c, v); break;
+    case '{':  ret = JSON_VARIANT(json_parse_object)(c, v); break;
+    case '\0': ret = JSON_PARSE_EXPECT_VALUE; break;
+    default:   ret = JSON_VARIANT(json_parse_number)(c, v); break;
+    }
+    STAT_LEAVE(c, v, ret);
+    if (JSON_VARIANT_PARSE_OPTS & JSON_PARSE_DEPTH_LIMIT)
+        c->nest--;
+    return ret;
+}
+
+static int JSON_VARIANT(json_parse_root)(json_context *c, json_value *v)
+{
+    int ret;
+
+    json_init(v);
+    json_parse_whitespace(c);
+    if ((ret = JSON_VARIANT(json_parse_value)(c, v)) == JSON_PARSE_OK) {
+        json_parse_whitespace(c);
+        if (c->json[0] != '\0') {
+            json_free_value(v, c->a);
+            ret = JSON_PARSE_ROOT_NOT_SINGULAR;
+        }
+    }
+    assert(c->top == 0);
+    return ret;
+}
+
+#endif /* JSON_VARIANT_PARSE_OPTS */
+
+#ifdef JSON_VARIANT_STRINGIFY_OPTS
+
+static void JSON_VARIANT(json_stringify_string)(json_context* c, const char* s, size_t len)
+{
+    static const char hex_digits[] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
+    size_t size;
+    u_char* p;
+    u_char* head;
+
+    assert(s != NULL || len == 0);
+    size = len * 6 + 2;
+    p = head = json_context_push(c, size);
+    *p++ = '"';
+    for (size_t i = 0; i < len; ++i) {
+        u_char ch = (u_char) s[i];
+        switch (ch) {
+        case '\\': *p++ = '\\'; *p++ = '\\'; break;
+        case '"':  *p++ = '\\'; *p++ = '"'; break;
+        case '/':
+            if (!(JSON_VARIANT_STRINGIFY_OPTS & JSON_STRINGIFY_UTF8))
+                *p++ = '\\';
+            *p++ = '/';
+            break;
+        case '\t': *p++ = '\\'; *p++ = 't'; break;
+        case '\b': *p++ = '\\'; *p++ = 'b'; break;
+        case '\n': *p++ = '\\'; *p++ = 'n'; break;
+        case '\r': *p++ = '\\'; *p++ = 'r'; break;
+        case '\f': *p++ = '\\'; *p++ = 'f'; break;
+        default:
+            if (ch < 0x20) {
+                *p++ = '\\'; *p++ = 'u'; *p++ = '0'; *p++ = '0';
+                *p++ = hex_digits[ch >> 4];
+                *p++ = hex_digits[ch & 15];
+            } else if (ch > 0x7f && !(JSON_VARIANT_STRINGIFY_OPTS & JSON_STRINGIFY_UTF8)) { /* Handle UTF-8. */
+                unsigned u = json_decode_utf8((const u_char*) s, len, &i);
+                if (u == JSON_UTF8_INVALID)
+                    *p++ = s[i];
+                else if (u <= 0xffff) {
+                    *p++ = '\\'; *p++ = 'u';
+                    *p++ = hex_digits[u >> 12];
+                    *p++ = hex_digits[(u >> 8) & 15];
+                    *p++ = hex_digits[(u >> 4) & 15];
+                    *p++ = hex_digits[u & 15];
+                } else { /* Transfer codepoint to surrogate pair. */
+                    unsigned h, l;
+                    u -= 0x10000;
+                    h = (u - (l = u % 0x400)) / 0x400;
+                    h += 0xd800, l += 0xdc00;
+                    *p++ = '\\'; *p++ = 'u';
+                    *p++ = hex_digits[h >> 12];
+                    *p++ = hex_digits[(h >> 8) & 15];
+                    *p++ = hex_digits[(h >> 4) & 15];
+                    *p++ = hex_digits[h & 15];
+                    *p++ = '\\'; *p++ = 'u';
+                    *p++ = hex_digits[l >> 12];
+                    *p++ = hex_digits[(l >> 8) & 15];
+                    *p++ = hex_digits[(l >> 4) & 15];
+                    *p++ = hex_digits[l & 15];
+                }
+            } else {
+                *p++ = s[i];
+            }
+            break;
+        }
+    }
+    *p++ = '"';
+    c->top -= size - (p - head);
+}
+
+static int JSON_VARIANT(json_stringify_value)(json_context* c, const json_value* v);
+static void JSON_VARIANT(json_stringify_object_member)(json_context* c, const json_member* m)
+{
+    assert(m->k != NULL);
+    JSON_VARIANT(json_stringify_string)(c, m->k, m->klen);
+    PUTC(c, ':');
+    JSON_VARIANT(json_stringify_value)(c, &m->v);
+}
+
+static int JSON_VARIANT(json_stringify_value)(json_context* c, const json_value* v)
+{
+    switch (v->type) {
+    case JSON_NULL:  PUTS(c, "null", 4); break;
+    case JSON_TRUE:  PUTS(c, "true", 4); break;
+    case JSON_FALSE: PUTS(c, "false", 5); break;
+    case JSON_NUMBER:
+        c->top -= 32 - sprintf(json_context_push(c, 32), "%.17g", v->json_n);
+        break;
+    case JSON_OBJECT:
+        PUTC(c, '{');
+        for (size_t i = 0; i < v->json_osz; ++i) {
+            JSON_VARIANT(json_stringify_object_member)(c, &v->json_m[i]);
+            PUTC(c, ',');
+        }
+        if (v->json_osz > 0)
+            json_context_pop(c, 1);   /* Delete the last ',' */
+        PUTC(c, '}');
+        break;
+    case JSON_ARRAY:
+        PUTC(c, '[');
+        for (size_t i = 0; i < v->json_size; ++i) {
+            JSON_VARIANT(json_stringify_value)(c, &v->json_e[i]);
+            PUTC(c, ',');
+        }
+        if (v->json_size)
+            json_context_pop(c, 1);  /* Delete the last ',' */
+        PUTC(c, ']');
+        break;
+    case JSON_STRING: JSON_VARIANT(json_stringify_string)(c, v->json_s, v->json_len); break;
+    }
+    return JSON_STRINGIFY_OK;
+}
+
+#endif /* JSON_VARIANT_STRINGIFY_OPTS */
+
+#undef JSON_VARIANT
+#undef JSON_VARIANT_PARSE_OPTS
+#undef JSON_VARIANT_STRINGIFY_OPTS
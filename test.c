@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <pthread.h>
 #include "json_parser.h"
 
 static int main_ret = 0;
@@ -67,6 +69,7 @@ static void test_parse_false() {
         json_value v;\
         json_init(&v);\
         EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, json));\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_validate(json, strlen(json)));\
         EXPECT_EQ_INT(JSON_NUMBER, json_get_type(&v));\
         EXPECT_EQ_DOUBLE(expect, json_get_number(&v));\
         json_free(&v);\
@@ -109,6 +112,7 @@ static void test_parse_number() {
         json_value v;\
         json_init(&v);\
         EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, json));\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_validate(json, strlen(json)));\
         EXPECT_EQ_INT(JSON_STRING, json_get_type(&v));\
         EXPECT_EQ_STRING(expect, json_get_string(&v), json_get_string_length(&v));\
         json_free(&v);\
@@ -232,6 +236,7 @@ static void test_parse_object() {
         json_init(&v);\
         v.type = JSON_FALSE;\
         EXPECT_EQ_INT(error, json_parse(&v, json));\
+        EXPECT_EQ_INT(error, json_validate(json, strlen(json)));\
         EXPECT_EQ_INT(JSON_NULL, json_get_type(&v));\
         json_free(&v);\
     } while(0)
@@ -272,6 +277,15 @@ static void test_parse_root_not_singular() {
 static void test_parse_number_too_big() {
     TEST_ERROR(JSON_PARSE_NUMBER_TOO_BIG, "1e309");
     TEST_ERROR(JSON_PARSE_NUMBER_TOO_BIG, "-1e309");
+    TEST_ERROR(JSON_PARSE_ROOT_NOT_SINGULAR, "06.9e324");
+    TEST_ERROR(JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "[-01e999]");
+
+    /* strtod's ERANGE does not leak out */
+    errno = 0;
+    TEST_ERROR(JSON_PARSE_NUMBER_TOO_BIG, "1e309");
+    TEST_ERROR(JSON_PARSE_NUMBER_TOO_BIG, "1.8e308");
+    TEST_NUMBER(0.0, "1e-400");
+    EXPECT_EQ_INT(0, errno);
 }
 
 static void test_parse_miss_quotation_mark() {
@@ -345,6 +359,56 @@ static void test_parse_miss_comma_or_curly_bracket() {
     TEST_ERROR(JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET, "{\"a\":{}");
 }
 
+#define TEST_ERROR_LOCATION(error, json, eoffset, eline, ecolumn, eexcerpt, ecaret)\
+    do {\
+        json_value v;\
+        json_error e;\
+        json_init(&v);\
+        EXPECT_EQ_INT(error, json_parse_ex(&v, json, &e));\
+        EXPECT_EQ_INT(error, e.code);\
+        EXPECT_EQ_SIZE_T(eoffset, e.offset);\
+        EXPECT_EQ_SIZE_T(eline, e.line);\
+        EXPECT_EQ_SIZE_T(ecolumn, e.column);\
+        EXPECT_EQ_STRING(eexcerpt, e.excerpt, strlen(e.excerpt));\
+        EXPECT_EQ_SIZE_T(ecaret, e.excerpt_column);\
+        json_free(&v);\
+    } while(0)
+
+static void test_parse_error_location() {
+    json_value v;
+    json_error e;
+
+    TEST_ERROR_LOCATION(JSON_PARSE_EXPECT_VALUE, "", 0, 1, 1, "", 0);
+    TEST_ERROR_LOCATION(JSON_PARSE_EXPECT_VALUE, "[1,\n 2,\n", 8, 3, 1, "", 0);
+    TEST_ERROR_LOCATION(JSON_PARSE_INVALID_VALUE, "{\"a\": nul}", 6, 1, 7, "{\"a\": nul}", 6);
+    TEST_ERROR_LOCATION(JSON_PARSE_INVALID_VALUE, "[1.]", 1, 1, 2, "[1.]", 1);
+    TEST_ERROR_LOCATION(JSON_PARSE_ROOT_NOT_SINGULAR, "{}\n\n  x", 6, 3, 3, "  x", 2);
+    TEST_ERROR_LOCATION(JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET, "{\n\t\"a\": 1\n\t\"b\": 2\n}", 11, 3, 2, " \"b\": 2", 1);
+    TEST_ERROR_LOCATION(JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "[[1]\r\n[2]]", 6, 2, 1, "[2]]", 0);
+    TEST_ERROR_LOCATION(JSON_PARSE_MISS_COLON, "{\"a\" 1}", 5, 1, 6, "{\"a\" 1}", 5);
+    TEST_ERROR_LOCATION(JSON_PARSE_MISS_KEY, "{\"a\":1,}", 7, 1, 8, "{\"a\":1,}", 7);
+    TEST_ERROR_LOCATION(JSON_PARSE_MISS_QUOTATION_MARK, "[\"abc", 5, 1, 6, "[\"abc", 5);
+    TEST_ERROR_LOCATION(JSON_PARSE_INVALID_STRING_ESCAPE, "[\"ab\\x\"]", 4, 1, 5, "[\"ab\\x\"]", 4);
+    TEST_ERROR_LOCATION(JSON_PARSE_INVALID_STRING_CHAR, "[\"a\tb\"]", 3, 1, 4, "[\"a b\"]", 3);
+    /* a bad \u escape is reported at its backslash */
+    TEST_ERROR_LOCATION(JSON_PARSE_INVALID_UNICODE_HEX, "[\"ab\\u00G0\"]", 4, 1, 5, "[\"ab\\u00G0\"]", 4);
+    TEST_ERROR_LOCATION(JSON_PARSE_INVALID_UNICODE_SURROGATE, "[\"a\\uD800b\"]", 3, 1, 4, "[\"a\\uD800b\"]", 3);
+    TEST_ERROR_LOCATION(JSON_PARSE_INVALID_UNICODE_HEX, "[\"a\\uD800\\u12\"]", 9, 1, 10, "[\"a\\uD800\\u12\"]", 9);
+    TEST_ERROR_LOCATION(JSON_PARSE_INVALID_UNICODE_SURROGATE, "[\"a\\uD800\\u0041\"]", 9, 1, 10, "[\"a\\uD800\\u0041\"]", 9);
+    /* a long line is cut to a window around the error */
+    TEST_ERROR_LOCATION(JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET,
+        "[0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19 20,21,22,23,24,25,26,27,28,29,30]",
+        51, 1, 52, "12,13,14,15,16,17,18,19 20,21,22,23,24,25,26,27", 24);
+
+    /* success sets only the code */
+    json_init(&v);
+    e.code = -1;
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_ex(&v, " [1] ", &e));
+    EXPECT_EQ_INT(JSON_PARSE_OK, e.code);
+    json_free(&v);
+    EXPECT_EQ_INT(JSON_PARSE_MISS_KEY, json_parse_ex(&v, "{1}", NULL));
+}
+
 static void test_parse() {
     test_parse_null();
     test_parse_true();
@@ -367,6 +431,131 @@ static void test_parse() {
     test_parse_miss_key();
     test_parse_miss_colon();
     test_parse_miss_comma_or_curly_bracket();
+    test_parse_error_location();
+}
+
+#define TEST_VALIDATE(error, json)\
+    EXPECT_EQ_INT(error, json_validate(json, sizeof(json) - 1))
+
+static void test_validate() {
+    static const char dbl_max_tie[] =
+        "179769313486231580793728971405303415079934132710037826936173778980444968292764750946649017"
+        "977587207096330286416692887910946555547851940402630657488671505820681908902000708383676273"
+        "854845817711531764475730270069855571366959622842914819860834936475292719074168444365510704"
+        "342711559699508093042880177904174497792";
+    const char *doc = "[1, {\"a\": \"b\"}] trailing";
+    char big[310];
+
+    TEST_VALIDATE(JSON_PARSE_OK, " [null, true, false, 1.5e3, \"\\u00e9\", {\"k\": []}] ");
+    TEST_VALIDATE(JSON_PARSE_OK, "\"a string longer than one machine word, \\\"escaped\\\" twice\"");
+    TEST_VALIDATE(JSON_PARSE_OK, "\"\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac non-ASCII runs\"");
+    TEST_VALIDATE(JSON_PARSE_INVALID_STRING_CHAR, "\"0123456789abcdef\x01 control after two words\"");
+    TEST_VALIDATE(JSON_PARSE_INVALID_STRING_ESCAPE, "\"0123456789abcdef\\x\"");
+    TEST_VALIDATE(JSON_PARSE_MISS_QUOTATION_MARK, "\"0123456789abcdef0123456789abcdef");
+    TEST_VALIDATE(JSON_PARSE_MISS_QUOTATION_MARK, "\"01234567\0\"");
+    TEST_VALIDATE(JSON_PARSE_ROOT_NOT_SINGULAR, "[1]\0");
+    TEST_VALIDATE(JSON_PARSE_NUMBER_TOO_BIG, "[1e309]");
+    TEST_VALIDATE(JSON_PARSE_EXPECT_VALUE, "");
+
+    /* The length bounds the text; it need not end in a NUL. */
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_validate(doc, 16));
+    EXPECT_EQ_INT(JSON_PARSE_ROOT_NOT_SINGULAR, json_validate(doc, 17));
+    EXPECT_EQ_INT(JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET, json_validate(doc, 13));
+    EXPECT_EQ_INT(JSON_PARSE_MISS_QUOTATION_MARK, json_validate(doc, 12));
+    EXPECT_EQ_INT(JSON_PARSE_INVALID_VALUE, json_validate("true", 3));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_validate("12", 1));
+
+    /* Every digit of a long number near DBL_MAX counts, as in json_parse. */
+    memset(big, '9', 309);
+    EXPECT_EQ_INT(JSON_PARSE_NUMBER_TOO_BIG, json_validate(big, 309));
+    memset(big, '0', 309);
+    big[0] = '2';
+    EXPECT_EQ_INT(JSON_PARSE_NUMBER_TOO_BIG, json_validate(big, 309));
+    /* 2^1024 - 2^970 rounds to infinity, one less to DBL_MAX */
+    memcpy(big, dbl_max_tie, 309);
+    EXPECT_EQ_INT(JSON_PARSE_NUMBER_TOO_BIG, json_validate(big, 309));
+    big[308] = '1';
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_validate(big, 309));
+    big[309] = '\0';
+    TEST_NUMBER(1.7976931348623157e308, big);
+}
+
+#define TEST_PARSE_OPTS(error, flags, json)\
+    do {\
+        json_value v;\
+        json_init(&v);\
+        EXPECT_EQ_INT(error, json_parse_opts(&v, json, flags, NULL));\
+        json_free(&v);\
+    } while(0)
+
+#define TEST_PARSE_INTEGER(expect, json)\
+    do {\
+        json_value v;\
+        json_init(&v);\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_opts(&v, json, JSON_PARSE_INTEGERS, NULL));\
+        EXPECT_EQ_DOUBLE(expect, json_get_number(&v));\
+        json_free(&v);\
+    } while(0)
+
+static void test_parse_opts() {
+    char nested[2 * 513 + 1];
+    json_value v;
+    json_error e;
+    char *json;
+    size_t length;
+
+    /* Options only restrict what json_parse accepts. */
+    TEST_PARSE_OPTS(JSON_PARSE_OK, 0, "\"\xc3\"");
+    TEST_PARSE_OPTS(JSON_PARSE_OK, 0, "[1.5, \"\\udc00\"]");
+    TEST_PARSE_OPTS(JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, JSON_PARSE_OPTIONS - 1, "[1 2]");
+
+    TEST_PARSE_OPTS(JSON_PARSE_OK, JSON_PARSE_VALIDATE_UTF8, "\"caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80\"");
+    TEST_PARSE_OPTS(JSON_PARSE_OK, JSON_PARSE_VALIDATE_UTF8, "\"\\ud83d\\ude00\"");
+    TEST_PARSE_OPTS(JSON_PARSE_INVALID_UTF8, JSON_PARSE_VALIDATE_UTF8, "\"\xc3\"");
+    TEST_PARSE_OPTS(JSON_PARSE_INVALID_UTF8, JSON_PARSE_VALIDATE_UTF8, "\"\xc0\xaf\"");
+    TEST_PARSE_OPTS(JSON_PARSE_INVALID_UTF8, JSON_PARSE_VALIDATE_UTF8, "\"\xe0\x80\xaf\"");
+    TEST_PARSE_OPTS(JSON_PARSE_INVALID_UTF8, JSON_PARSE_VALIDATE_UTF8, "\"\xed\xa0\x80\"");
+    TEST_PARSE_OPTS(JSON_PARSE_INVALID_UTF8, JSON_PARSE_VALIDATE_UTF8, "\"\xf4\x90\x80\x80\"");
+    TEST_PARSE_OPTS(JSON_PARSE_INVALID_UTF8, JSON_PARSE_VALIDATE_UTF8, "{\"\xff\":1}");
+    TEST_PARSE_OPTS(JSON_PARSE_INVALID_UNICODE_SURROGATE, JSON_PARSE_VALIDATE_UTF8, "\"\\udc00\"");
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_INVALID_UTF8, json_parse_opts(&v, "[\"ab\xe2\x82\"]", JSON_PARSE_VALIDATE_UTF8, &e));
+    EXPECT_EQ_SIZE_T(4, e.offset);
+
+    memset(nested, '[', 512);
+    memset(nested + 512, ']', 512);
+    nested[1024] = '\0';
+    TEST_PARSE_OPTS(JSON_PARSE_OK, JSON_PARSE_DEPTH_LIMIT, nested);
+    memset(nested, '[', 513);
+    memset(nested + 513, ']', 513);
+    nested[1026] = '\0';
+    TEST_PARSE_OPTS(JSON_PARSE_OK, 0, nested);
+    EXPECT_EQ_INT(JSON_PARSE_TOO_DEEP, json_parse_opts(&v, nested, JSON_PARSE_DEPTH_LIMIT, &e));
+    EXPECT_EQ_SIZE_T(512, e.offset);
+    nested[512] = '{';
+    TEST_PARSE_OPTS(JSON_PARSE_TOO_DEEP, JSON_PARSE_DEPTH_LIMIT, nested);
+
+    TEST_PARSE_INTEGER(0.0, "0");
+    TEST_PARSE_INTEGER(-0.0, "-0");
+    TEST_PARSE_INTEGER(-42.0, " -42 ");
+    TEST_PARSE_INTEGER(9007199254740992.0, "9007199254740993");
+    TEST_PARSE_INTEGER(1e19, "9999999999999999999");
+    TEST_PARSE_INTEGER(-1e19, "-9999999999999999999");
+    TEST_PARSE_INTEGER(18446744073709551616.0, "18446744073709551615");
+    TEST_PARSE_OPTS(JSON_PARSE_NUMBER_NOT_INTEGER, JSON_PARSE_INTEGERS, "1.0");
+    TEST_PARSE_OPTS(JSON_PARSE_NUMBER_NOT_INTEGER, JSON_PARSE_INTEGERS, "[1, 2e3]");
+    TEST_PARSE_OPTS(JSON_PARSE_NUMBER_NOT_INTEGER, JSON_PARSE_INTEGERS | JSON_PARSE_DEPTH_LIMIT, "{\"a\":-0E0}");
+    TEST_PARSE_OPTS(JSON_PARSE_ROOT_NOT_SINGULAR, JSON_PARSE_INTEGERS, "01");
+
+    /* JSON_STRINGIFY_UTF8 leaves non-ASCII and '/' as they are. */
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "[\"caf\\u00e9 \\ud83d\\ude00 a/b\\n\"]"));
+    EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify_opts(&v, &json, &length, JSON_STRINGIFY_UTF8));
+    EXPECT_EQ_STRING("[\"caf\xc3\xa9 \xf0\x9f\x98\x80 a/b\\n\"]", json, length);
+    free(json);
+    EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify_opts(&v, &json, &length, 0));
+    EXPECT_EQ_STRING("[\"caf\\u00E9 \\uD83D\\uDE00 a\\/b\\n\"]", json, length);
+    free(json);
+    json_free(&v);
 }
 
 static void test_access_null() {
@@ -445,13 +634,1728 @@ static void test_stringify()
     TEST_ROUNDTRIP("[]");
     TEST_ROUNDTRIP("123.456");
     TEST_ROUNDTRIP("{}");
+    TEST_ROUNDTRIP("{\"a\\\"b\\n\":1}");
     TEST_ROUNDTRIP("{\"n\":null,\"f\":false,\"t\":true,\"i\":123,\"s\":\"abc\",\"a\":[1,2,3],\"o\":{\"1\":1,\"2\":2,\"3\":3}}");
+    /* bytes that are not UTF-8 are accepted raw, so they are written back raw */
+    TEST_ROUNDTRIP("\"\xc3\"");
+    TEST_ROUNDTRIP("\"a\xc3(\xff\x80\"");
+    TEST_ROUNDTRIP("\"\xe2\x82\"");
+    TEST_ROUNDTRIP("\"\xc0\x80\xe0\x80\x80\xf4\x90\x80\x80\"");
+}
+
+static void test_find_object() {
+    json_value v;
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "{\"a\":1,\"bb\":2,\"\\u0063\":3}"));
+    EXPECT_EQ_SIZE_T(1, json_find_object_index(&v, "bb", 2));
+    EXPECT_EQ_SIZE_T(2, json_find_object_index(&v, "c", 1));
+    EXPECT_EQ_SIZE_T(JSON_KEY_NOT_EXIST, json_find_object_index(&v, "b", 1));
+    EXPECT_EQ_DOUBLE(1.0, json_get_number(json_find_object_value(&v, "a", 1)));
+    EXPECT_TRUE(json_find_object_value(&v, "", 0) == NULL);
+    json_free(&v);
+}
+
+#define TEST_POINTER_ERROR(error, ptr)\
+    do {\
+        json_pointer p;\
+        EXPECT_EQ_INT(error, json_pointer_compile(&p, ptr, sizeof(ptr) - 1));\
+        json_pointer_free(&p);\
+    } while (0)
+
+static void test_pointer_compile() {
+    json_pointer p;
+
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_pointer_compile(&p, "", 0));
+    EXPECT_EQ_SIZE_T(0, p.size);
+    json_pointer_free(&p);
+
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_pointer_compile(&p, "/a~1b/m~0n//0/01/-", 18));
+    EXPECT_EQ_SIZE_T(6, p.size);
+    EXPECT_EQ_STRING("a/b", p.s[0].k, p.s[0].klen);
+    EXPECT_EQ_STRING("m~n", p.s[1].k, p.s[1].klen);
+    EXPECT_EQ_SIZE_T(0, p.s[2].klen);
+    EXPECT_EQ_SIZE_T(JSON_KEY_NOT_EXIST, p.s[2].index);
+    EXPECT_EQ_SIZE_T(0, p.s[3].index);
+    EXPECT_EQ_SIZE_T(JSON_KEY_NOT_EXIST, p.s[4].index);
+    EXPECT_EQ_SIZE_T(JSON_POINTER_APPEND, p.s[5].index);
+    json_pointer_free(&p);
+
+    TEST_POINTER_ERROR(JSON_POINTER_INVALID, "a");
+    TEST_POINTER_ERROR(JSON_POINTER_INVALID, "/a~");
+    TEST_POINTER_ERROR(JSON_POINTER_INVALID, "/a~2");
+}
+
+static const char pointer_doc[] =
+    "{ \"foo\": [\"bar\", \"baz\"], \"\": 0, \"a/b\": 1, \"c%d\": 2, \"e^f\": 3,"
+    " \"g|h\": 4, \"i\\\\j\": 5, \"k\\\"l\": 6, \" \": 7, \"m~n\": 8,"
+    " \"payload\": { \"skip\": [1, {\"x\": \"y\"}], \"items\": [ {\"price\": 9.5} ] } }";
+
+#define TEST_POINTER(expect, ptr)\
+    do {\
+        json_pointer p;\
+        json_value v, e;\
+        json_init(&v);\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, pointer_doc));\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_pointer_compile(&p, ptr, sizeof(ptr) - 1));\
+        EXPECT_TRUE(json_pointer_get(&p, &v) != NULL);\
+        EXPECT_EQ_DOUBLE(expect, json_get_number(json_pointer_get(&p, &v)));\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_pointer(&e, pointer_doc, &p));\
+        EXPECT_EQ_DOUBLE(expect, json_get_number(&e));\
+        json_free(&e);\
+        json_pointer_free(&p);\
+        json_free(&v);\
+    } while (0)
+
+#define TEST_POINTER_NOT_FOUND(ptr)\
+    do {\
+        json_pointer p;\
+        json_value v, e;\
+        json_init(&v);\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, pointer_doc));\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_pointer_compile(&p, ptr, sizeof(ptr) - 1));\
+        EXPECT_TRUE(json_pointer_get(&p, &v) == NULL);\
+        EXPECT_EQ_INT(JSON_POINTER_NOT_FOUND, json_parse_pointer(&e, pointer_doc, &p));\
+        EXPECT_EQ_INT(JSON_NULL, json_get_type(&e));\
+        json_pointer_free(&p);\
+        json_free(&v);\
+    } while (0)
+
+static void test_pointer_get() {
+    char big[310];
+    json_pointer p;
+    json_value v;
+
+    /* RFC 6901 section 5 */
+    TEST_POINTER(0.0, "/");
+    TEST_POINTER(1.0, "/a~1b");
+    TEST_POINTER(2.0, "/c%d");
+    TEST_POINTER(3.0, "/e^f");
+    TEST_POINTER(4.0, "/g|h");
+    TEST_POINTER(5.0, "/i\\j");
+    TEST_POINTER(6.0, "/k\"l");
+    TEST_POINTER(7.0, "/ ");
+    TEST_POINTER(8.0, "/m~0n");
+    TEST_POINTER(9.5, "/payload/items/0/price");
+
+    TEST_POINTER_NOT_FOUND("/nope");
+    TEST_POINTER_NOT_FOUND("/foo/2");
+    TEST_POINTER_NOT_FOUND("/foo/-");
+    TEST_POINTER_NOT_FOUND("/foo/01");
+    TEST_POINTER_NOT_FOUND("/a~1b/0");
+    TEST_POINTER_NOT_FOUND("/payload/items/0/price/x");
+
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_pointer_compile(&p, "/foo/1", 6));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_pointer(&v, pointer_doc, &p));
+    EXPECT_EQ_STRING("baz", json_get_string(&v), json_get_string_length(&v));
+    json_free(&v);
+    json_pointer_free(&p);
+
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_pointer_compile(&p, "", 0));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_pointer(&v, pointer_doc, &p));
+    EXPECT_EQ_INT(JSON_OBJECT, json_get_type(&v));
+    json_free(&v);
+    EXPECT_EQ_INT(JSON_PARSE_ROOT_NOT_SINGULAR, json_parse_pointer(&v, "null x", &p));
+    json_pointer_free(&p);
+
+    /* errors in skipped subtrees are still reported */
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_pointer_compile(&p, "/b", 2));
+    EXPECT_EQ_INT(JSON_PARSE_INVALID_VALUE, json_parse_pointer(&v, "{\"a\":[1,],\"b\":0}", &p));
+    EXPECT_EQ_INT(JSON_PARSE_NUMBER_TOO_BIG, json_parse_pointer(&v, "{\"a\":1e309,\"b\":0}", &p));
+    EXPECT_EQ_INT(JSON_PARSE_INVALID_UNICODE_SURROGATE, json_parse_pointer(&v, "{\"a\":\"\\uD800\",\"b\":0}", &p));
+    EXPECT_EQ_INT(JSON_PARSE_MISS_COLON, json_parse_pointer(&v, "{\"a\" 1,\"b\":0}", &p));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_pointer(&v, "{\"a\":1.7976931348623157e308,\"b\":0}", &p));
+    EXPECT_EQ_INT(JSON_PARSE_NUMBER_TOO_BIG, json_parse_pointer(&v, "{\"a\":1.8e308,\"b\":0}", &p));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_pointer(&v, "{\"a\":0.00e400,\"b\":0}", &p));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_pointer(&v, "{\"a\":0.0001e311,\"b\":0}", &p));
+    json_free(&v);
+    json_pointer_free(&p);
+
+    /* A root number runs to the end of the text; all its digits decide overflow. */
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_pointer_compile(&p, "/a", 2));
+    memset(big, '9', 309);
+    big[309] = '\0';
+    EXPECT_EQ_INT(JSON_PARSE_NUMBER_TOO_BIG, json_parse(&v, big));
+    EXPECT_EQ_INT(JSON_PARSE_NUMBER_TOO_BIG, json_parse_pointer(&v, big, &p));
+    memcpy(big, "17976931348623157", 17);
+    memset(big + 17, '0', 292);
+    EXPECT_EQ_INT(JSON_POINTER_NOT_FOUND, json_parse_pointer(&v, big, &p));
+    json_pointer_free(&p);
+}
+
+static void test_pointer() {
+    test_find_object();
+    test_pointer_compile();
+    test_pointer_get();
+}
+
+#define TEST_PROJECTION(expect, json, ...)\
+    do {\
+        static const char *paths[] = { __VA_ARGS__ };\
+        json_projection p;\
+        json_value v;\
+        char* json2;\
+        size_t i, length;\
+        json_projection_init(&p);\
+        for (i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i)\
+            EXPECT_EQ_INT(JSON_PARSE_OK, json_projection_add(&p, paths[i], strlen(paths[i])));\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_projection(&v, json, &p));\
+        EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify(&v, &json2, &length));\
+        EXPECT_EQ_STRING(expect, json2, length);\
+        json_free(&v);\
+        free(json2);\
+        json_projection_free(&p);\
+    } while (0)
+
+#define TEST_PROJECTION_ERROR(error, json)\
+    do {\
+        json_projection p;\
+        json_value v;\
+        json_projection_init(&p);\
+        json_projection_add(&p, "/a", 2);\
+        EXPECT_EQ_INT(error, json_parse_projection(&v, json, &p));\
+        EXPECT_EQ_INT(error, json_parse(&v, json));\
+        EXPECT_EQ_INT(JSON_NULL, json_get_type(&v));\
+        json_projection_free(&p);\
+    } while (0)
+
+static void test_projection() {
+    static const char doc[] =
+        "{ \"id\": 7, \"name\": \"x\\ty\", \"tags\": [\"a\", \"b\"],"
+        " \"payload\": { \"items\": [ {\"price\": 1, \"qty\": 2}, {\"price\": 3} ], \"n\": null } }";
+    char big[314];
+
+    TEST_PROJECTION("{\"id\":7}", doc, "/id");
+    TEST_PROJECTION("{\"id\":7,\"name\":\"x\\ty\"}", doc, "/name", "/id");
+    TEST_PROJECTION("{\"payload\":{\"items\":[{\"price\":1}]}}", doc, "/payload/items/0/price");
+    TEST_PROJECTION("{\"payload\":{\"items\":[null,{\"price\":3}]}}", doc, "/payload/items/1");
+    TEST_PROJECTION("{\"tags\":[\"a\",\"b\"]}", doc, "/tags", "/tags/0");
+    TEST_PROJECTION("{}", doc, "/missing", "/id/x");
+    TEST_PROJECTION("{\"ab\":1}", "{\"\\u0061b\":1,\"c\":2}", "/ab");
+    TEST_PROJECTION("[1,2]", "[1,2]", "");
+
+    TEST_PROJECTION_ERROR(JSON_PARSE_INVALID_VALUE, "{\"b\":[1,],\"a\":1}");
+    TEST_PROJECTION_ERROR(JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "{\"a\":[1}");
+    TEST_PROJECTION_ERROR(JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET, "{\"a\":1 \"b\"");
+    TEST_PROJECTION_ERROR(JSON_PARSE_MISS_COLON, "{\"b\" 1}");
+    TEST_PROJECTION_ERROR(JSON_PARSE_ROOT_NOT_SINGULAR, "{\"a\":1} x");
+    TEST_PROJECTION_ERROR(JSON_PARSE_INVALID_STRING_CHAR, "{\"b\":\"\x01\"}");
+    TEST_PROJECTION_ERROR(JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET, "{\"a\":{\"b\":[1,2],\"c\":{}");
+
+    /* A skipped number near DBL_MAX overflows on all its digits, at the end of the text too. */
+    memset(big, '9', 309);
+    big[309] = '\0';
+    TEST_PROJECTION_ERROR(JSON_PARSE_NUMBER_TOO_BIG, big);
+    memcpy(big, "[1,", 3);
+    memset(big + 3, '0', 309);
+    big[3] = '2';
+    memcpy(big + 312, "]", 2);
+    TEST_PROJECTION_ERROR(JSON_PARSE_NUMBER_TOO_BIG, big);
+}
+
+#define TEST_QUERY(expect, doc, query)\
+    do {\
+        json_query q;\
+        json_value d, r;\
+        json_value* out[16];\
+        char* json;\
+        size_t length, n, i;\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_query_compile(&q, query, strlen(query)));\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_query(&r, doc, &q));\
+        EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify(&r, &json, &length));\
+        EXPECT_EQ_STRING(expect, json, length);\
+        json_init(&d);\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&d, doc));\
+        n = json_query_select(&q, &d, out, 16);\
+        EXPECT_EQ_SIZE_T(json_get_array_size(&r), n);\
+        for (i = 0; i < n && i < 16; i++)\
+            EXPECT_TRUE(json_is_equal(out[i], json_get_array_element(&r, i)));\
+        free(json);\
+        json_free(&d);\
+        json_free(&r);\
+        json_query_free(&q);\
+    } while(0)
+
+#define TEST_QUERY_INVALID(query)\
+    do {\
+        json_query q;\
+        EXPECT_EQ_INT(JSON_QUERY_INVALID, json_query_compile(&q, query, strlen(query)));\
+        EXPECT_EQ_SIZE_T(0, q.size);\
+    } while(0)
+
+static void test_query() {
+    static const char doc[] =
+        "{\"store\": {\"items\": [{\"id\": 1, \"price\": 5, \"tags\": [\"a\"]},"
+        " {\"id\": 2, \"price\": 12.5, \"name\": \"x\"}, {\"id\": 3, \"price\": 30, \"tags\": [\"b\", \"c\"]},"
+        " {\"id\": 4}], \"owner\": {\"name\": \"n\", \"id\": 9}, \"a~b/c\": true}}";
+    char big[310];
+    json_query q;
+    json_value v;
+    json_value* out[2];
+
+    TEST_QUERY("[2,3]", doc, "$.store.items[?(@.price > 10)].id");
+    TEST_QUERY("[1]", doc, "$.store.items[?@.price <= 12.4 && @.tags].id");
+    TEST_QUERY("[2,4]", doc, "$.store.items[?(!@.price || @.name == \"x\")].id");
+    TEST_QUERY("[2,3]", doc, "$.store.items[?(@.id >= 2 && (@.price < 20 || @.price > 25))].id");
+    TEST_QUERY("[2,3,4]", doc, "$.store.items[?@.tags[0] != \"a\"].id");
+    TEST_QUERY("[3]", doc, "$.store.items[?@['tags'][1] == \"c\"].id");
+    TEST_QUERY("[2]", doc, "$.store.items[?@.name >= \"x\" && @.name < \"xa\"].id");
+    TEST_QUERY("[]", doc, "$.store.items[?@.price > \"10\"].id");
+    TEST_QUERY("[\"c\"]", doc, "$.store.items[*].tags[1]");
+    TEST_QUERY("[\"n\"]", doc, "$.store['owner'][\"name\"]");
+    TEST_QUERY("[true]", doc, "$.store[\"a~b\\/c\"]");
+    TEST_QUERY("[9]", doc, "$.store.*.id");
+    TEST_QUERY("[9]", doc, "$.store.owner[?@ == 9]");
+    TEST_QUERY("[{\"id\":4}]", doc, "$.store.items[3]");
+    TEST_QUERY("[{\"a\":[1]}]", "{\"a\":[1]}", "$");
+    TEST_QUERY("[]", doc, "$.missing");
+    TEST_QUERY("[]", doc, "$.store.items.id");
+    TEST_QUERY("[]", doc, "$.store[0]");
+    TEST_QUERY("[]", doc, "$.store.items[4]");
+    /* filter paths may name keys with ~ and / in them */
+    TEST_QUERY("[{\"a~b\\/c\":1}]", "[{\"a~b/c\":1},{\"a\":2}]", "$[?@['a~b/c']]");
+    /* like a lookup, a member step takes the first of duplicate keys */
+    TEST_QUERY("[1]", "{\"a\":1,\"a\":2}", "$.a");
+    TEST_QUERY("[[2,{\"k\":[3]}]]", "[[1],[2,{\"k\":[3]}]]", "$[?@[1].k[0] == 3]");
+
+    TEST_QUERY_INVALID("");
+    TEST_QUERY_INVALID("store");
+    TEST_QUERY_INVALID("$.");
+    TEST_QUERY_INVALID("$..a");
+    TEST_QUERY_INVALID("$[");
+    TEST_QUERY_INVALID("$[01]");
+    TEST_QUERY_INVALID("$['a]");
+    TEST_QUERY_INVALID("$.a b");
+    TEST_QUERY_INVALID("$[?@.a ==]");
+    TEST_QUERY_INVALID("$[?@.a = 1]");
+    TEST_QUERY_INVALID("$[?(@.a]");
+    TEST_QUERY_INVALID("$[?@.a && ]");
+    TEST_QUERY_INVALID("$[?a]");
+
+    /* select reports every match even past cap */
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_query_compile(&q, "$.store.items[*].id", 19));
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, doc));
+    EXPECT_EQ_SIZE_T(4, json_query_select(&q, &v, out, 2));
+    EXPECT_EQ_DOUBLE(2.0, json_get_number(out[1]));
+    json_free(&v);
+    /* text errors are json_parse's */
+    EXPECT_EQ_INT(JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET, json_parse_query(&v, "{\"store\":{\"items\":[]]}", &q));
+    EXPECT_EQ_INT(JSON_NULL, json_get_type(&v));
+    EXPECT_EQ_INT(JSON_PARSE_ROOT_NOT_SINGULAR, json_parse_query(&v, "{\"store\":{\"items\":[{\"id\":1}]}} x", &q));
+    EXPECT_EQ_INT(JSON_PARSE_INVALID_VALUE, json_parse_query(&v, "{\"store\":{\"items\":[{\"id\":1}, {\"id\":tru}]}}", &q));
+    json_query_free(&q);
+    /* a skipped root number near DBL_MAX overflows on all its digits */
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_query_compile(&q, "$.a", 3));
+    memset(big, '9', 309);
+    big[309] = '\0';
+    EXPECT_EQ_INT(JSON_PARSE_NUMBER_TOO_BIG, json_parse_query(&v, big, &q));
+    EXPECT_EQ_INT(JSON_NULL, json_get_type(&v));
+    json_query_free(&q);
+}
+
+static char* make_array(size_t n, const char* tail) {
+    size_t i, len = 0;
+    char* json = malloc(n * 64 + strlen(tail) + 8);
+    json[len++] = '[';
+    for (i = 0; i < n; i++)
+        len += sprintf(json + len, i % 4 == 0 ? "%s{\"k\":[%zu,\"a,]\\\"b\"]}" : i % 4 == 1 ? "%s\"s%zu\"" :
+            i % 4 == 2 ? "%s%zu.5" : "%s[[],{},null,%zu]", i > 0 ? ", " : " ", i);
+    strcpy(json + len, tail);
+    return json;
+}
+
+#define TEST_PARSE_PARALLEL(json, nthreads)\
+    do {\
+        json_value v1, v2;\
+        char *s1, *s2;\
+        size_t l1, l2;\
+        int ret = json_parse(&v1, json);\
+        EXPECT_EQ_INT(ret, json_parse_parallel(&v2, json, nthreads));\
+        if (ret == JSON_PARSE_OK) {\
+            json_stringify(&v1, &s1, &l1);\
+            json_stringify(&v2, &s2, &l2);\
+            EXPECT_TRUE(l1 == l2 && memcmp(s1, s2, l1) == 0);\
+            free(s1);\
+            free(s2);\
+        } else\
+            EXPECT_EQ_INT(JSON_NULL, json_get_type(&v2));\
+        json_free(&v1);\
+        json_free(&v2);\
+    } while (0)
+
+static void test_parse_parallel() {
+    static const char* tails[] = {
+        " ]", "]  \n", ", ]", ",]", "] x", ", nul]", ", [1}]", ", {\"a\":1]", ", \"\\x\"]", ", 1 2]", "", ", \"abc"
+    };
+    size_t i;
+    unsigned t;
+    char* json;
+
+    TEST_PARSE_PARALLEL("[1, 2, 3]", 4);
+    TEST_PARSE_PARALLEL("{\"a\":[1]}", 4);
+    for (i = 0; i < sizeof(tails) / sizeof(tails[0]); i++) {
+        json = make_array(5000, tails[i]);
+        for (t = 1; t <= 5; t += 2)
+            TEST_PARSE_PARALLEL(json, t);
+        free(json);
+    }
+    json = make_array(5000, "]");
+    json[5000] = '\x01';  /* an error inside some element */
+    TEST_PARSE_PARALLEL(json, 3);
+    free(json);
+}
+
+#define TEST_STRINGIFY_PARALLEL(json, nthreads)\
+    do {\
+        json_value v;\
+        char *s1, *s2, *s3;\
+        size_t l1, l2, l3;\
+        FILE* f = tmpfile();\
+        json_init(&v);\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, json));\
+        EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify(&v, &s1, &l1));\
+        EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify_parallel(&v, &s2, &l2, nthreads));\
+        EXPECT_TRUE(l1 == l2 && memcmp(s1, s2, l1) == 0 && s2[l2] == '\0');\
+        EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify_parallel_fd(&v, fileno(f), nthreads));\
+        s3 = malloc(l1 + 1);\
+        rewind(f);\
+        l3 = fread(s3, 1, l1 + 1, f);\
+        EXPECT_TRUE(l1 == l3 && memcmp(s1, s3, l1) == 0);\
+        fclose(f);\
+        json_free(&v);\
+        free(s1);\
+        free(s2);\
+        free(s3);\
+    } while (0)
+
+#define TEST_CANONICAL(expect, json)\
+    do {\
+        json_value v;\
+        char* out;\
+        size_t length;\
+        json_init(&v);\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, json));\
+        EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify_canonical(&v, &out, &length));\
+        EXPECT_EQ_STRING(expect, out, length);\
+        json_free(&v);\
+        free(out);\
+    } while(0)
+
+#define TEST_CANONICAL_NUMBER(expect, n)\
+    do {\
+        json_value v;\
+        char* out;\
+        size_t length;\
+        json_init(&v);\
+        json_set_number(&v, n);\
+        EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify_canonical(&v, &out, &length));\
+        EXPECT_EQ_STRING(expect, out, length);\
+        free(out);\
+    } while(0)
+
+static void test_stringify_canonical() {
+    json_value v;
+    char* out;
+    char* again;
+    size_t length, again_length;
+
+    /* RFC 8785, 3.2.2 */
+    TEST_CANONICAL("{\"literals\":[null,true,false],\"numbers\":[333333333.3333333,1e+30,4.5,0.002,1e-27],"
+        "\"string\":\"\xe2\x82\xac$\\u000f\\nA'B\\\"\\\\\\\\\\\"/\"}",
+        "{\n  \"numbers\": [333333333.33333329, 1E30, 4.50, 2e-3, 0.000000000000000000000000001],\n"
+        "  \"string\": \"\\u20ac$\\u000F\\u000aA'\\u0042\\u0022\\u005c\\\\\\\"\\/\",\n"
+        "  \"literals\": [null, true, false]\n}");
+    /* RFC 8785, 3.2.3: UTF-16 order puts U+FB33 after U+1F600 */
+    TEST_CANONICAL("{\"\\r\":1,\"1\":2,\"\xc2\x80\":3,\"\xc3\xb6\":4,\"\xe2\x82\xac\":5,\"\xf0\x9f\x98\x80\":6,\"\xef\xac\xb3\":7}",
+        "{\"\\u20ac\":5,\"\\r\":1,\"\\ufb33\":7,\"1\":2,\"\\ud83d\\ude00\":6,\"\\u0080\":3,\"\\u00f6\":4}");
+    TEST_CANONICAL("{\"a\":{\"b\":true,\"x\":[{\"p\":2,\"q\":1}]},\"ab\":0,\"abcdefgh\":1,\"abcdefghi\":2,\"abcdefgz\":3}",
+        " { \"abcdefgz\" : 3 , \"ab\":0, \"abcdefghi\":2, \"abcdefgh\":1, \"a\": {\"x\": [{\"q\":1, \"p\":2}], \"b\": true} } ");
+    /* duplicate keys keep their order, embedded NULs sort by bytes */
+    TEST_CANONICAL("{\"a\":2,\"a\":1,\"a\\u0000\":3}", "{\"a\\u0000\":3,\"a\":2,\"a\":1}");
+    TEST_CANONICAL("[{},[],\"\",\"\\b\\f\\u001f\x7f\"]", "[{}, [], \"\", \"\\b\\f\\u001F\x7f\"]");
+
+    TEST_CANONICAL_NUMBER("0", 0.0);
+    TEST_CANONICAL_NUMBER("0", -0.0);
+    TEST_CANONICAL_NUMBER("-1.5", -1.5);
+    TEST_CANONICAL_NUMBER("5e-324", 4.9406564584124654e-324);
+    TEST_CANONICAL_NUMBER("1.7976931348623157e+308", 1.7976931348623157e308);
+    TEST_CANONICAL_NUMBER("9007199254740992", 9007199254740992.0);
+    TEST_CANONICAL_NUMBER("295147905179352830000", 295147905179352825856.0);
+    TEST_CANONICAL_NUMBER("1e+21", 1e21);
+    TEST_CANONICAL_NUMBER("9.999999999999997e+22", 9.999999999999997e22);
+    TEST_CANONICAL_NUMBER("0.000001", 0.000001);
+    TEST_CANONICAL_NUMBER("1e-7", 1e-7);
+    TEST_CANONICAL_NUMBER("1.5e-7", 1.5e-7);
+    TEST_CANONICAL_NUMBER("0.1", 0.1);
+    TEST_CANONICAL_NUMBER("123.456", 123.456);
+
+    json_init(&v);
+    json_set_number(&v, NAN);
+    EXPECT_EQ_INT(JSON_STRINGIFY_NUMBER_INVALID, json_stringify_canonical(&v, &out, &length));
+    EXPECT_TRUE(out == NULL);
+
+    /* Wide objects (sorted with qsort) nested deep enough to move the scratch stack. */
+    {
+        char json[16384];
+        const json_value* o;
+        size_t pos = 0;
+        int depth, k;
+
+        for (depth = 0; depth < 20; ++depth) {
+            pos += sprintf(json + pos, "{");
+            for (k = 30; k > 0; --k)
+                pos += sprintf(json + pos, "\"key%02d\":%d,", (k * 7) % 31, k);
+            pos += sprintf(json + pos, "\"next\":");
+        }
+        pos += sprintf(json + pos, "null");
+        for (depth = 0; depth < 20; ++depth)
+            pos += sprintf(json + pos, "}");
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, json));
+        EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify_canonical(&v, &out, &length));
+        json_free(&v);
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, out));
+        for (o = &v; json_get_type(o) == JSON_OBJECT; o = json_get_object_value(o, 30)) {
+            EXPECT_EQ_SIZE_T(31, json_get_object_size(o));
+            for (k = 1; k < 31; ++k)
+                EXPECT_TRUE(strcmp(json_get_object_key(o, k - 1), json_get_object_key(o, k)) < 0);
+        }
+        EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify_canonical(&v, &again, &again_length));
+        EXPECT_EQ_SIZE_T(length, again_length);
+        EXPECT_TRUE(memcmp(out, again, length) == 0);
+        free(out);
+        free(again);
+        json_free(&v);
+    }
+}
+
+static void test_stringify_parallel() {
+    size_t i, len;
+    unsigned t;
+    char* json;
+
+    TEST_STRINGIFY_PARALLEL("[1,2,3]", 4);
+    TEST_STRINGIFY_PARALLEL("\"abc\"", 4);
+    json = make_array(5000, "]");
+    for (t = 1; t <= 7; t += 2)
+        TEST_STRINGIFY_PARALLEL(json, t);
+    free(json);
+    /* more threads than elements: no chunk may come out empty */
+    json = make_array(1024, "]");
+    TEST_STRINGIFY_PARALLEL(json, 1500);
+    free(json);
+
+    json = malloc(5000 * 32);
+    len = sprintf(json, "{");
+    for (i = 0; i < 5000; i++)
+        len += sprintf(json + len, "%s\"k\\\"%zu\":[%zu]", i > 0 ? "," : "", i, i);
+    strcpy(json + len, "}");
+    TEST_STRINGIFY_PARALLEL(json, 3);
+    free(json);
+}
+
+static size_t count_live = 0;
+static size_t count_calls = 0;
+
+/* atomic so that allocations from other threads are counted too */
+static void* count_malloc(void* ud, size_t size) {
+    (void)ud;
+    __atomic_add_fetch(&count_live, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&count_calls, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+static void* count_realloc(void* ud, void* ptr, size_t size) {
+    (void)ud;
+    if (ptr == NULL)
+        __atomic_add_fetch(&count_live, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&count_calls, 1, __ATOMIC_RELAXED);
+    return realloc(ptr, size);
+}
+
+static void count_free(void* ud, void* ptr) {
+    (void)ud;
+    if (ptr != NULL)
+        __atomic_sub_fetch(&count_live, 1, __ATOMIC_RELAXED);
+    free(ptr);
+}
+
+static json_allocator counting = { count_malloc, count_realloc, count_free, NULL };
+
+static void test_allocator() {
+    json_allocator pooled;
+    const json_allocator* prev;
+    json_pool* pool;
+    json_value v;
+    char* json;
+    size_t len;
+    const char* doc = "{\"a\":[1,2,{\"b\":\"xyz\"}],\"long\":\"0123456789012345678901234567890123456789\"}";
+
+    prev = json_set_thread_allocator(&counting);
+    EXPECT_TRUE(prev == NULL);
+    EXPECT_TRUE(json_get_allocator() == &counting);
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, doc));
+    EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify(&v, &json, &len));
+    EXPECT_TRUE(count_calls > 0);
+    EXPECT_TRUE(count_live > 0);
+    json_get_allocator()->free(json_get_allocator()->ud, json);
+    json_free(&v);
+    EXPECT_EQ_SIZE_T(0, count_live);
+    EXPECT_TRUE(json_set_thread_allocator(NULL) == &counting);
+    EXPECT_TRUE(json_get_allocator() != &counting);
+
+    pool = json_pool_create();
+    EXPECT_TRUE(pool != NULL);
+    json_pool_allocator(pool, &pooled);
+    json_set_thread_allocator(&pooled);
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, doc));
+    EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify(&v, &json, &len));
+    EXPECT_EQ_STRING("{\"a\":[1,2,{\"b\":\"xyz\"}],\"long\":\"0123456789012345678901234567890123456789\"}", json, len);
+    json_free(&v);
+    /* large documents spill past the size classes into dedicated blocks */
+    json_set_thread_allocator(NULL);
+    doc = make_array(3000, "]");
+    json_set_thread_allocator(&pooled);
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, doc));
+    EXPECT_EQ_SIZE_T(3000, json_get_array_size(&v));
+    /* json is left for json_pool_destroy to reclaim */
+    json_free(&v);
+    json_set_thread_allocator(NULL);
+    free((char*)doc);
+    json_pool_destroy(pool);
+}
+
+static void test_parse_fixed() {
+    static json_value nodes[2048];
+    static char strings[2048];
+    json_buffers b;
+    json_value v, w;
+    size_t nodes_needed, strings_needed;
+    const char* doc = " {\"a\": [1, true, \"x\\u00e9\\ud83d\\ude00\"], \"b\": {\"c\": null, \"\": \"\"}, \"d\": []} ";
+
+    json_init(&w);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&w, doc));
+
+    /* Too small: measured, nothing parsed, exact sizes reported. */
+    b.nodes = nodes;
+    b.nodes_size = 0;
+    b.strings = strings;
+    b.strings_size = 0;
+    json_set_thread_allocator(&counting);
+    count_calls = 0;
+    EXPECT_EQ_INT(JSON_PARSE_CAPACITY_EXCEEDED, json_parse_fixed(&v, doc, &b));
+    EXPECT_EQ_INT(JSON_NULL, json_get_type(&v));
+    nodes_needed = b.nodes_needed;
+    strings_needed = b.strings_needed;
+    EXPECT_EQ_SIZE_T(2 + 8 + 2 + 2 + 1 + 1 + 2, strings_needed);
+    EXPECT_TRUE(nodes_needed >= 3 * sizeof(json_value) + 5 * sizeof(json_member));
+
+    /* The reported sizes are enough, and exactly so. */
+    b.nodes_size = nodes_needed;
+    b.strings_size = strings_needed;
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_fixed(&v, doc, &b));
+    EXPECT_TRUE(json_is_equal(&w, &v));
+    b.nodes_size = nodes_needed - 1;
+    EXPECT_EQ_INT(JSON_PARSE_CAPACITY_EXCEEDED, json_parse_fixed(&v, doc, &b));
+    b.nodes_size = nodes_needed;
+    b.strings_size = strings_needed - 1;
+    EXPECT_EQ_INT(JSON_PARSE_CAPACITY_EXCEEDED, json_parse_fixed(&v, doc, &b));
+    EXPECT_EQ_SIZE_T(nodes_needed, b.nodes_needed);
+    EXPECT_EQ_SIZE_T(strings_needed, b.strings_needed);
+
+    /* Buffers of the worst-case sizes parse in one pass. */
+    EXPECT_TRUE(JSON_FIXED_NODES_SIZE(strlen(doc)) <= sizeof(nodes));
+    b.nodes_size = JSON_FIXED_NODES_SIZE(strlen(doc));
+    b.strings_size = JSON_FIXED_STRINGS_SIZE(strlen(doc));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse_fixed(&v, doc, &b));
+    EXPECT_TRUE(json_is_equal(&w, &v));
+    EXPECT_TRUE(JSON_MAX_VALUES(7) >= 4); /* [0,0,0] */
+
+    /* Errors win over capacity, with or without the measuring pass. */
+    EXPECT_EQ_INT(JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET, json_parse_fixed(&v, "{\"a\":[1,2]]", &b));
+    EXPECT_EQ_INT(JSON_NULL, json_get_type(&v));
+    b.nodes_size = b.strings_size = 0;
+    EXPECT_EQ_INT(JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET, json_parse_fixed(&v, "{\"a\":[1,2]]", &b));
+    EXPECT_EQ_INT(JSON_PARSE_ROOT_NOT_SINGULAR, json_parse_fixed(&v, "[] x", &b));
+    EXPECT_EQ_INT(JSON_PARSE_NUMBER_TOO_BIG, json_parse_fixed(&v, "[1e309]", &b));
+    EXPECT_EQ_SIZE_T(0, count_calls);
+    json_set_thread_allocator(NULL);
+    json_free(&w);
+}
+
+static void test_parser() {
+    json_parser p;
+    json_value v;
+    char* json;
+    size_t first, second;
+
+    json_set_thread_allocator(&counting);
+    json_parser_init(&p);
+    count_calls = 0;
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parser_parse(&p, &v, "[1,[\"a\",{\"b\":null}]]"));
+    first = count_calls;
+    json_free(&v);
+    count_calls = 0;
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parser_parse(&p, &v, "[1,[\"a\",{\"b\":null}]]"));
+    second = count_calls;
+    json_free(&v);
+    EXPECT_TRUE(second < first);
+    EXPECT_TRUE(p.size > 0);
+
+    EXPECT_EQ_INT(JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, json_parser_parse(&p, &v, "[1,[2}"));
+    EXPECT_EQ_INT(JSON_NULL, json_get_type(&v));
+    EXPECT_EQ_INT(JSON_PARSE_ROOT_NOT_SINGULAR, json_parser_parse(&p, &v, "null x"));
+
+    json_set_thread_allocator(NULL);
+    json = make_array(3000, "]");
+    json_set_thread_allocator(&counting);
+    p.shrink_size = 1024;
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parser_parse(&p, &v, json));
+    EXPECT_EQ_SIZE_T(3000, json_get_array_size(&v));
+    EXPECT_EQ_SIZE_T(1024, p.size);
+    json_free(&v);
+    p.shrink_size = 0;
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parser_parse(&p, &v, "[1]"));
+    EXPECT_EQ_SIZE_T(0, p.size);
+    json_free(&v);
+    json_parser_free(&p);
+    EXPECT_EQ_SIZE_T(0, count_live);
+    json_set_thread_allocator(NULL);
+    free(json);
+}
+
+static void test_free() {
+    json_value v, *e;
+    size_t i;
+
+    /* deep enough to overflow the stack if teardown recursed */
+    json_init(&v);
+    for (e = &v, i = 0; i < 1000000; i++) {
+        json_init(e);
+        e->type = JSON_ARRAY;
+        e->json_size = 1;
+        e->json_e = (json_value*)malloc(sizeof(json_value));
+        e = e->json_e;
+    }
+    json_init(e);
+    json_set_string(e, "leaf", 4);
+    json_free(&v);
+    EXPECT_EQ_INT(JSON_NULL, json_get_type(&v));
+
+    json_set_thread_allocator(&counting);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "{\"a\":[1,\"s\",{\"b\":[[],{}]}],\"c\":\"d\"}"));
+    json_free_deferred(&v);
+    EXPECT_EQ_INT(JSON_NULL, json_get_type(&v));
+    for (i = 0; i < 100; i++) {
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "[[1],[2,[3]],{\"k\":\"v\"}]"));
+        json_free_deferred(&v);
+    }
+    json_set_string(&v, "scalar", 6);
+    json_free_deferred(&v);
+    EXPECT_EQ_INT(JSON_NULL, json_get_type(&v));
+    json_free_wait();
+    EXPECT_EQ_SIZE_T(0, count_live);
+    json_set_thread_allocator(NULL);
+}
+
+#define TEST_BINARY_ROUNDTRIP(json)\
+    do {\
+        json_value v, w;\
+        char* bin;\
+        char* json2;\
+        size_t length, blen;\
+        json_init(&v);\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, json));\
+        EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_encode_binary(&v, &bin, &blen));\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_decode_binary(&w, bin, blen));\
+        EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify(&w, &json2, &length));\
+        EXPECT_EQ_STRING(json, json2, length);\
+        json_free(&v);\
+        json_free(&w);\
+        free(bin);\
+        free(json2);\
+    } while(0)
+
+static void test_binary_roundtrip() {
+    TEST_BINARY_ROUNDTRIP("null");
+    TEST_BINARY_ROUNDTRIP("false");
+    TEST_BINARY_ROUNDTRIP("true");
+    TEST_BINARY_ROUNDTRIP("0");
+    TEST_BINARY_ROUNDTRIP("-1.5");
+    TEST_BINARY_ROUNDTRIP("1.0000000000000002");
+    TEST_BINARY_ROUNDTRIP("1.7976931348623157e+308");
+    TEST_BINARY_ROUNDTRIP("\"\"");
+    TEST_BINARY_ROUNDTRIP("\"abc\"");
+    TEST_BINARY_ROUNDTRIP("\"Hello\\u0000World\"");
+    TEST_BINARY_ROUNDTRIP("[]");
+    TEST_BINARY_ROUNDTRIP("{}");
+    TEST_BINARY_ROUNDTRIP("[null,false,true,123,\"abc\",[1,2,3]]");
+    TEST_BINARY_ROUNDTRIP("{\"n\":null,\"f\":false,\"t\":true,\"i\":123,\"s\":\"abc\",\"a\":[1,2,3],\"o\":{\"1\":1,\"2\":2,\"3\":3}}");
+    TEST_BINARY_ROUNDTRIP("[[[[[]]]],{\"\":{}},[{}]]");
+}
+
+static void test_binary_invalid() {
+    json_value v;
+    char* bin;
+    char* copy;
+    char deep[1027];
+    size_t blen, i;
+    int ret;
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_BINARY_INVALID, json_decode_binary(&v, NULL, 0));
+    EXPECT_EQ_INT(JSON_BINARY_INVALID, json_decode_binary(&v, "JPB2\x0c\0\0\0\0\0\0\0", 12));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "{\"a\":[1,\"xy\",{\"b\":[]}],\"c\":null}"));
+    EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_encode_binary(&v, &bin, &blen));
+    json_free(&v);
+
+    /* every truncation is rejected */
+    for (i = 0; i < blen; i++) {
+        copy = (char*)malloc(i + 1);
+        memcpy(copy, bin, i);
+        EXPECT_EQ_INT(JSON_BINARY_INVALID, json_decode_binary(&v, copy, i));
+        EXPECT_EQ_INT(JSON_NULL, json_get_type(&v));
+        free(copy);
+    }
+    /* corrupted bytes are either rejected or still decode to a whole tree */
+    for (i = 0; i < blen; i++) {
+        copy = (char*)malloc(blen);
+        memcpy(copy, bin, blen);
+        copy[i] ^= 0x5a;
+        ret = json_decode_binary(&v, copy, blen);
+        EXPECT_TRUE(ret == JSON_PARSE_OK || ret == JSON_BINARY_INVALID);
+        json_free(&v);
+        free(copy);
+    }
+    free(bin);
+
+    /* nesting is bounded like the MessagePack and CBOR decoders */
+    for (i = 0; i < 513; i++) {
+        deep[i] = '[';
+        deep[1025 - i] = ']';
+    }
+    deep[1025] = '\0';
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, deep + 1));
+    EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_encode_binary(&v, &bin, &blen));
+    json_free(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_decode_binary(&v, bin, blen));
+    json_free(&v);
+    free(bin);
+    deep[1025] = ']';
+    deep[1026] = '\0';
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, deep));
+    EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_encode_binary(&v, &bin, &blen));
+    json_free(&v);
+    EXPECT_EQ_INT(JSON_BINARY_INVALID, json_decode_binary(&v, bin, blen));
+    EXPECT_EQ_INT(JSON_NULL, json_get_type(&v));
+    free(bin);
+}
+
+static void test_binary_view() {
+    json_value v;
+    json_view r, e, k, x;
+    char* bin;
+    size_t blen, len;
+    const char* s;
+
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "{\"n\":null,\"a\":[1.5,\"xy\",{\"b\":true}],\"s\":\"str\"}"));
+    EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_encode_binary(&v, &bin, &blen));
+    json_free(&v);
+
+    EXPECT_EQ_INT(JSON_BINARY_INVALID, json_view_init(&r, bin, blen - 4));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_view_init(&r, bin, blen));
+    EXPECT_EQ_INT(JSON_OBJECT, json_view_get_type(&r));
+    EXPECT_EQ_SIZE_T(3, json_view_get_size(&r));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_view_get_object_member(&r, 2, &k, &e));
+    s = json_view_get_string(&k, &len);
+    EXPECT_EQ_STRING("s", s, len);
+    s = json_view_get_string(&e, &len);
+    EXPECT_EQ_STRING("str", s, len);
+    EXPECT_EQ_INT(JSON_POINTER_NOT_FOUND, json_view_find_object_value(&r, "x", 1, &e));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_view_find_object_value(&r, "n", 1, &e));
+    EXPECT_EQ_INT(JSON_NULL, json_view_get_type(&e));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_view_find_object_value(&r, "a", 1, &e));
+    EXPECT_EQ_INT(JSON_ARRAY, json_view_get_type(&e));
+    EXPECT_EQ_SIZE_T(3, json_view_get_size(&e));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_view_get_array_element(&e, 0, &x));
+    EXPECT_EQ_DOUBLE(1.5, json_view_get_number(&x));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_view_get_array_element(&e, 1, &x));
+    s = json_view_get_string(&x, &len);
+    EXPECT_EQ_STRING("xy", s, len);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_view_get_array_element(&e, 2, &x));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_view_find_object_value(&x, "b", 1, &e));
+    EXPECT_EQ_INT(JSON_TRUE, json_view_get_type(&e));
+    free(bin);
+}
+
+static void test_binary() {
+    test_binary_roundtrip();
+    test_binary_invalid();
+    test_binary_view();
+}
+
+#define TEST_CODEC(encode, decode, json, bytes)\
+    do {\
+        json_value v;\
+        char* out;\
+        size_t length;\
+        json_init(&v);\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, json));\
+        EXPECT_EQ_INT(JSON_STRINGIFY_OK, encode(&v, &out, &length));\
+        EXPECT_EQ_STRING(bytes, out, length);\
+        json_free(&v);\
+        free(out);\
+        TEST_CODEC_DECODE(decode, json, bytes);\
+    } while(0)
+
+#define TEST_CODEC_DECODE(decode, json, bytes)\
+    do {\
+        json_value v;\
+        char* out;\
+        size_t length;\
+        EXPECT_EQ_INT(JSON_PARSE_OK, decode(&v, bytes, sizeof(bytes) - 1));\
+        EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify(&v, &out, &length));\
+        EXPECT_EQ_STRING(json, out, length);\
+        json_free(&v);\
+        free(out);\
+    } while(0)
+
+#define TEST_CODEC_ERROR(decode, error, bytes)\
+    do {\
+        json_value v;\
+        size_t i;\
+        EXPECT_EQ_INT(error, decode(&v, bytes, sizeof(bytes) - 1));\
+        EXPECT_EQ_INT(JSON_NULL, json_get_type(&v));\
+        if (error == JSON_BINARY_INVALID)\
+            for (i = 0; i < sizeof(bytes) - 1; i++)\
+                EXPECT_TRUE(decode(&v, bytes, i) != JSON_PARSE_OK);\
+    } while(0)
+
+#define TEST_CODEC_TRUNCATED(decode, bytes)\
+    do {\
+        json_value v;\
+        size_t i;\
+        for (i = 0; i < sizeof(bytes) - 1; i++) {\
+            EXPECT_EQ_INT(JSON_BINARY_INVALID, decode(&v, bytes, i));\
+            EXPECT_EQ_INT(JSON_NULL, json_get_type(&v));\
+        }\
+    } while(0)
+
+#define TEST_MSGPACK(json, bytes) TEST_CODEC(json_encode_msgpack, json_decode_msgpack, json, bytes)
+#define TEST_CBOR(json, bytes) TEST_CODEC(json_encode_cbor, json_decode_cbor, json, bytes)
+
+static void test_msgpack() {
+    char deep[513];
+    json_value v;
+
+    TEST_MSGPACK("null", "\xc0");
+    TEST_MSGPACK("false", "\xc2");
+    TEST_MSGPACK("true", "\xc3");
+    TEST_MSGPACK("0", "\x00");
+    TEST_MSGPACK("127", "\x7f");
+    TEST_MSGPACK("128", "\xcc\x80");
+    TEST_MSGPACK("256", "\xcd\x01\x00");
+    TEST_MSGPACK("65536", "\xce\x00\x01\x00\x00");
+    TEST_MSGPACK("4294967296", "\xcf\x00\x00\x00\x01\x00\x00\x00\x00");
+    TEST_MSGPACK("-1", "\xff");
+    TEST_MSGPACK("-32", "\xe0");
+    TEST_MSGPACK("-33", "\xd0\xdf");
+    TEST_MSGPACK("-129", "\xd1\xff\x7f");
+    TEST_MSGPACK("-32769", "\xd2\xff\xff\x7f\xff");
+    TEST_MSGPACK("-2147483649", "\xd3\xff\xff\xff\xff\x7f\xff\xff\xff");
+    TEST_MSGPACK("1.5", "\xcb\x3f\xf8\x00\x00\x00\x00\x00\x00");
+    TEST_MSGPACK("-0", "\xcb\x80\x00\x00\x00\x00\x00\x00\x00");
+    TEST_MSGPACK("\"\"", "\xa0");
+    TEST_MSGPACK("\"a\"", "\xa1" "a");
+    TEST_MSGPACK("\"0123456789012345678901234567890123456789\"",
+        "\xd9\x28" "0123456789012345678901234567890123456789");
+    TEST_MSGPACK("[]", "\x90");
+    TEST_MSGPACK("[1,[2,\"x\"]]", "\x92\x01\x92\x02\xa1x");
+    TEST_MSGPACK("{}", "\x80");
+    TEST_MSGPACK("{\"a\":1,\"b\":{\"c\":null}}", "\x82\xa1" "a" "\x01\xa1" "b" "\x81\xa1" "c" "\xc0");
+
+    TEST_CODEC_DECODE(json_decode_msgpack, "1.5", "\xca\x3f\xc0\x00\x00");
+    TEST_CODEC_DECODE(json_decode_msgpack, "300", "\xd1\x01\x2c");
+    TEST_CODEC_DECODE(json_decode_msgpack, "\"ab\"", "\xda\x00\x02" "ab");
+    TEST_CODEC_DECODE(json_decode_msgpack, "[true]", "\xdc\x00\x01\xc3");
+    TEST_CODEC_DECODE(json_decode_msgpack, "{\"k\":[]}", "\xde\x00\x01\xa1k\x90");
+
+    TEST_CODEC_ERROR(json_decode_msgpack, JSON_BINARY_INVALID, "");
+    TEST_CODEC_ERROR(json_decode_msgpack, JSON_BINARY_INVALID, "\xc1");
+    TEST_CODEC_ERROR(json_decode_msgpack, JSON_BINARY_UNSUPPORTED, "\xc4\x01x");
+    TEST_CODEC_ERROR(json_decode_msgpack, JSON_BINARY_UNSUPPORTED, "\xd4\x01\x00");
+    TEST_CODEC_ERROR(json_decode_msgpack, JSON_BINARY_UNSUPPORTED, "\x81\x01\x02");
+    TEST_CODEC_ERROR(json_decode_msgpack, JSON_BINARY_UNSUPPORTED, "\x92\x01\xcb\x7f\xf0\x00\x00\x00\x00\x00\x00");
+    TEST_CODEC_ERROR(json_decode_msgpack, JSON_PARSE_ROOT_NOT_SINGULAR, "\xc0\xc0");
+    TEST_CODEC_TRUNCATED(json_decode_msgpack, "\x82\xa1" "a" "\x92\x01\xcd\x01\x00\xa1" "b" "\xd9\x02xy");
+    TEST_CODEC_TRUNCATED(json_decode_msgpack, "\xdd\x00\x00\x00\x02\xc0\xcb\x3f\xf8\x00\x00\x00\x00\x00\x00");
+
+    /* nesting is limited like JSON_PARSE_DEPTH_LIMIT's */
+    json_init(&v);
+    memset(deep, 0x91, 511);
+    deep[511] = '\x90';
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_decode_msgpack(&v, deep, 512));
+    json_free(&v);
+    memset(deep, 0x91, 512);
+    deep[512] = '\x90';
+    EXPECT_EQ_INT(JSON_BINARY_INVALID, json_decode_msgpack(&v, deep, 513));
+    EXPECT_EQ_INT(JSON_NULL, json_get_type(&v));
+}
+
+static void test_cbor() {
+    char deep[513];
+    json_value v;
+
+    TEST_CBOR("null", "\xf6");
+    TEST_CBOR("false", "\xf4");
+    TEST_CBOR("true", "\xf5");
+    TEST_CBOR("0", "\x00");
+    TEST_CBOR("23", "\x17");
+    TEST_CBOR("24", "\x18\x18");
+    TEST_CBOR("1000", "\x19\x03\xe8");
+    TEST_CBOR("1000000", "\x1a\x00\x0f\x42\x40");
+    TEST_CBOR("1000000000000", "\x1b\x00\x00\x00\xe8\xd4\xa5\x10\x00");
+    TEST_CBOR("-1", "\x20");
+    TEST_CBOR("-1000", "\x39\x03\xe7");
+    TEST_CBOR("1.5", "\xfb\x3f\xf8\x00\x00\x00\x00\x00\x00");
+    TEST_CBOR("-0", "\xfb\x80\x00\x00\x00\x00\x00\x00\x00");
+    TEST_CBOR("\"\"", "\x60");
+    TEST_CBOR("\"IETF\"", "\x64IETF");
+    TEST_CBOR("[]", "\x80");
+    TEST_CBOR("[1,[2,3],[4,5]]", "\x83\x01\x82\x02\x03\x82\x04\x05");
+    TEST_CBOR("{}", "\xa0");
+    TEST_CBOR("{\"a\":1,\"b\":[2,3]}", "\xa2\x61" "a" "\x01\x61" "b" "\x82\x02\x03");
+
+    TEST_CODEC_DECODE(json_decode_cbor, "1", "\xf9\x3c\x00");
+    TEST_CODEC_DECODE(json_decode_cbor, "65504", "\xf9\x7b\xff");
+    TEST_CODEC_DECODE(json_decode_cbor, "5.9604644775390625e-08", "\xf9\x00\x01");
+    TEST_CODEC_DECODE(json_decode_cbor, "-4", "\xf9\xc4\x00");
+    TEST_CODEC_DECODE(json_decode_cbor, "100000", "\xfa\x47\xc3\x50\x00");
+    TEST_CODEC_DECODE(json_decode_cbor, "1363896240", "\xc1\x1a\x51\x4b\x67\xb0");
+    TEST_CODEC_DECODE(json_decode_cbor, "\"streaming\"", "\x7f\x65strea\x64ming\xff");
+    TEST_CODEC_DECODE(json_decode_cbor, "[1,[2,3],[4,5]]", "\x9f\x01\x82\x02\x03\x9f\x04\x05\xff\xff");
+    TEST_CODEC_DECODE(json_decode_cbor, "{\"a\":1,\"b\":[2,3]}", "\xbf\x61" "a" "\x01\x61" "b" "\x9f\x02\x03\xff\xff");
+    TEST_CODEC_DECODE(json_decode_cbor, "[]", "\x9f\xff");
+
+    TEST_CODEC_ERROR(json_decode_cbor, JSON_BINARY_INVALID, "");
+    TEST_CODEC_ERROR(json_decode_cbor, JSON_BINARY_INVALID, "\x1c");
+    TEST_CODEC_ERROR(json_decode_cbor, JSON_BINARY_INVALID, "\xff");
+    TEST_CODEC_ERROR(json_decode_cbor, JSON_BINARY_INVALID, "\x7f\x01\xff");
+    TEST_CODEC_ERROR(json_decode_cbor, JSON_BINARY_UNSUPPORTED, "\x42\x01\x02");
+    TEST_CODEC_ERROR(json_decode_cbor, JSON_BINARY_UNSUPPORTED, "\xf7");
+    TEST_CODEC_ERROR(json_decode_cbor, JSON_BINARY_UNSUPPORTED, "\xf9\x7c\x00");
+    TEST_CODEC_ERROR(json_decode_cbor, JSON_BINARY_UNSUPPORTED, "\xa1\x01\x02");
+    TEST_CODEC_ERROR(json_decode_cbor, JSON_PARSE_ROOT_NOT_SINGULAR, "\xf6\x00");
+    TEST_CODEC_TRUNCATED(json_decode_cbor, "\xa2\x61" "a" "\x83\x01\x19\x03\xe8\xfb\x3f\xf1\x99\x99\x99\x99\x99\x9a\x61" "b" "\x62xy");
+    TEST_CODEC_TRUNCATED(json_decode_cbor, "\xbf\x61" "a" "\x9f\x7f\x61x\xff\xff\xff");
+    /* the largest definite length is not the indefinite one */
+    TEST_CODEC_ERROR(json_decode_cbor, JSON_BINARY_INVALID, "\x9b\xff\xff\xff\xff\xff\xff\xff\xff\xff");
+    TEST_CODEC_ERROR(json_decode_cbor, JSON_BINARY_INVALID, "\xbb\xff\xff\xff\xff\xff\xff\xff\xff\xff");
+
+    json_init(&v);
+    memset(deep, 0x81, 511);
+    deep[511] = '\x80';
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_decode_cbor(&v, deep, 512));
+    json_free(&v);
+    memset(deep, 0x9f, 513);
+    EXPECT_EQ_INT(JSON_BINARY_INVALID, json_decode_cbor(&v, deep, 513));
+    EXPECT_EQ_INT(JSON_NULL, json_get_type(&v));
+}
+
+#define TEST_STRINGIFIED(expect, v)\
+    do {\
+        char* json;\
+        size_t length;\
+        EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify(v, &json, &length));\
+        EXPECT_EQ_STRING(expect, json, length);\
+        json_get_allocator()->free(json_get_allocator()->ud, json);\
+    } while(0)
+
+static void* share_run(void* arg) {
+    const json_value* v = (const json_value*)arg;
+    json_value w;
+    int i;
+
+    json_set_thread_allocator(&counting);
+    json_init(&w);
+    for (i = 0; i < 1000; i++) {
+        json_copy(&w, v);
+        json_copy(&w, json_get_object_value(v, 1));
+    }
+    json_free(&w);
+    return NULL;
+}
+
+static void test_share() {
+    json_value v, w, x;
+    json_pointer p;
+    pthread_t threads[4];
+    size_t calls;
+    int i;
+    const char* doc = "{\"a\":{\"b\":1,\"c\":[true,\"s\"]},\"d\":[{\"e\":null},\"long string\"]}";
+
+    json_set_thread_allocator(&counting);
+    json_init(&v);
+    json_init(&w);
+    json_init(&x);
+
+    /* a private tree is deep-copied */
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, doc));
+    json_copy(&w, &v);
+    EXPECT_TRUE(w.json_m != v.json_m);
+    TEST_STRINGIFIED("{\"a\":{\"b\":1,\"c\":[true,\"s\"]},\"d\":[{\"e\":null},\"long string\"]}", &w);
+
+    /* a shared one is copied by reference */
+    json_share(&v);
+    EXPECT_TRUE(v.flags & JSON_SHARED);
+    calls = count_calls;
+    json_copy(&w, &v);
+    EXPECT_TRUE(count_calls == calls);
+    EXPECT_TRUE(w.json_m == v.json_m);
+    TEST_STRINGIFIED("{\"a\":{\"b\":1,\"c\":[true,\"s\"]},\"d\":[{\"e\":null},\"long string\"]}", &w);
+
+    /* mutation copies only the path to the target */
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_pointer_compile(&p, "/a/b", 4));
+    json_set_number(json_pointer_cow(&p, &w), 2);
+    json_pointer_free(&p);
+    EXPECT_TRUE(w.json_m != v.json_m);
+    EXPECT_TRUE(w.json_m[0].v.json_m != v.json_m[0].v.json_m);
+    EXPECT_TRUE(w.json_m[0].v.json_m[1].v.json_e == v.json_m[0].v.json_m[1].v.json_e);
+    EXPECT_TRUE(w.json_m[1].v.json_e == v.json_m[1].v.json_e);
+    TEST_STRINGIFIED("{\"a\":{\"b\":1,\"c\":[true,\"s\"]},\"d\":[{\"e\":null},\"long string\"]}", &v);
+    TEST_STRINGIFIED("{\"a\":{\"b\":2,\"c\":[true,\"s\"]},\"d\":[{\"e\":null},\"long string\"]}", &w);
+
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_pointer_compile(&p, "/d/1", 4));
+    json_copy(&x, &w);
+    json_set_string(json_pointer_cow(&p, &x), "x", 1);
+    EXPECT_TRUE(json_pointer_cow(&p, &v) != NULL);
+    EXPECT_TRUE(json_pointer_cow(&p, &x) != NULL);
+    json_pointer_free(&p);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_pointer_compile(&p, "/d/5", 4));
+    EXPECT_TRUE(json_pointer_cow(&p, &x) == NULL);
+    json_pointer_free(&p);
+    TEST_STRINGIFIED("{\"a\":{\"b\":2,\"c\":[true,\"s\"]},\"d\":[{\"e\":null},\"x\"]}", &x);
+    TEST_STRINGIFIED("{\"a\":{\"b\":2,\"c\":[true,\"s\"]},\"d\":[{\"e\":null},\"long string\"]}", &w);
+
+    /* the original can go first */
+    json_free(&v);
+    TEST_STRINGIFIED("{\"a\":{\"b\":2,\"c\":[true,\"s\"]},\"d\":[{\"e\":null},\"long string\"]}", &w);
+    json_unshare(&w);
+    json_free(&w);
+    json_free(&x);
+    EXPECT_EQ_SIZE_T(0, count_live);
+
+    /* the lookup index of a large shared object keeps first-match semantics */
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "{\"d\":1,\"a\":0,\"b\":0,\"c\":0,\"e\":0,\"f\":0,\"g\":0,"
+        "\"h\":0,\"i\":0,\"j\":0,\"k\":0,\"l\":0,\"m\":0,\"n\":0,\"o\":0,\"p\":0,\"d\":2}"));
+    json_share(&v);
+    EXPECT_EQ_SIZE_T(0, json_find_object_index(&v, "d", 1));
+    EXPECT_EQ_SIZE_T(15, json_find_object_index(&v, "p", 1));
+    EXPECT_EQ_SIZE_T(JSON_KEY_NOT_EXIST, json_find_object_index(&v, "q", 1));
+    json_free(&v);
+    EXPECT_EQ_SIZE_T(0, count_live);
+
+    /* concurrent copies and frees of one shared tree */
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, doc));
+    json_share(&v);
+    for (i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, share_run, &v);
+    for (i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    TEST_STRINGIFIED("{\"a\":{\"b\":1,\"c\":[true,\"s\"]},\"d\":[{\"e\":null},\"long string\"]}", &v);
+    json_free(&v);
+    EXPECT_EQ_SIZE_T(0, count_live);
+    json_set_thread_allocator(NULL);
+}
+
+#define TEST_MERGE_PATCH(expect, target, patch)\
+    do {\
+        json_value v, p;\
+        json_init(&v);\
+        json_init(&p);\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, target));\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&p, patch));\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_merge_patch(&v, &p));\
+        TEST_STRINGIFIED(expect, &v);\
+        json_free(&v);\
+        json_free(&p);\
+    } while(0)
+
+static void test_merge_patch() {
+    json_value v, w, p;
+
+    json_set_thread_allocator(&counting);
+    /* RFC 7386 appendix A */
+    TEST_MERGE_PATCH("{\"a\":\"c\"}", "{\"a\":\"b\"}", "{\"a\":\"c\"}");
+    TEST_MERGE_PATCH("{\"a\":\"b\",\"b\":\"c\"}", "{\"a\":\"b\"}", "{\"b\":\"c\"}");
+    TEST_MERGE_PATCH("{}", "{\"a\":\"b\"}", "{\"a\":null}");
+    TEST_MERGE_PATCH("{\"b\":\"c\"}", "{\"a\":\"b\",\"b\":\"c\"}", "{\"a\":null}");
+    TEST_MERGE_PATCH("{\"a\":\"c\"}", "{\"a\":[\"b\"]}", "{\"a\":\"c\"}");
+    TEST_MERGE_PATCH("{\"a\":[\"b\"]}", "{\"a\":\"c\"}", "{\"a\":[\"b\"]}");
+    TEST_MERGE_PATCH("{\"a\":{\"b\":\"d\"}}", "{\"a\":{\"b\":\"c\"}}", "{\"a\":{\"b\":\"d\",\"c\":null}}");
+    TEST_MERGE_PATCH("{\"a\":[1]}", "{\"a\":[{\"b\":\"c\"}]}", "{\"a\":[1]}");
+    TEST_MERGE_PATCH("[\"c\",\"d\"]", "[\"a\",\"b\"]", "[\"c\",\"d\"]");
+    TEST_MERGE_PATCH("[\"a\"]", "{\"a\":\"b\"}", "[\"a\"]");
+    TEST_MERGE_PATCH("\"a\"", "{\"a\":\"foo\"}", "\"a\"");
+    TEST_MERGE_PATCH("null", "{\"a\":\"foo\"}", "null");
+    TEST_MERGE_PATCH("\"bar\"", "{\"a\":\"foo\"}", "\"bar\"");
+    TEST_MERGE_PATCH("{\"e\":null,\"a\":1}", "{\"e\":null}", "{\"a\":1}");
+    TEST_MERGE_PATCH("{\"a\":{\"bb\":{}}}", "[1,2]", "{\"a\":{\"bb\":{\"ccc\":null}}}");
+    TEST_MERGE_PATCH("{\"a\":{\"bb\":{}}}", "{}", "{\"a\":{\"bb\":{\"ccc\":null}}}");
+    TEST_MERGE_PATCH("{\"a\":{\"bb\":{}}}", "{\"a\":{}}", "{\"a\":{\"bb\":{\"ccc\":null}}}");
+    EXPECT_EQ_SIZE_T(0, count_live);
+
+    /* a shared target is copied only along the changed path */
+    json_init(&v);
+    json_init(&w);
+    json_init(&p);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "{\"a\":{\"b\":1},\"c\":[true]}"));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&p, "{\"a\":{\"b\":2}}"));
+    json_share(&v);
+    json_copy(&w, &v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_merge_patch(&w, &p));
+    TEST_STRINGIFIED("{\"a\":{\"b\":1},\"c\":[true]}", &v);
+    TEST_STRINGIFIED("{\"a\":{\"b\":2},\"c\":[true]}", &w);
+    EXPECT_TRUE(w.json_m[1].v.json_e == v.json_m[1].v.json_e);
+    json_free(&v);
+    json_free(&w);
+    json_free(&p);
+    EXPECT_EQ_SIZE_T(0, count_live);
+    json_set_thread_allocator(NULL);
+}
+
+#define TEST_PATCH(error, expect, doc, patch)\
+    do {\
+        json_value v, p;\
+        json_init(&v);\
+        json_init(&p);\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, doc));\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&p, patch));\
+        EXPECT_EQ_INT(error, json_patch(&v, &p));\
+        TEST_STRINGIFIED(expect, &v);\
+        json_free(&v);\
+        json_free(&p);\
+    } while(0)
+
+/* A failing patch must leave the document exactly as it was. */
+#define TEST_PATCH_ERROR(error, doc, patch) TEST_PATCH(error, doc, doc, patch)
+
+static void test_json_patch() {
+    json_value v, w, p;
+    size_t i, len, calls;
+    char* json;
+
+    json_set_thread_allocator(&counting);
+    /* RFC 6902 appendix A */
+    TEST_PATCH(JSON_PARSE_OK, "{\"foo\":\"bar\",\"baz\":\"qux\"}",
+        "{\"foo\":\"bar\"}", "[{\"op\":\"add\",\"path\":\"/baz\",\"value\":\"qux\"}]");
+    TEST_PATCH(JSON_PARSE_OK, "{\"foo\":[\"bar\",\"qux\",\"baz\"]}",
+        "{\"foo\":[\"bar\",\"baz\"]}", "[{\"op\":\"add\",\"path\":\"/foo/1\",\"value\":\"qux\"}]");
+    TEST_PATCH(JSON_PARSE_OK, "{\"foo\":\"bar\"}",
+        "{\"baz\":\"qux\",\"foo\":\"bar\"}", "[{\"op\":\"remove\",\"path\":\"/baz\"}]");
+    TEST_PATCH(JSON_PARSE_OK, "{\"foo\":[\"bar\",\"baz\"]}",
+        "{\"foo\":[\"bar\",\"qux\",\"baz\"]}", "[{\"op\":\"remove\",\"path\":\"/foo/1\"}]");
+    TEST_PATCH(JSON_PARSE_OK, "{\"baz\":\"boo\",\"foo\":\"bar\"}",
+        "{\"baz\":\"qux\",\"foo\":\"bar\"}", "[{\"op\":\"replace\",\"path\":\"/baz\",\"value\":\"boo\"}]");
+    TEST_PATCH(JSON_PARSE_OK, "{\"foo\":{\"bar\":\"baz\"},\"qux\":{\"corge\":\"grault\",\"thud\":\"fred\"}}",
+        "{\"foo\":{\"bar\":\"baz\",\"waldo\":\"fred\"},\"qux\":{\"corge\":\"grault\"}}",
+        "[{\"op\":\"move\",\"from\":\"/foo/waldo\",\"path\":\"/qux/thud\"}]");
+    TEST_PATCH(JSON_PARSE_OK, "{\"foo\":[\"all\",\"cows\",\"eat\",\"grass\"]}",
+        "{\"foo\":[\"all\",\"grass\",\"cows\",\"eat\"]}", "[{\"op\":\"move\",\"from\":\"/foo/1\",\"path\":\"/foo/3\"}]");
+    TEST_PATCH(JSON_PARSE_OK, "{\"baz\":\"qux\",\"foo\":[\"a\",2,\"c\"]}",
+        "{\"baz\":\"qux\",\"foo\":[\"a\",2,\"c\"]}",
+        "[{\"op\":\"test\",\"path\":\"/baz\",\"value\":\"qux\"},{\"op\":\"test\",\"path\":\"/foo/1\",\"value\":2}]");
+    TEST_PATCH_ERROR(JSON_PATCH_TEST_FAILED, "{\"baz\":\"qux\"}",
+        "[{\"op\":\"test\",\"path\":\"/baz\",\"value\":\"bar\"}]");
+    TEST_PATCH(JSON_PARSE_OK, "{\"foo\":\"bar\",\"child\":{\"grandchild\":{}}}",
+        "{\"foo\":\"bar\"}", "[{\"op\":\"add\",\"path\":\"/child\",\"value\":{\"grandchild\":{}}}]");
+    TEST_PATCH(JSON_PARSE_OK, "{\"foo\":\"bar\",\"baz\":\"qux\"}",
+        "{\"foo\":\"bar\"}", "[{\"op\":\"add\",\"path\":\"/baz\",\"value\":\"qux\",\"xyz\":123}]");
+    TEST_PATCH_ERROR(JSON_POINTER_NOT_FOUND, "{\"foo\":\"bar\"}",
+        "[{\"op\":\"add\",\"path\":\"/baz/bat\",\"value\":\"qux\"}]");
+    TEST_PATCH(JSON_PARSE_OK, "{\"\\/\":9,\"~1\":10}",
+        "{\"\\/\":9,\"~1\":10}", "[{\"op\":\"test\",\"path\":\"/~01\",\"value\":10}]");
+    TEST_PATCH_ERROR(JSON_PATCH_TEST_FAILED, "{\"\\/\":9,\"~1\":10}",
+        "[{\"op\":\"test\",\"path\":\"/~01\",\"value\":\"10\"}]");
+    TEST_PATCH(JSON_PARSE_OK, "{\"foo\":[\"bar\",[\"abc\",\"def\"]]}",
+        "{\"foo\":[\"bar\"]}", "[{\"op\":\"add\",\"path\":\"/foo/-\",\"value\":[\"abc\",\"def\"]}]");
+
+    /* copy, root targets and deep equality */
+    TEST_PATCH(JSON_PARSE_OK, "{\"a\":{\"b\":[1]},\"c\":{\"b\":[1]}}",
+        "{\"a\":{\"b\":[1]}}", "[{\"op\":\"copy\",\"from\":\"/a\",\"path\":\"/c\"}]");
+    TEST_PATCH(JSON_PARSE_OK, "[1,2]",
+        "{\"a\":{\"b\":[1]}}", "[{\"op\":\"replace\",\"path\":\"\",\"value\":[1,2]}]");
+    TEST_PATCH(JSON_PARSE_OK, "[1]",
+        "{\"a\":{\"b\":[1]}}", "[{\"op\":\"move\",\"from\":\"/a/b\",\"path\":\"\"}]");
+    TEST_PATCH(JSON_PARSE_OK, "{\"a\":1}",
+        "{\"a\":1}", "[{\"op\":\"move\",\"from\":\"/a\",\"path\":\"/a\"}]");
+    TEST_PATCH(JSON_PARSE_OK, "{\"a\":{\"x\":[1,{}],\"y\":null}}",
+        "{\"a\":{\"x\":[1,{}],\"y\":null}}",
+        "[{\"op\":\"test\",\"path\":\"\",\"value\":{\"a\":{\"y\":null,\"x\":[1,{}]}}}]");
+
+    TEST_PATCH(JSON_PARSE_OK, "{\"a\":1,\"b\":2,\"a\":3}",
+        "{\"a\":1,\"b\":2,\"a\":3}", "[{\"op\":\"test\",\"path\":\"\",\"value\":{\"a\":1,\"b\":2,\"a\":3}}]");
+
+    /* malformed operations */
+    TEST_PATCH_ERROR(JSON_PATCH_INVALID, "{\"a\":1}", "{\"op\":\"remove\",\"path\":\"/a\"}");
+    TEST_PATCH_ERROR(JSON_PATCH_INVALID, "{\"a\":1}", "[{\"op\":\"frob\",\"path\":\"/a\"}]");
+    TEST_PATCH_ERROR(JSON_PATCH_INVALID, "{\"a\":1}", "[{\"path\":\"/a\"}]");
+    TEST_PATCH_ERROR(JSON_PATCH_INVALID, "{\"a\":1}", "[{\"op\":\"add\",\"path\":\"/b\"}]");
+    TEST_PATCH_ERROR(JSON_PATCH_INVALID, "{\"a\":1}", "[{\"op\":\"move\",\"path\":\"/b\"}]");
+    TEST_PATCH_ERROR(JSON_PATCH_INVALID, "{\"a\":{}}", "[{\"op\":\"move\",\"from\":\"/a\",\"path\":\"/a/b\"}]");
+    TEST_PATCH_ERROR(JSON_PATCH_INVALID, "{\"a\":1}", "[{\"op\":\"remove\",\"path\":\"\"}]");
+    TEST_PATCH_ERROR(JSON_POINTER_INVALID, "{\"a\":1}", "[{\"op\":\"remove\",\"path\":\"a\"}]");
+    TEST_PATCH_ERROR(JSON_POINTER_NOT_FOUND, "[1]", "[{\"op\":\"replace\",\"path\":\"/1\",\"value\":0}]");
+    TEST_PATCH_ERROR(JSON_POINTER_NOT_FOUND, "[1]", "[{\"op\":\"add\",\"path\":\"/2\",\"value\":0}]");
+    TEST_PATCH_ERROR(JSON_POINTER_NOT_FOUND, "[1]", "[{\"op\":\"remove\",\"path\":\"/-\"}]");
+    TEST_PATCH_ERROR(JSON_POINTER_NOT_FOUND, "{\"a\":1}", "[{\"op\":\"test\",\"path\":\"/b\",\"value\":1}]");
+
+    /* every applied operation is rolled back when a later one fails */
+    TEST_PATCH_ERROR(JSON_PATCH_TEST_FAILED, "{\"a\":[1,2,{\"b\":\"c\"}],\"d\":{\"e\":true}}",
+        "[{\"op\":\"add\",\"path\":\"/a/0\",\"value\":0},"
+        "{\"op\":\"remove\",\"path\":\"/a/3/b\"},"
+        "{\"op\":\"replace\",\"path\":\"/d/e\",\"value\":false},"
+        "{\"op\":\"add\",\"path\":\"/f\",\"value\":{\"g\":[]}},"
+        "{\"op\":\"move\",\"from\":\"/d\",\"path\":\"/f/g/0\"},"
+        "{\"op\":\"copy\",\"from\":\"/f\",\"path\":\"/a/-\"},"
+        "{\"op\":\"remove\",\"path\":\"/a/1\"},"
+        "{\"op\":\"move\",\"from\":\"/a\",\"path\":\"\"},"
+        "{\"op\":\"test\",\"path\":\"/0\",\"value\":1}]");
+    TEST_PATCH_ERROR(JSON_POINTER_NOT_FOUND, "{\"a\":[1,2],\"b\":{}}",
+        "[{\"op\":\"move\",\"from\":\"/a/0\",\"path\":\"/b/x\"},"
+        "{\"op\":\"move\",\"from\":\"/a\",\"path\":\"/c/d\"}]");
+    TEST_PATCH_ERROR(JSON_POINTER_NOT_FOUND, "{\"a\":1}",
+        "[{\"op\":\"replace\",\"path\":\"\",\"value\":[]},"
+        "{\"op\":\"remove\",\"path\":\"/a\"}]");
+    EXPECT_EQ_SIZE_T(0, count_live);
+
+    /* duplicate keys pair up one to one, whichever side has them */
+    TEST_PATCH_ERROR(JSON_PATCH_TEST_FAILED, "{\"x\":{\"a\":1,\"a\":1}}",
+        "[{\"op\":\"test\",\"path\":\"/x\",\"value\":{\"a\":1,\"b\":1}}]");
+    TEST_PATCH_ERROR(JSON_PATCH_TEST_FAILED, "{\"x\":{\"a\":1,\"b\":1}}",
+        "[{\"op\":\"test\",\"path\":\"/x\",\"value\":{\"a\":1,\"a\":1}}]");
+    TEST_PATCH_ERROR(JSON_PARSE_OK, "{\"x\":{\"b\":0,\"a\":1,\"a\":[2]}}",
+        "[{\"op\":\"test\",\"path\":\"/x\",\"value\":{\"a\":[2],\"b\":0,\"a\":1}}]");
+    TEST_PATCH_ERROR(JSON_PATCH_TEST_FAILED, "{\"x\":{\"a\":1,\"a\":2}}",
+        "[{\"op\":\"test\",\"path\":\"/x\",\"value\":{\"a\":2,\"a\":2}}]");
+    TEST_PATCH_ERROR(JSON_PATCH_TEST_FAILED, "{\"x\":{\"a\":2,\"a\":2}}",
+        "[{\"op\":\"test\",\"path\":\"/x\",\"value\":{\"a\":1,\"a\":2}}]");
+
+    /* adds to one container grow it geometrically: beyond the pointer
+     * compiles that 1000 tests also make, only a few reallocs */
+    json = malloc(1000 * 48 + 8);
+    json_init(&v);
+    json_init(&p);
+    for (i = 0, len = sprintf(json, "["); i < 1000; i++)
+        len += sprintf(json + len, "%s{\"op\":\"test\",\"path\":\"/0\",\"value\":0}", i > 0 ? "," : "");
+    strcpy(json + len, "]");
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "[0]"));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&p, json));
+    calls = count_calls;
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_patch(&v, &p));
+    calls = count_calls - calls;
+    json_free(&p);
+    for (i = 0, len = sprintf(json, "["); i < 1000; i++)
+        len += sprintf(json + len, "%s{\"op\":\"add\",\"path\":\"/-\",\"value\":%zu}", i > 0 ? "," : "", i + 1);
+    strcpy(json + len, "]");
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&p, json));
+    calls = count_calls + calls;
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_patch(&v, &p));
+    EXPECT_TRUE(count_calls - calls < 64);
+    EXPECT_EQ_SIZE_T(1001, json_get_array_size(&v));
+    EXPECT_EQ_DOUBLE(1000.0, json_get_number(json_get_array_element(&v, 1000)));
+    json_share(&v);
+    EXPECT_EQ_INT(JSON_SHARED, v.flags);
+    json_free(&v);
+    json_free(&p);
+    free(json);
+    EXPECT_EQ_SIZE_T(0, count_live);
+
+    /* patching a copy of a shared tree leaves the original alone */
+    json_init(&v);
+    json_init(&w);
+    json_init(&p);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "{\"a\":{\"b\":[1,2]},\"c\":[true]}"));
+    json_share(&v);
+    json_copy(&w, &v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&p, "[{\"op\":\"remove\",\"path\":\"/a/b/0\"}]"));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_patch(&w, &p));
+    TEST_STRINGIFIED("{\"a\":{\"b\":[1,2]},\"c\":[true]}", &v);
+    TEST_STRINGIFIED("{\"a\":{\"b\":[2]},\"c\":[true]}", &w);
+    EXPECT_TRUE(w.json_m[1].v.json_e == v.json_m[1].v.json_e);
+    json_free(&p);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&p, "[{\"op\":\"remove\",\"path\":\"/c/0\"},{\"op\":\"test\",\"path\":\"/x\",\"value\":1}]"));
+    EXPECT_EQ_INT(JSON_POINTER_NOT_FOUND, json_patch(&w, &p));
+    TEST_STRINGIFIED("{\"a\":{\"b\":[2]},\"c\":[true]}", &w);
+    EXPECT_TRUE(w.json_m[1].v.json_e == v.json_m[1].v.json_e);
+    /* a failed patch shares again what it unshared */
+    json_copy(&w, &v);
+    json_free(&p);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&p, "[{\"op\":\"add\",\"path\":\"/a/b/-\",\"value\":3},"
+        "{\"op\":\"move\",\"from\":\"/c/0\",\"path\":\"/a/x\"},{\"op\":\"remove\",\"path\":\"/x\"}]"));
+    EXPECT_EQ_INT(JSON_POINTER_NOT_FOUND, json_patch(&w, &p));
+    EXPECT_TRUE((w.flags & JSON_SHARED) && w.json_m == v.json_m);
+    TEST_STRINGIFIED("{\"a\":{\"b\":[1,2]},\"c\":[true]}", &w);
+    json_free(&v);
+    json_free(&w);
+    json_free(&p);
+    EXPECT_EQ_SIZE_T(0, count_live);
+    json_set_thread_allocator(NULL);
+}
+
+typedef struct {
+    double x, y;
+} point;
+
+typedef struct {
+    int id;
+    long long big;
+    int ok;
+    char* name;
+    point origin;
+    json_field_array tags;
+    json_field_array points;
+    json_field_array sizes;
+} shape;
+
+static const json_field point_fields[] = {
+    { "x", offsetof(point, x), JSON_FIELD_DOUBLE },
+    { "y", offsetof(point, y), JSON_FIELD_DOUBLE },
+};
+
+static json_schema point_schema;
+static const json_field shape_fields[] = {
+    { "id",     offsetof(shape, id),     JSON_FIELD_INT },
+    { "big",    offsetof(shape, big),    JSON_FIELD_INT64 },
+    { "ok",     offsetof(shape, ok),     JSON_FIELD_BOOL },
+    { "name",   offsetof(shape, name),   JSON_FIELD_STRING },
+    { "origin", offsetof(shape, origin), JSON_FIELD_OBJECT, 0, &point_schema },
+    { "tags",   offsetof(shape, tags),   JSON_FIELD_ARRAY, JSON_FIELD_STRING },
+    { "points", offsetof(shape, points), JSON_FIELD_ARRAY, JSON_FIELD_OBJECT, &point_schema },
+    { "sizes",  offsetof(shape, sizes),  JSON_FIELD_ARRAY, JSON_FIELD_INT },
+};
+
+/* Integers are read exactly, not through a double. */
+#define TEST_DECODE_INTEGER(expect_id, expect_big, json)\
+    do {\
+        shape sh;\
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_decode_struct(&sh, json, &schema));\
+        EXPECT_EQ_INT(expect_id, sh.id);\
+        EXPECT_TRUE(sh.big == (expect_big));\
+        json_free_struct(&sh, &schema);\
+    } while(0)
+
+#define TEST_DECODE_ERROR(error, json)\
+    do {\
+        shape sh;\
+        EXPECT_EQ_INT(error, json_decode_struct(&sh, json, &schema));\
+        EXPECT_TRUE(sh.name == NULL && sh.tags.e == NULL && sh.tags.size == 0);\
+    } while(0)
+
+static void test_decode_struct() {
+    json_schema schema, bad;
+    json_field bad_fields[2];
+    shape sh;
+    point* pt;
+
+    json_set_thread_allocator(&counting);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_schema_compile(&point_schema, point_fields, 2, sizeof(point)));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_schema_compile(&schema, shape_fields, 8, sizeof(shape)));
+
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_decode_struct(&sh,
+        " { \"id\" : 7, \"big\": -9007199254740993, \"ok\": true, \"name\": \"tri\\u0061ngle\","
+        " \"unknown\": {\"a\": [1, {\"id\": 1}]}, \"origin\": {\"y\": 2.5, \"x\": -1, \"z\": null},"
+        " \"tags\": [\"a\", \"b\\n\"], \"points\": [{\"x\": 1}, null, {\"y\": 3}], \"sizes\": [], \"n\\u0061me2\": 0 } ", &schema));
+    EXPECT_EQ_INT(7, sh.id);
+    EXPECT_TRUE(sh.big == -9007199254740993LL);
+    EXPECT_EQ_INT(1, sh.ok);
+    EXPECT_EQ_STRING("triangle", sh.name, strlen(sh.name));
+    EXPECT_EQ_DOUBLE(-1.0, sh.origin.x);
+    EXPECT_EQ_DOUBLE(2.5, sh.origin.y);
+    EXPECT_EQ_SIZE_T(2, sh.tags.size);
+    EXPECT_EQ_STRING("b\n", ((char**)sh.tags.e)[1], 2);
+    EXPECT_EQ_SIZE_T(3, sh.points.size);
+    pt = (point*)sh.points.e;
+    EXPECT_EQ_DOUBLE(1.0, pt[0].x);
+    EXPECT_EQ_DOUBLE(0.0, pt[1].x);
+    EXPECT_EQ_DOUBLE(3.0, pt[2].y);
+    EXPECT_EQ_SIZE_T(0, sh.sizes.size);
+    json_free_struct(&sh, &schema);
+    EXPECT_TRUE(sh.name == NULL && sh.points.e == NULL);
+
+    /* absent and null members stay zero; repeated ones are replaced */
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_decode_struct(&sh,
+        "{\"name\":\"a\",\"name\":\"b\",\"\\u006eame\":null,\"tags\":[\"x\"],\"tags\":[\"y\",\"z\"],\"sizes\":[1,-2,3]}", &schema));
+    EXPECT_EQ_INT(0, sh.id);
+    EXPECT_EQ_STRING("b", sh.name, 1);
+    EXPECT_EQ_SIZE_T(2, sh.tags.size);
+    EXPECT_EQ_STRING("y", ((char**)sh.tags.e)[0], 1);
+    EXPECT_EQ_INT(-2, ((int*)sh.sizes.e)[1]);
+    json_free_struct(&sh, &schema);
+
+    TEST_DECODE_INTEGER(0, 9007199254740993LL, "{\"big\":9007199254740993}");
+    TEST_DECODE_INTEGER(0, 9223372036854775807LL, "{\"big\":9223372036854775807}");
+    TEST_DECODE_INTEGER(0, -9223372036854775807LL - 1, "{\"big\":-9223372036854775808}");
+    TEST_DECODE_INTEGER(-2147483647 - 1, 9223372036854775807LL,
+        "{\"id\":-2147483648,\"big\":922337203685477580.70e1}");
+    TEST_DECODE_INTEGER(1200, 0, "{\"id\":1200.00,\"big\":-0.0e7}");
+    TEST_DECODE_INTEGER(125, 9007199254740993LL, "{\"id\":12.50e1,\"big\":9007199254740993000e-3}");
+    TEST_DECODE_ERROR(JSON_DECODE_TYPE_MISMATCH, "{\"name\":\"a\",\"id\":\"7\"}");
+    TEST_DECODE_ERROR(JSON_DECODE_TYPE_MISMATCH, "{\"name\":\"a\",\"id\":1.5}");
+    TEST_DECODE_ERROR(JSON_DECODE_TYPE_MISMATCH, "{\"name\":\"a\",\"id\":3e10}");
+    TEST_DECODE_ERROR(JSON_DECODE_TYPE_MISMATCH, "{\"name\":\"a\",\"big\":1e19}");
+    TEST_DECODE_ERROR(JSON_DECODE_TYPE_MISMATCH, "{\"name\":\"a\",\"big\":9223372036854775808}");
+    TEST_DECODE_ERROR(JSON_DECODE_TYPE_MISMATCH, "{\"name\":\"a\",\"big\":-9223372036854775809}");
+    TEST_DECODE_ERROR(JSON_DECODE_TYPE_MISMATCH, "{\"name\":\"a\",\"big\":9007199254740993.5}");
+    TEST_DECODE_ERROR(JSON_DECODE_TYPE_MISMATCH, "{\"name\":\"a\",\"id\":2147483648}");
+    TEST_DECODE_ERROR(JSON_DECODE_TYPE_MISMATCH, "{\"name\":\"a\",\"id\":1e-400}");
+    TEST_DECODE_ERROR(JSON_DECODE_TYPE_MISMATCH, "{\"name\":\"a\",\"ok\":1}");
+    TEST_DECODE_ERROR(JSON_DECODE_TYPE_MISMATCH, "{\"name\":1}");
+    TEST_DECODE_ERROR(JSON_DECODE_TYPE_MISMATCH, "{\"name\":\"a\",\"origin\":[]}");
+    TEST_DECODE_ERROR(JSON_DECODE_TYPE_MISMATCH, "{\"tags\":[\"a\",\"b\",3]}");
+    TEST_DECODE_ERROR(JSON_DECODE_TYPE_MISMATCH, "{\"tags\":\"a\"}");
+    TEST_DECODE_ERROR(JSON_DECODE_TYPE_MISMATCH, "[{\"id\":1}]");
+    TEST_DECODE_ERROR(JSON_DECODE_TYPE_MISMATCH, "null");
+    TEST_DECODE_ERROR(JSON_PARSE_EXPECT_VALUE, " ");
+    TEST_DECODE_ERROR(JSON_PARSE_MISS_COLON, "{\"name\":\"a\",\"id\" 1}");
+    TEST_DECODE_ERROR(JSON_PARSE_MISS_KEY, "{\"name\":\"a\",1:1}");
+    TEST_DECODE_ERROR(JSON_PARSE_MISS_COMMA_OR_CURLY_BRACKET, "{\"name\":\"a\" \"id\":1}");
+    TEST_DECODE_ERROR(JSON_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "{\"tags\":[\"a\" \"b\"]}");
+    TEST_DECODE_ERROR(JSON_PARSE_INVALID_VALUE, "{\"name\":\"a\",\"other\":[1,]}");
+    TEST_DECODE_ERROR(JSON_PARSE_INVALID_STRING_ESCAPE, "{\"tags\":[\"a\",\"\\x\"]}");
+    TEST_DECODE_ERROR(JSON_PARSE_ROOT_NOT_SINGULAR, "{\"name\":\"a\"} x");
+    EXPECT_EQ_SIZE_T(6, count_live);
+
+    /* malformed field tables */
+    bad_fields[0] = shape_fields[0];
+    bad_fields[1] = shape_fields[0];
+    EXPECT_EQ_INT(JSON_SCHEMA_INVALID, json_schema_compile(&bad, bad_fields, 2, sizeof(shape)));
+    bad_fields[1] = shape_fields[4];
+    bad_fields[1].schema = NULL;
+    EXPECT_EQ_INT(JSON_SCHEMA_INVALID, json_schema_compile(&bad, bad_fields, 2, sizeof(shape)));
+    bad_fields[1] = shape_fields[5];
+    bad_fields[1].item = JSON_FIELD_ARRAY;
+    EXPECT_EQ_INT(JSON_SCHEMA_INVALID, json_schema_compile(&bad, bad_fields, 2, sizeof(shape)));
+    EXPECT_EQ_INT(JSON_SCHEMA_INVALID, json_schema_compile(&bad, point_fields, 2, sizeof(double)));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_schema_compile(&bad, NULL, 0, 0));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_decode_struct(&sh, "{\"a\":1}", &bad));
+    json_schema_free(&bad);
+
+    json_schema_free(&schema);
+    json_schema_free(&point_schema);
+    EXPECT_EQ_SIZE_T(0, count_live);
+    json_set_thread_allocator(NULL);
+}
+
+static void test_encode_struct() {
+    json_schema schema, quoted;
+    static const json_field quoted_fields[] = {
+        { "a\"b/\xc3\xa9", 0, JSON_FIELD_STRING },
+    };
+    const char* text;
+    char* tags[2] = { "x", "\"y\"\n" };
+    point points[2] = { { 1, -2.5 }, { 0, 1e300 } };
+    int sizes[3] = { 0, -1, 2147483647 };
+    shape sh, back;
+    char* json;
+    size_t length, calls;
+
+    json_set_thread_allocator(&counting);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_schema_compile(&point_schema, point_fields, 2, sizeof(point)));
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_schema_compile(&schema, shape_fields, 8, sizeof(shape)));
+
+    memset(&sh, 0, sizeof(sh));
+    EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_encode_struct(&sh, &schema, &json, &length));
+    EXPECT_EQ_STRING("{\"id\":0,\"big\":0,\"ok\":false,\"name\":null,\"origin\":{\"x\":0,\"y\":0},"
+        "\"tags\":[],\"points\":[],\"sizes\":[]}", json, length);
+    json_get_allocator()->free(json_get_allocator()->ud, json);
+
+    sh.id = -7;
+    sh.big = -9007199254740991LL;
+    sh.ok = 1;
+    sh.name = "tab\there";
+    sh.origin.x = 0.5;
+    sh.tags.e = tags;
+    sh.tags.size = 2;
+    sh.points.e = points;
+    sh.points.size = 2;
+    sh.sizes.e = sizes;
+    sh.sizes.size = 3;
+    calls = count_calls;
+    EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_encode_struct(&sh, &schema, &json, &length));
+    EXPECT_EQ_STRING("{\"id\":-7,\"big\":-9007199254740991,\"ok\":true,\"name\":\"tab\\there\",\"origin\":{\"x\":0.5,\"y\":0},"
+        "\"tags\":[\"x\",\"\\\"y\\\"\\n\"],\"points\":[{\"x\":1,\"y\":-2.5},{\"x\":0,\"y\":1.0000000000000001e+300}],"
+        "\"sizes\":[0,-1,2147483647]}", json, length);
+    /* one buffer, grown in place: no per-field or per-key allocation */
+    EXPECT_TRUE(count_calls - calls <= 2);
+
+    /* decoding the output gives the struct back */
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_decode_struct(&back, json, &schema));
+    json_get_allocator()->free(json_get_allocator()->ud, json);
+    EXPECT_TRUE(back.big == sh.big);
+    EXPECT_EQ_STRING("tab\there", back.name, strlen(back.name));
+    EXPECT_EQ_STRING("\"y\"\n", ((char**)back.tags.e)[1], 4);
+    EXPECT_EQ_DOUBLE(1e300, ((point*)back.points.e)[1].y);
+    EXPECT_EQ_INT(2147483647, ((int*)back.sizes.e)[2]);
+    json_free_struct(&back, &schema);
+
+    /* NaN and infinities have no JSON form */
+    sh.origin.x = NAN;
+    json = "";
+    EXPECT_EQ_INT(JSON_STRINGIFY_NUMBER_INVALID, json_encode_struct(&sh, &schema, &json, &length));
+    EXPECT_TRUE(json == NULL);
+    sh.origin.x = 0.5;
+    points[1].y = -INFINITY;
+    EXPECT_EQ_INT(JSON_STRINGIFY_NUMBER_INVALID, json_encode_struct(&sh, &schema, &json, &length));
+    EXPECT_TRUE(json == NULL);
+    points[1].y = 1e300;
+
+    /* keys are escaped like json_stringify escapes them */
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_schema_compile(&quoted, quoted_fields, 1, sizeof(char*)));
+    text = "\xc3\xa9";
+    EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_encode_struct(&text, &quoted, &json, &length));
+    EXPECT_EQ_STRING("{\"a\\\"b\\/\\u00E9\":\"\\u00E9\"}", json, length);
+    json_get_allocator()->free(json_get_allocator()->ud, json);
+    json_schema_free(&quoted);
+
+    json_schema_free(&schema);
+    json_schema_free(&point_schema);
+    EXPECT_EQ_SIZE_T(0, count_live);
+    json_set_thread_allocator(NULL);
+}
+
+#define READERS 8
+
+typedef struct {
+    const json_value* v;
+    const char* expect;
+    int failures;
+} reader;
+
+static void* reader_run(void* arg) {
+    reader* r = (reader*)arg;
+    char key[16];
+    char* json;
+    size_t i, length;
+    int round, n;
+    json_pointer p;
+    const json_value* e;
+
+    for (round = 0; round < 50; round++) {
+        for (i = 0; i < 64; i++) {
+            n = sprintf(key, "k%zu", (i * 7 + round) % 64);
+            e = json_find_object_value(r->v, key, n);
+            if (e == NULL || json_get_number(json_get_array_element(e, 0)) != (double)((i * 7 + round) % 64))
+                r->failures++;
+        }
+        if (json_find_object_value(r->v, "missing", 7) != NULL)
+            r->failures++;
+        json_pointer_compile(&p, "/k63/1/s", 8);
+        if ((e = json_pointer_get(&p, r->v)) == NULL || strcmp(json_get_string(e), "x63") != 0)
+            r->failures++;
+        json_pointer_free(&p);
+        json_stringify(r->v, &json, &length);
+        if (length != strlen(r->expect) || memcmp(json, r->expect, length) != 0)
+            r->failures++;
+        free(json);
+    }
+    return NULL;
+}
+
+static void test_concurrent_read() {
+    pthread_t threads[READERS];
+    reader r[READERS];
+    json_value v;
+    char* json;
+    char* expect;
+    size_t i, len, length;
+    int shared, t;
+
+    json = malloc(64 * 32);
+    len = sprintf(json, "{");
+    for (i = 0; i < 64; i++)
+        len += sprintf(json + len, "%s\"k%zu\":[%zu,{\"s\":\"x%zu\"}]", i > 0 ? "," : "", i, i, i);
+    strcpy(json + len, "}");
+
+    /* a private tree, then a shared one whose index the readers race to build */
+    for (shared = 0; shared <= 1; shared++) {
+        json_init(&v);
+        EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, json));
+        if (shared)
+            json_share(&v);
+        EXPECT_EQ_INT(JSON_STRINGIFY_OK, json_stringify(&v, &expect, &length));
+        for (t = 0; t < READERS; t++) {
+            r[t].v = &v;
+            r[t].expect = expect;
+            r[t].failures = 0;
+            pthread_create(&threads[t], NULL, reader_run, &r[t]);
+        }
+        for (t = 0; t < READERS; t++) {
+            pthread_join(threads[t], NULL);
+            EXPECT_EQ_INT(0, r[t].failures);
+        }
+        free(expect);
+        json_free(&v);
+    }
+    free(json);
+}
+
+static void test_stats() {
+    json_stats st;
+    json_value v;
+
+    json_stats_reset();
+    json_init(&v);
+    EXPECT_EQ_INT(JSON_PARSE_OK, json_parse(&v, "[1, \"a\", [null, {\"k\": true}]]"));
+    json_free(&v);
+    json_stats_get(&st);
+#ifdef JSON_ENABLE_STATS
+    EXPECT_EQ_SIZE_T(4, st.max_depth);
+    EXPECT_EQ_SIZE_T(1, st.nodes[JSON_NULL]);
+    EXPECT_EQ_SIZE_T(1, st.nodes[JSON_TRUE]);
+    EXPECT_EQ_SIZE_T(1, st.nodes[JSON_NUMBER]);
+    EXPECT_EQ_SIZE_T(1, st.nodes[JSON_STRING]);
+    EXPECT_EQ_SIZE_T(2, st.nodes[JSON_ARRAY]);
+    EXPECT_EQ_SIZE_T(1, st.nodes[JSON_OBJECT]);
+    EXPECT_TRUE(st.allocs > 0);
+    EXPECT_EQ_SIZE_T(st.allocs, st.frees);
+    EXPECT_TRUE(st.cycles[JSON_PHASE_PARSE] > 0);
+#else
+    EXPECT_EQ_SIZE_T(0, st.allocs);
+    EXPECT_EQ_SIZE_T(0, st.max_depth);
+#endif
 }
 
 int main() {
     test_parse();
+    test_validate();
+    test_parse_opts();
     test_access();
     test_stringify();
+    test_stringify_canonical();
+    test_pointer();
+    test_projection();
+    test_query();
+    test_parse_parallel();
+    test_stringify_parallel();
+    test_allocator();
+    test_parse_fixed();
+    test_parser();
+    test_free();
+    test_binary();
+    test_msgpack();
+    test_cbor();
+    test_share();
+    test_concurrent_read();
+    test_merge_patch();
+    test_json_patch();
+    test_decode_struct();
+    test_encode_struct();
+    test_stats();
     printf("%d/%d (%3.2f%%) passed\n", test_pass, test_count, test_pass * 100.0 / test_count);
     return main_ret;
 }